@@ -0,0 +1,246 @@
+/*
+ ============================================================================
+ Name        : hev-dns-bench.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : UDP DNS load generator
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_IDS		(65536)
+#define BATCH_SIZE	(64)
+/* answers later than this are lost */
+#define TIMEOUT		(2 * 1000000000ULL)
+
+static void
+usage (const char *app)
+{
+	printf ("\
+usage: %s [-h] [-s SERVER] [-p PORT] [-q QPS] [-d SECONDS] [-r NAMES]\n\
+Send UDP DNS queries at a fixed rate and report the latency.\n\
+\n\
+  -s SERVER             forwarder address, default: 127.0.0.1\n\
+  -p PORT               forwarder port, default: 5300\n\
+  -q QPS                queries per second, default: 10000\n\
+  -d SECONDS            duration of the run, default: 10\n\
+  -r NAMES              distinct names asked, default: 1000000\n\
+  -h                    show this help message and exit\n", app);
+}
+
+static uint64_t
+get_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t
+build_query (uint8_t *msg, uint16_t id, unsigned long name)
+{
+	size_t len;
+
+	memset (msg, 0, 12);
+	msg[0] = id >> 8;
+	msg[1] = id & 0xff;
+	/* rd, one question */
+	msg[2] = 0x01;
+	msg[5] = 1;
+	len = 12 + sprintf ((char *) msg + 13, "n%lu", name) + 1;
+	msg[12] = len - 13;
+	len += sprintf ((char *) msg + len, "%cbench", 5);
+	msg[len ++] = 0;
+	/* A, IN */
+	msg[len ++] = 0;
+	msg[len ++] = 1;
+	msg[len ++] = 0;
+	msg[len ++] = 1;
+
+	return len;
+}
+
+static int
+compare_u32 (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile (uint32_t *samples, size_t count, double p)
+{
+	size_t index;
+
+	if (0 == count)
+	  return 0;
+	index = (size_t) (p * (count - 1));
+
+	return samples[index] / 1000.0;
+}
+
+int
+main (int argc, char **argv)
+{
+	struct addrinfo hints, *addr_ip;
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovecs[BATCH_SIZE];
+	uint8_t buffers[BATCH_SIZE][512];
+	const char *server = "127.0.0.1";
+	const char *port = "5300";
+	unsigned long qps = 10000, seconds = 10, names = 1000000;
+	unsigned long sent = 0, received = 0, lost = 0, stray = 0, max_samples;
+	uint64_t *send_times;
+	uint32_t *samples;
+	uint64_t start, end, next, now, interval;
+	uint16_t id = 0;
+	int i, ch, r, fd;
+
+	while ((ch = getopt(argc, argv, "hs:p:q:d:r:")) != -1) {
+		switch (ch) {
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+			case 's':
+				server = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'q':
+				qps = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				seconds = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				names = strtoul(optarg, NULL, 10);
+				break;
+		}
+	}
+	if ((0 == qps) || (0 == seconds) || (0 == names)) {
+		usage (argv[0]);
+		return 1;
+	}
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (0 != (r = getaddrinfo (server, port, &hints, &addr_ip))) {
+		fprintf (stderr, "%s:%s:%s\n", gai_strerror (r), server, port);
+		return 1;
+	}
+	fd = socket (addr_ip->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if ((0 > fd) || (0 != connect (fd, addr_ip->ai_addr, addr_ip->ai_addrlen))) {
+		fprintf (stderr, "Can't connect to %s:%s\n", server, port);
+		return 1;
+	}
+	freeaddrinfo (addr_ip);
+	r = 8 * 1024 * 1024;
+	setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &r, sizeof (r));
+
+	/* send time of each id in flight, 0 when free */
+	send_times = calloc (MAX_IDS, sizeof (uint64_t));
+	max_samples = qps * seconds;
+	samples = malloc (sizeof (uint32_t) * max_samples);
+	if (!send_times || !samples)
+	  return 1;
+	memset (msgs, 0, sizeof (msgs));
+	for (i=0; i<BATCH_SIZE; i++) {
+		iovecs[i].iov_base = buffers[i];
+		iovecs[i].iov_len = sizeof (buffers[i]);
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	interval = 1000000000ULL / qps;
+	start = get_time ();
+	end = start + seconds * 1000000000ULL;
+	next = start;
+	srandom (start);
+
+	for (now=start; now<(end + TIMEOUT); now=get_time ()) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int count, timeout;
+
+		/* catch up with the schedule, one batch at most */
+		for (count=0; (now < end) && (next <= now) && (count < BATCH_SIZE); count++) {
+			uint8_t msg[512];
+			size_t len;
+
+			if (send_times[id])
+			  lost ++;
+			len = build_query (msg, id, random () % names);
+			send_times[id] = get_time ();
+			if (0 > send (fd, msg, len, 0))
+			  send_times[id] = 0;
+			else
+			  sent ++;
+			id ++;
+			next += interval;
+		}
+
+		timeout = 0;
+		if ((now >= end) || (next > now))
+		  timeout = (now >= end) ? 10 : (int) ((next - now) / 1000000);
+		if (0 >= poll (&pfd, 1, timeout))
+		  continue;
+
+		count = recvmmsg (fd, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+		now = get_time ();
+		for (i=0; i<count; i++) {
+			uint8_t *msg = buffers[i];
+			uint16_t rid;
+
+			if (12 > msgs[i].msg_len)
+			  continue;
+			rid = (msg[0] << 8) | msg[1];
+			if (!send_times[rid]) {
+				stray ++;
+				continue;
+			}
+			if (received < max_samples)
+			  samples[received] = (now - send_times[rid]) / 1000;
+			received ++;
+			send_times[rid] = 0;
+		}
+	}
+	for (i=0; i<MAX_IDS; i++) {
+		if (send_times[i])
+		  lost ++;
+	}
+
+	if (received > max_samples)
+	  received = max_samples;
+	qsort (samples, received, sizeof (uint32_t), compare_u32);
+	printf ("sent %lu, received %lu, lost %lu, stray %lu\n",
+				sent, received, lost, stray);
+	printf ("throughput %.1f qps\n", received / (double) seconds);
+	printf ("latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+				percentile (samples, received, 0.50),
+				percentile (samples, received, 0.99),
+				percentile (samples, received, 0.999),
+				percentile (samples, received, 1.0));
+
+	free (samples);
+	free (send_times);
+	close (fd);
+
+	return 0;
+}
+
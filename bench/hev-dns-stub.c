@@ -0,0 +1,373 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stub.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : Stub TCP DNS upstream for benchmarks
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS	(256)
+#define BUFFER_SIZE	(64 * 1024)
+#define ANSWER_SIZE	(16)
+
+typedef struct _Conn Conn;
+typedef struct _Reply Reply;
+
+struct _Conn
+{
+	int fd;
+	size_t in_len;
+	size_t out_len;
+	size_t out_off;
+	unsigned int refs;
+	/* the epoll registration holds a reference until released */
+	bool registered;
+	uint8_t in[BUFFER_SIZE];
+	uint8_t out[BUFFER_SIZE];
+};
+
+/* delayed replies, due in order because the delay is fixed */
+struct _Reply
+{
+	Reply *next;
+	uint64_t due;
+	Conn *conn;
+	size_t len;
+	uint8_t msg[];
+};
+
+static unsigned int delay = 0;
+static unsigned int ttl = 0;
+static unsigned long answered = 0;
+static Reply *reply_head = NULL;
+static Reply *reply_tail = NULL;
+
+static void
+usage (const char *app)
+{
+	printf ("\
+usage: %s [-h] [-b BIND_ADDR] [-p BIND_PORT] [-d DELAY] [-t TTL]\n\
+Stub TCP DNS server answering every question with one A record.\n\
+\n\
+  -b BIND_ADDR          address that listens, default: 127.0.0.1\n\
+  -p BIND_PORT          port that listens, default: 5353\n\
+  -d DELAY              ms before each answer is sent, default: 0\n\
+  -t TTL                ttl of the answers, default: 0 (not cached)\n\
+  -h                    show this help message and exit\n", app);
+}
+
+static uint64_t
+get_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+conn_unref (Conn *conn)
+{
+	conn->refs --;
+	if (0 == conn->refs)
+	  free (conn);
+}
+
+static void
+conn_close (int epoll_fd, Conn *conn)
+{
+	if (-1 < conn->fd) {
+		epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close (conn->fd);
+		conn->fd = -1;
+	}
+}
+
+static void
+conn_release (Conn *conn)
+{
+	if ((-1 == conn->fd) && conn->registered) {
+		conn->registered = false;
+		conn_unref (conn);
+	}
+}
+
+static void
+conn_flush (int epoll_fd, Conn *conn)
+{
+	while (conn->out_off < conn->out_len) {
+		ssize_t size = write (conn->fd, conn->out + conn->out_off,
+					conn->out_len - conn->out_off);
+		if (0 > size) {
+			if (EAGAIN != errno)
+			  conn_close (epoll_fd, conn);
+			return;
+		}
+		conn->out_off += size;
+	}
+	conn->out_off = 0;
+	conn->out_len = 0;
+}
+
+static void
+conn_send (int epoll_fd, Conn *conn, const uint8_t *msg, size_t len)
+{
+	if (-1 == conn->fd)
+	  return;
+
+	/* the client reads slower than we answer, drop */
+	if ((conn->out_len + len + 2) > BUFFER_SIZE) {
+		conn_flush (epoll_fd, conn);
+		if ((-1 == conn->fd) || ((conn->out_len + len + 2) > BUFFER_SIZE))
+		  return;
+	}
+	conn->out[conn->out_len ++] = len >> 8;
+	conn->out[conn->out_len ++] = len & 0xff;
+	memcpy (conn->out + conn->out_len, msg, len);
+	conn->out_len += len;
+	answered ++;
+}
+
+static ssize_t
+build_answer (const uint8_t *query, size_t len, uint8_t *msg)
+{
+	size_t offset = 12;
+
+	if ((12 > len) || ((len + ANSWER_SIZE) > 1024))
+	  return -1;
+
+	/* skip qname and qtype/qclass */
+	while ((offset < len) && (0 != query[offset]))
+	  offset += query[offset] + 1;
+	offset += 5;
+	if (offset > len)
+	  return -1;
+
+	memcpy (msg, query, offset);
+	msg[2] = 0x81;
+	msg[3] = 0x80;
+	msg[6] = 0;
+	msg[7] = 1;
+	msg[8] = msg[9] = msg[10] = msg[11] = 0;
+	/* name pointer, A, IN, ttl, 127.0.0.1 */
+	msg[offset + 0] = 0xc0;
+	msg[offset + 1] = 0x0c;
+	msg[offset + 2] = 0;
+	msg[offset + 3] = 1;
+	msg[offset + 4] = 0;
+	msg[offset + 5] = 1;
+	msg[offset + 6] = ttl >> 24;
+	msg[offset + 7] = (ttl >> 16) & 0xff;
+	msg[offset + 8] = (ttl >> 8) & 0xff;
+	msg[offset + 9] = ttl & 0xff;
+	msg[offset + 10] = 0;
+	msg[offset + 11] = 4;
+	msg[offset + 12] = 127;
+	msg[offset + 13] = 0;
+	msg[offset + 14] = 0;
+	msg[offset + 15] = 1;
+
+	return offset + ANSWER_SIZE;
+}
+
+static void
+handle_query (int epoll_fd, Conn *conn, const uint8_t *query, size_t len)
+{
+	uint8_t msg[1024];
+	ssize_t size;
+	Reply *reply;
+
+	size = build_answer (query, len, msg);
+	if (0 > size)
+	  return;
+	if (0 == delay) {
+		conn_send (epoll_fd, conn, msg, size);
+		return;
+	}
+
+	reply = malloc (sizeof (Reply) + size);
+	if (!reply)
+	  return;
+	reply->next = NULL;
+	reply->due = get_time () + delay;
+	reply->conn = conn;
+	reply->len = size;
+	memcpy (reply->msg, msg, size);
+	conn->refs ++;
+	if (reply_tail)
+	  reply_tail->next = reply;
+	else
+	  reply_head = reply;
+	reply_tail = reply;
+}
+
+static void
+conn_read (int epoll_fd, Conn *conn)
+{
+	for (;;) {
+		size_t offset = 0;
+		ssize_t size;
+
+		size = read (conn->fd, conn->in + conn->in_len, BUFFER_SIZE - conn->in_len);
+		if (0 >= size) {
+			if ((0 == size) || (EAGAIN != errno))
+			  conn_close (epoll_fd, conn);
+			break;
+		}
+		conn->in_len += size;
+
+		while ((offset + 2) <= conn->in_len) {
+			size_t len = (conn->in[offset] << 8) | conn->in[offset + 1];
+
+			if ((offset + 2 + len) > conn->in_len)
+			  break;
+			handle_query (epoll_fd, conn, conn->in + offset + 2, len);
+			offset += 2 + len;
+		}
+		memmove (conn->in, conn->in + offset, conn->in_len - offset);
+		conn->in_len -= offset;
+	}
+}
+
+static int
+send_due_replies (int epoll_fd)
+{
+	uint64_t now = get_time ();
+
+	while (reply_head && (reply_head->due <= now)) {
+		Reply *reply = reply_head;
+
+		reply_head = reply->next;
+		if (!reply_head)
+		  reply_tail = NULL;
+		conn_send (epoll_fd, reply->conn, reply->msg, reply->len);
+		if (-1 < reply->conn->fd)
+		  conn_flush (epoll_fd, reply->conn);
+		conn_release (reply->conn);
+		conn_unref (reply->conn);
+		free (reply);
+	}
+
+	return reply_head ? (int) (reply_head->due - now) : 1000;
+}
+
+static void
+signal_handler (int signo)
+{
+	fprintf (stderr, "answered %lu\n", answered);
+	exit (0);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct epoll_event event, events[MAX_EVENTS];
+	struct addrinfo hints, *addr_ip;
+	const char *addr = "127.0.0.1";
+	const char *port = "5353";
+	int ch, r, listen_fd, epoll_fd, timeout = 1000, reuseaddr = 1;
+
+	while ((ch = getopt(argc, argv, "hb:p:d:t:")) != -1) {
+		switch (ch) {
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+			case 'b':
+				addr = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'd':
+				delay = atoi(optarg);
+				break;
+			case 't':
+				ttl = atoi(optarg);
+				break;
+		}
+	}
+
+	signal (SIGPIPE, SIG_IGN);
+	signal (SIGINT, signal_handler);
+	signal (SIGTERM, signal_handler);
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (0 != (r = getaddrinfo (addr, port, &hints, &addr_ip))) {
+		fprintf (stderr, "%s:%s:%s\n", gai_strerror (r), addr, port);
+		return 1;
+	}
+	listen_fd = socket (addr_ip->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
+	if ((0 > listen_fd) || (0 != bind (listen_fd, addr_ip->ai_addr, addr_ip->ai_addrlen)) ||
+				(0 != listen (listen_fd, 128))) {
+		fprintf (stderr, "Can't bind address %s:%s\n", addr, port);
+		return 1;
+	}
+	freeaddrinfo (addr_ip);
+
+	epoll_fd = epoll_create (1024);
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl (epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+	for (;;) {
+		int i, nfds;
+
+		nfds = epoll_wait (epoll_fd, events, MAX_EVENTS, timeout);
+		for (i=0; i<nfds; i++) {
+			Conn *conn = events[i].data.ptr;
+
+			if (!conn) {
+				int fd, nodelay = 1;
+
+				while (0 <= (fd = accept4 (listen_fd, NULL, NULL, SOCK_NONBLOCK))) {
+					conn = malloc (sizeof (Conn));
+					if (!conn) {
+						close (fd);
+						continue;
+					}
+					setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));
+					conn->fd = fd;
+					conn->in_len = 0;
+					conn->out_len = 0;
+					conn->out_off = 0;
+					conn->refs = 1;
+					conn->registered = true;
+					event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+					event.data.ptr = conn;
+					epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event);
+				}
+				continue;
+			}
+			if (EPOLLIN & events[i].events)
+			  conn_read (epoll_fd, conn);
+			if (-1 < conn->fd)
+			  conn_flush (epoll_fd, conn);
+			conn_release (conn);
+		}
+		timeout = send_due_replies (epoll_fd);
+	}
+
+	return 0;
+}
+
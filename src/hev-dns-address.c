@@ -0,0 +1,78 @@
+/*
+ ============================================================================
+ Name        : hev-dns-address.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : Socket address helpers
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "hev-dns-address.h"
+
+bool
+hev_dns_address_parse (const char *str, const char *default_port,
+			struct sockaddr_storage *addr)
+{
+	char host[INET6_ADDRSTRLEN];
+	const char *port = default_port;
+	const char *end;
+	size_t len;
+	int port_num;
+
+	if (!str || !addr)
+	  return false;
+
+	/* ADDR, ADDR:PORT, ADDR#PORT, [ADDR6]:PORT or a bare ADDR6 */
+	if ('[' == str[0]) {
+		str ++;
+		end = strchr (str, ']');
+		if (!end)
+		  return false;
+		if (('\0' != end[1]) && (':' != end[1]) && ('#' != end[1]))
+		  return false;
+		if ('\0' != end[1])
+		  port = end + 2;
+	} else {
+		end = strchr (str, '#');
+		if (!end) {
+			end = strchr (str, ':');
+			/* more than one colon, an ipv6 address without port */
+			if (end && strchr (end + 1, ':'))
+			  end = NULL;
+		}
+		if (end)
+		  port = end + 1;
+		else
+		  end = str + strlen (str);
+	}
+
+	len = end - str;
+	if ((0 == len) || (sizeof (host) <= len))
+	  return false;
+	memcpy (host, str, len);
+	host[len] = '\0';
+
+	port_num = atoi (port);
+	if ((0 >= port_num) || (65535 < port_num))
+	  return false;
+
+	memset (addr, 0, sizeof (struct sockaddr_storage));
+	if (strchr (host, ':')) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) addr;
+
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons (port_num);
+		return 1 == inet_pton (AF_INET6, host, &addr6->sin6_addr);
+	} else {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *) addr;
+
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons (port_num);
+		return 1 == inet_pton (AF_INET, host, &addr4->sin_addr);
+	}
+}
+
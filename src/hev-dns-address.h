@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : hev-dns-address.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : Socket address helpers
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_ADDRESS_H__
+#define __HEV_DNS_ADDRESS_H__
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+static inline socklen_t
+hev_dns_address_get_len (const struct sockaddr_storage *addr)
+{
+	return (AF_INET6 == addr->ss_family) ?
+		sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+}
+
+bool hev_dns_address_parse (const char *str, const char *default_port,
+			struct sockaddr_storage *addr);
+
+#endif /* __HEV_DNS_ADDRESS_H__ */
+
@@ -0,0 +1,971 @@
+/*
+ ============================================================================
+ Name        : hev-dns-cache.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS response cache
+ ============================================================================
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hev-dns-cache.h"
+#include "hev-dns-message.h"
+#include "hev-dns-stats.h"
+#include "hev-memory-allocator.h"
+
+#define MAX_TTLS	(256)
+#define MAX_TTL		(24 * 3600)
+/* rfc 2308 caps negative answers, and servfail is held only briefly */
+#define MAX_NEGATIVE_TTL	(3 * 3600)
+#define SERVFAIL_TTL	(5)
+/* rfc 8767: expired answers kept a day, handed out with a short ttl */
+#define MAX_STALE	(24 * 3600 * 1000)
+#define STALE_TTL	(30)
+/* hits that make an entry worth refreshing, in its last percent of ttl */
+#define PREFETCH_HITS	(8)
+#define PREFETCH_PERCENT	(10)
+#define PREFETCH_QUEUE	(64)
+
+/* writers lock one stripe, each an arena the entries are logged into */
+#define CACHE_LINE	(64)
+#define MAX_STRIPES	(64)
+#define MIN_STRIPE_SIZE	(256 * 1024)
+/* bytes of arena per hash bucket */
+#define BUCKET_BYTES	(128)
+/* a chain longer than this is being rewritten under the reader */
+#define MAX_CHAIN	(64)
+/* hot records moved on per insert before the new one is refused */
+#define MAX_ROTATIONS	(8)
+
+/* recent lookups per key, hit or not, approximate, halved as they add up */
+#define SKETCH_SIZE	(1 << 16)
+#define SKETCH_DEPTH	(4)
+#define SKETCH_PERIOD	(SKETCH_SIZE * 4)
+
+/* snapshot file, host byte order, records 8-byte aligned for mmap */
+#define FILE_MAGIC	"HEVDNSC"
+#define FILE_VERSION	(2)
+#define ALIGN(n)	(((n) + 7) & ~(size_t) 7)
+
+#define load_acquire(p)		__atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define load_relaxed(p)		__atomic_load_n (p, __ATOMIC_RELAXED)
+#define store_release(p, v)	__atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define store_relaxed(p, v)	__atomic_store_n (p, v, __ATOMIC_RELAXED)
+
+typedef struct _HevDNSCacheEntry HevDNSCacheEntry;
+typedef struct _HevDNSCacheStripe HevDNSCacheStripe;
+typedef struct _HevDNSCacheFileHeader HevDNSCacheFileHeader;
+typedef struct _HevDNSCacheFileEntry HevDNSCacheFileEntry;
+
+/* a record in a stripe's arena, followed by ttl offsets, key and message */
+struct _HevDNSCacheEntry
+{
+	/* hash chain, arena offset + 1, 0 ends it */
+	uint32_t next;
+	uint32_t size;
+	uint32_t hash;
+	uint16_t key_len;
+	uint16_t msg_len;
+	uint16_t ttl_count;
+	uint8_t live;
+	uint8_t prefetch;
+	int64_t time;
+	int64_t expire;
+};
+
+/* entries are appended at the tail and the oldest fall off the head,
+ * readers copy out and retry if seq moved, arena memory is never freed */
+struct _HevDNSCacheStripe
+{
+	/* odd while a writer is in */
+	unsigned int seq;
+	unsigned int count;
+	unsigned int records;
+	uint32_t head;
+	uint32_t tail;
+	/* end of the records at the head once the tail has gone round */
+	uint32_t wrap;
+	bool wrapped;
+	pthread_mutex_t lock;
+	uint32_t *buckets;
+	uint8_t *arena;
+} __attribute__ ((aligned (CACHE_LINE)));
+
+/* times in wall clock ms, followed by ttls, key and message */
+struct _HevDNSCacheFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	int64_t time;
+};
+
+struct _HevDNSCacheFileEntry
+{
+	int64_t time;
+	int64_t expire;
+	uint16_t key_len;
+	uint16_t msg_len;
+	uint16_t ttl_count;
+	uint16_t reserved;
+};
+
+struct _HevDNSCache
+{
+	unsigned int ref_count;
+	unsigned int stripe_count;
+	unsigned int stripe_shift;
+	unsigned int bucket_mask;
+	uint32_t stripe_size;
+	HevDNSCacheStripe *stripes;
+
+	uint8_t sketch[SKETCH_SIZE];
+	unsigned int sketch_adds;
+
+	/* keys of hot entries about to expire, oldest first */
+	pthread_mutex_t prefetch_lock;
+	unsigned int prefetch_head;
+	unsigned int prefetch_count;
+	uint16_t prefetch_lens[PREFETCH_QUEUE];
+	uint8_t prefetch_keys[PREFETCH_QUEUE][HEV_DNS_MAX_KEY_SIZE];
+};
+
+HevDNSCache *
+hev_dns_cache_new (size_t size)
+{
+	HevDNSCache *self;
+	size_t stripes, stripes_size;
+	unsigned int i, buckets = 1;
+
+	self = hev_malloc0 (sizeof (HevDNSCache));
+	if (!self)
+	  return NULL;
+
+	/* the sketch and the stripes come out of the budget first */
+	stripes_size = sizeof (HevDNSCache) + sizeof (HevDNSCacheStripe) * MAX_STRIPES;
+	size = (size > stripes_size) ? (size - stripes_size) : 0;
+	/* as many stripes as the budget fills to the minimum, a power of two
+	 * for the hash split, so the total never goes over it */
+	stripes = size / MIN_STRIPE_SIZE;
+	if (MAX_STRIPES < stripes)
+	  stripes = MAX_STRIPES;
+	self->stripe_count = 1;
+	self->stripe_shift = 32;
+	while ((self->stripe_count * 2) <= stripes) {
+		self->stripe_count <<= 1;
+		self->stripe_shift --;
+	}
+	/* the budget pays for the buckets too, the arenas get the rest */
+	self->stripe_size = size / self->stripe_count;
+	while ((buckets * 2 * (BUCKET_BYTES + sizeof (uint32_t))) <= self->stripe_size)
+	  buckets <<= 1;
+	self->stripe_size -= buckets * sizeof (uint32_t);
+	self->bucket_mask = buckets - 1;
+
+	/* on cache lines of their own, the allocator does not align that far */
+	stripes_size = sizeof (HevDNSCacheStripe) * self->stripe_count;
+	stripes_size = (stripes_size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+	self->stripes = aligned_alloc (CACHE_LINE, stripes_size);
+	if (!self->stripes) {
+		hev_free (self);
+		return NULL;
+	}
+	memset (self->stripes, 0, stripes_size);
+	for (i=0; i<self->stripe_count; i++) {
+		HevDNSCacheStripe *stripe = &self->stripes[i];
+
+		pthread_mutex_init (&stripe->lock, NULL);
+		stripe->buckets = hev_malloc0 (sizeof (uint32_t) * buckets);
+		/* touched as it fills */
+		stripe->arena = hev_malloc (self->stripe_size);
+		if (!stripe->buckets || !stripe->arena) {
+			self->ref_count = 1;
+			hev_dns_cache_unref (self);
+			return NULL;
+		}
+	}
+	pthread_mutex_init (&self->prefetch_lock, NULL);
+	self->ref_count = 1;
+
+	return self;
+}
+
+HevDNSCache *
+hev_dns_cache_ref (HevDNSCache *self)
+{
+	if (self)
+	  __atomic_add_fetch (&self->ref_count, 1, __ATOMIC_RELAXED);
+
+	return self;
+}
+
+void
+hev_dns_cache_unref (HevDNSCache *self)
+{
+	unsigned int i;
+
+	/* sessions of every worker hold it */
+	if (!self || (0 != __atomic_sub_fetch (&self->ref_count, 1, __ATOMIC_ACQ_REL)))
+	  return;
+
+	for (i=0; i<self->stripe_count; i++) {
+		pthread_mutex_destroy (&self->stripes[i].lock);
+		hev_free (self->stripes[i].buckets);
+		hev_free (self->stripes[i].arena);
+	}
+	pthread_mutex_destroy (&self->prefetch_lock);
+	free (self->stripes);
+	hev_free (self);
+}
+
+static int64_t
+get_clock (clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime (clock, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t
+get_time (void)
+{
+	return get_clock (CLOCK_MONOTONIC);
+}
+
+static bool
+is_servfail (const uint8_t *msg)
+{
+	return HEV_DNS_RCODE_SERVFAIL == (HEV_DNS_RCODE_MASK & hev_dns_message_get_flags (msg));
+}
+
+static inline HevDNSCacheStripe *
+get_stripe (HevDNSCache *self, uint32_t hash)
+{
+	return &self->stripes[(1 < self->stripe_count) ? (hash >> self->stripe_shift) : 0];
+}
+
+static inline HevDNSCacheEntry *
+get_entry (HevDNSCacheStripe *stripe, uint32_t ref)
+{
+	return (HevDNSCacheEntry *) (stripe->arena + ref - 1);
+}
+
+static inline uint16_t *
+entry_ttls (HevDNSCacheEntry *entry)
+{
+	return (uint16_t *) (entry + 1);
+}
+
+static inline uint8_t *
+entry_key (HevDNSCacheEntry *entry)
+{
+	return (uint8_t *) (entry_ttls (entry) + entry->ttl_count);
+}
+
+static inline uint8_t *
+entry_msg (HevDNSCacheEntry *entry)
+{
+	return entry_key (entry) + entry->key_len;
+}
+
+static inline size_t
+entry_size (size_t key_len, size_t msg_len, unsigned int ttl_count)
+{
+	return ALIGN (sizeof (HevDNSCacheEntry) + sizeof (uint16_t) * ttl_count +
+				key_len + msg_len);
+}
+
+static void
+write_begin (HevDNSCacheStripe *stripe)
+{
+	store_relaxed (&stripe->seq, stripe->seq + 1);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void
+write_end (HevDNSCacheStripe *stripe)
+{
+	store_release (&stripe->seq, stripe->seq + 1);
+}
+
+/* under the stripe lock */
+static uint32_t *
+find_link (HevDNSCache *self, HevDNSCacheStripe *stripe, const uint8_t *key,
+			size_t key_len, uint32_t hash)
+{
+	uint32_t *link = &stripe->buckets[hash & self->bucket_mask];
+
+	for (; *link; link=&get_entry (stripe, *link)->next) {
+		HevDNSCacheEntry *entry = get_entry (stripe, *link);
+		if ((entry->hash == hash) && (entry->key_len == key_len) &&
+					(0 == memcmp (entry_key (entry), key, key_len)))
+		  break;
+	}
+
+	return link;
+}
+
+static void
+unlink_entry (HevDNSCacheStripe *stripe, uint32_t *link)
+{
+	HevDNSCacheEntry *entry = get_entry (stripe, *link);
+
+	store_relaxed (link, entry->next);
+	entry->live = 0;
+	stripe->count --;
+}
+
+static void
+remove_oldest (HevDNSCache *self, HevDNSCacheStripe *stripe)
+{
+	HevDNSCacheEntry *entry = (HevDNSCacheEntry *) (stripe->arena + stripe->head);
+	uint32_t ref = stripe->head + 1;
+
+	if (entry->live) {
+		uint32_t *link = &stripe->buckets[entry->hash & self->bucket_mask];
+
+		while (*link != ref)
+		  link = &get_entry (stripe, *link)->next;
+		unlink_entry (stripe, link);
+	}
+	stripe->head += entry->size;
+	stripe->records --;
+	if (stripe->wrapped && (stripe->head == stripe->wrap)) {
+		stripe->head = 0;
+		stripe->wrapped = false;
+	}
+}
+
+static unsigned int
+sketch_index (uint32_t hash, unsigned int row)
+{
+	static const uint32_t seeds[SKETCH_DEPTH] =
+	{
+		0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f,
+	};
+
+	return (hash * seeds[row]) >> (32 - 16);
+}
+
+static unsigned int
+sketch_estimate (HevDNSCache *self, uint32_t hash)
+{
+	unsigned int i, min = UINT8_MAX;
+
+	for (i=0; i<SKETCH_DEPTH; i++) {
+		uint8_t value = load_relaxed (&self->sketch[sketch_index (hash, i)]);
+
+		if (value < min)
+		  min = value;
+	}
+
+	return min;
+}
+
+/* under the stripe lock, with the tail gone round behind the head */
+static void
+rotate_oldest (HevDNSCache *self, HevDNSCacheStripe *stripe)
+{
+	HevDNSCacheEntry *entry = (HevDNSCacheEntry *) (stripe->arena + stripe->head);
+	uint32_t *link, ref = stripe->head + 1, size = entry->size;
+
+	link = &stripe->buckets[entry->hash & self->bucket_mask];
+	while (*link != ref)
+	  link = &get_entry (stripe, *link)->next;
+	/* may overlap when the gap is smaller than the record */
+	memmove (stripe->arena + stripe->tail, entry, size);
+	store_relaxed (link, stripe->tail + 1);
+	stripe->tail += size;
+	stripe->head += size;
+	if (stripe->head == stripe->wrap) {
+		stripe->head = 0;
+		stripe->wrapped = false;
+	}
+}
+
+/* freq is how often the new key was asked for; the oldest answers asked
+ * more get a second round at the tail, a few at a time, and when those
+ * run out the new one is turned away, null then */
+static HevDNSCacheEntry *
+alloc_entry (HevDNSCache *self, HevDNSCacheStripe *stripe, uint32_t size,
+			unsigned int freq, int64_t now)
+{
+	HevDNSCacheEntry *oldest;
+	unsigned int rotations = 0;
+	uint32_t offset;
+
+	/* room at the tail, else go round and push the oldest out */
+	for (;;) {
+		if (0 == stripe->records) {
+			stripe->head = 0;
+			stripe->tail = 0;
+			stripe->wrapped = false;
+		}
+		if (!stripe->wrapped) {
+			if ((stripe->tail + size) <= self->stripe_size)
+			  break;
+			stripe->wrap = stripe->tail;
+			stripe->tail = 0;
+			stripe->wrapped = true;
+		}
+		if ((stripe->tail + size) <= stripe->head)
+		  break;
+		oldest = (HevDNSCacheEntry *) (stripe->arena + stripe->head);
+		if (oldest->live && (now < (oldest->expire + MAX_STALE))) {
+			if (freq < sketch_estimate (self, oldest->hash)) {
+				if (MAX_ROTATIONS <= rotations ++) {
+					hev_dns_stats_inc (HEV_DNS_STATS_CACHE_REJECTED);
+					return NULL;
+				}
+				rotate_oldest (self, stripe);
+				continue;
+			}
+			hev_dns_stats_inc (HEV_DNS_STATS_CACHE_EVICTIONS);
+		}
+		remove_oldest (self, stripe);
+	}
+
+	offset = stripe->tail;
+	stripe->tail += size;
+	stripe->records ++;
+
+	return (HevDNSCacheEntry *) (stripe->arena + offset);
+}
+
+static void
+store_entry (HevDNSCache *self, uint32_t hash, const uint8_t *key, size_t key_len,
+			const uint8_t *msg, size_t len, const uint16_t *ttls, unsigned int count,
+			int64_t time, int64_t expire, ssize_t soa, uint32_t soa_ttl)
+{
+	HevDNSCacheStripe *stripe = get_stripe (self, hash);
+	HevDNSCacheEntry *entry;
+	uint32_t *link, size;
+	unsigned int freq = UINT_MAX;
+	int64_t now = get_time ();
+
+	size = entry_size (key_len, len, count);
+	if ((self->stripe_size / 2) < size)
+	  return;
+
+	pthread_mutex_lock (&stripe->lock);
+	link = find_link (self, stripe, key, key_len, hash);
+	/* a failure leaves an answer that may still be served in place */
+	if (*link && is_servfail (msg)) {
+		entry = get_entry (stripe, *link);
+		if (!is_servfail (entry_msg (entry)) && (now < (entry->expire + MAX_STALE))) {
+			pthread_mutex_unlock (&stripe->lock);
+			return;
+		}
+	}
+
+	write_begin (stripe);
+	/* a key already in is always let back in, new ones must earn it */
+	if (*link)
+	  unlink_entry (stripe, link);
+	else
+	  freq = sketch_estimate (self, hash);
+	entry = alloc_entry (self, stripe, size, freq, now);
+	if (!entry) {
+		write_end (stripe);
+		pthread_mutex_unlock (&stripe->lock);
+		return;
+	}
+	entry->size = size;
+	entry->hash = hash;
+	entry->key_len = key_len;
+	entry->msg_len = len;
+	entry->ttl_count = count;
+	entry->live = 1;
+	entry->prefetch = 0;
+	entry->time = time;
+	entry->expire = expire;
+	memcpy (entry_ttls (entry), ttls, sizeof (uint16_t) * count);
+	memcpy (entry_key (entry), key, key_len);
+	memcpy (entry_msg (entry), msg, len);
+	/* the soa tells clients how long the negative answer lasts */
+	if (0 <= soa)
+	  hev_dns_message_set_u32 (entry_msg (entry) + soa, soa_ttl);
+
+	link = &stripe->buckets[hash & self->bucket_mask];
+	entry->next = *link;
+	store_relaxed (link, (uint32_t) ((uint8_t *) entry - stripe->arena) + 1);
+	stripe->count ++;
+	write_end (stripe);
+	pthread_mutex_unlock (&stripe->lock);
+}
+
+/* lock free, copies the entry out, msg takes up to size bytes and large
+ * the rest, both garbage unless true is returned */
+static bool
+read_entry (HevDNSCache *self, const uint8_t *key, size_t key_len, uint32_t hash,
+			HevDNSCacheEntry *header, uint16_t *ttls, uint8_t *msg, size_t size,
+			uint8_t *large)
+{
+	HevDNSCacheStripe *stripe = get_stripe (self, hash);
+
+	for (;;) {
+		unsigned int i, seq = load_acquire (&stripe->seq);
+		uint32_t ref;
+		bool found = false;
+
+		if (seq & 1)
+		  continue;
+
+		/* anything read may be torn by a writer, check before following */
+		ref = load_relaxed (&stripe->buckets[hash & self->bucket_mask]);
+		for (i=0; ref && (i<MAX_CHAIN); i++) {
+			HevDNSCacheEntry *entry;
+
+			if (((ref - 1) + sizeof (HevDNSCacheEntry)) > self->stripe_size)
+			  break;
+			entry = get_entry (stripe, ref);
+			memcpy (header, entry, sizeof (HevDNSCacheEntry));
+			if ((header->size > (self->stripe_size - (ref - 1))) ||
+						(MAX_TTLS < header->ttl_count) ||
+						(header->size < entry_size (header->key_len,
+										header->msg_len, header->ttl_count)))
+			  break;
+			if ((header->hash == hash) && (header->key_len == key_len) &&
+						(0 == memcmp ((uint8_t *) (entry + 1) +
+										sizeof (uint16_t) * header->ttl_count,
+										key, key_len))) {
+				memcpy (ttls, entry + 1, sizeof (uint16_t) * header->ttl_count);
+				memcpy ((header->msg_len > size) ? large : msg,
+							(uint8_t *) (entry + 1) + sizeof (uint16_t) * header->ttl_count +
+							key_len, header->msg_len);
+				found = true;
+				break;
+			}
+			ref = header->next;
+		}
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (load_relaxed (&stripe->seq) == seq)
+		  return found;
+	}
+}
+
+static unsigned int
+sketch_add (HevDNSCache *self, uint32_t hash)
+{
+	unsigned int i, min = UINT8_MAX;
+
+	/* racy increments, an estimate is all it is */
+	for (i=0; i<SKETCH_DEPTH; i++) {
+		uint8_t *counter = &self->sketch[sketch_index (hash, i)];
+		uint8_t value = load_relaxed (counter);
+
+		if (UINT8_MAX > value)
+		  store_relaxed (counter, ++ value);
+		if (value < min)
+		  min = value;
+	}
+
+	/* old hits count half */
+	if (SKETCH_PERIOD == __atomic_add_fetch (&self->sketch_adds, 1, __ATOMIC_RELAXED)) {
+		for (i=0; i<SKETCH_SIZE; i++)
+		  store_relaxed (&self->sketch[i], load_relaxed (&self->sketch[i]) >> 1);
+		store_relaxed (&self->sketch_adds, 0);
+	}
+
+	return min;
+}
+
+static void
+queue_prefetch (HevDNSCache *self, const uint8_t *key, size_t key_len, uint32_t hash)
+{
+	HevDNSCacheStripe *stripe = get_stripe (self, hash);
+	uint32_t *link;
+	bool queue = false;
+
+	/* once per entry, the refreshed answer replaces it */
+	pthread_mutex_lock (&stripe->lock);
+	link = find_link (self, stripe, key, key_len, hash);
+	if (*link && !get_entry (stripe, *link)->prefetch) {
+		get_entry (stripe, *link)->prefetch = 1;
+		queue = true;
+	}
+	pthread_mutex_unlock (&stripe->lock);
+	if (!queue)
+	  return;
+
+	pthread_mutex_lock (&self->prefetch_lock);
+	if (PREFETCH_QUEUE > self->prefetch_count) {
+		unsigned int index = (self->prefetch_head + self->prefetch_count) % PREFETCH_QUEUE;
+
+		memcpy (self->prefetch_keys[index], key, key_len);
+		self->prefetch_lens[index] = key_len;
+		store_relaxed (&self->prefetch_count, self->prefetch_count + 1);
+	}
+	pthread_mutex_unlock (&self->prefetch_lock);
+}
+
+static ssize_t
+dns_cache_lookup (HevDNSCache *self, const void *request, size_t len,
+			void *buffer, size_t size, bool stale)
+{
+	HevDNSCacheEntry header;
+	uint16_t ttls[MAX_TTLS];
+	uint8_t key[HEV_DNS_MAX_KEY_SIZE];
+	uint8_t large[UINT16_MAX];
+	uint8_t *msg = buffer;
+	ssize_t key_len, res;
+	uint32_t hash, elapsed;
+	unsigned int i, hits = 0;
+	int64_t now;
+
+	if (!self)
+	  return -1;
+
+	key_len = hev_dns_message_get_key (request, len, key);
+	if (0 > key_len)
+	  return -1;
+
+	/* misses count too, they decide what is let in */
+	hash = hev_dns_message_hash_key (key, key_len);
+	if (!stale)
+	  hits = sketch_add (self, hash);
+	if (!read_entry (self, key, key_len, hash, &header, ttls, msg, size, large))
+	  return -1;
+
+	/* expired ones stay for serving stale until the arena comes round */
+	now = get_time ();
+	if ((now >= (header.expire + MAX_STALE)) || (stale != (now >= header.expire)))
+	  return -1;
+	if (header.msg_len > size)
+	  msg = large;
+	if (stale && is_servfail (msg))
+	  return -1;
+	if (!stale && !header.prefetch && (PREFETCH_HITS <= hits) &&
+				((header.expire - now) * 100 <=
+				 (header.expire - header.time) * PREFETCH_PERCENT))
+	  queue_prefetch (self, key, key_len, hash);
+
+	hev_dns_message_set_id (msg, hev_dns_message_get_id (request));
+	/* echo the question as the client spelled it */
+	memcpy (msg + HEV_DNS_HEADER_SIZE, request + HEV_DNS_HEADER_SIZE,
+				hev_dns_message_get_key_question_len (key_len));
+	elapsed = (now - header.time) / 1000;
+	for (i=0; i<header.ttl_count; i++) {
+		uint8_t *ttl = msg + ttls[i];
+
+		if (stale)
+		  hev_dns_message_set_u32 (ttl, STALE_TTL);
+		else
+		  hev_dns_message_set_u32 (ttl, hev_dns_message_get_u32 (ttl) - elapsed);
+	}
+
+	/* the opt record as this client asked, in place while it fits */
+	res = -1;
+	if (msg == buffer)
+	  res = hev_dns_message_set_opt (msg, header.msg_len, request, len, buffer, size);
+	if (0 > res) {
+		if (msg == buffer)
+		  memcpy (large, buffer, header.msg_len);
+		res = hev_dns_message_set_opt (large, header.msg_len, request, len,
+					large, sizeof (large));
+		if (0 > res)
+		  return -1;
+		/* more than the client takes, a truncated reply tells it to use tcp */
+		if (res > size)
+		  return hev_dns_message_truncate (large, res, buffer, size);
+		memcpy (buffer, large, res);
+	}
+
+	return res;
+}
+
+ssize_t
+hev_dns_cache_lookup (HevDNSCache *self, const void *request, size_t len,
+			void *buffer, size_t size)
+{
+	return dns_cache_lookup (self, request, len, buffer, size, false);
+}
+
+ssize_t
+hev_dns_cache_lookup_stale (HevDNSCache *self, const void *request, size_t len,
+			void *buffer, size_t size)
+{
+	return dns_cache_lookup (self, request, len, buffer, size, true);
+}
+
+void
+hev_dns_cache_insert (HevDNSCache *self, const void *request, size_t request_len,
+			const void *response, size_t len)
+{
+	uint16_t ttls[MAX_TTLS];
+	uint8_t key[HEV_DNS_MAX_KEY_SIZE];
+	const uint8_t *msg = response;
+	uint16_t flags;
+	uint32_t min_ttl, negative_ttl = 0;
+	ssize_t key_len, soa = -1;
+	int64_t now;
+	int count;
+
+	if (!self || (HEV_DNS_HEADER_SIZE > len))
+	  return;
+
+	/* complete answers, negative ones while their soa allows */
+	flags = hev_dns_message_get_flags (msg);
+	if (!(HEV_DNS_FLAG_QR & flags) || (HEV_DNS_FLAG_TC & flags) ||
+				(HEV_DNS_OPCODE_MASK & flags))
+	  return;
+
+	/* under what was asked, an answer need not echo the edns bits */
+	if (!hev_dns_message_match_question (msg, len, request, request_len))
+	  return;
+	key_len = hev_dns_message_get_key (request, request_len, key);
+	if (0 > key_len)
+	  return;
+	count = hev_dns_message_find_ttls (msg, len, ttls, MAX_TTLS, &min_ttl);
+	if (0 > count)
+	  return;
+
+	switch (HEV_DNS_RCODE_MASK & flags) {
+	case HEV_DNS_RCODE_SERVFAIL:
+		if ((0 == count) || (SERVFAIL_TTL < min_ttl))
+		  min_ttl = SERVFAIL_TTL;
+		break;
+	case 0:
+		if (0 < hev_dns_message_get_u16 (msg + 6))
+		  break;
+		/* nodata, as nxdomain */
+	case HEV_DNS_RCODE_NXDOMAIN:
+		soa = hev_dns_message_find_soa (msg, len, &negative_ttl);
+		if (0 > soa)
+		  return;
+		if (MAX_NEGATIVE_TTL < negative_ttl)
+		  negative_ttl = MAX_NEGATIVE_TTL;
+		if (negative_ttl < min_ttl)
+		  min_ttl = negative_ttl;
+		break;
+	default:
+		return;
+	}
+	if (0 == min_ttl)
+	  return;
+	if (MAX_TTL < min_ttl)
+	  min_ttl = MAX_TTL;
+
+	now = get_time ();
+	store_entry (self, hev_dns_message_hash_key (key, key_len), key, key_len,
+				msg, len, ttls, count, now, now + (int64_t) min_ttl * 1000,
+				soa, negative_ttl);
+}
+
+unsigned int
+hev_dns_cache_get_prefetch_count (HevDNSCache *self)
+{
+	return self ? load_relaxed (&self->prefetch_count) : 0;
+}
+
+ssize_t
+hev_dns_cache_take_prefetch (HevDNSCache *self, uint8_t *key)
+{
+	unsigned int index;
+	ssize_t key_len = -1;
+
+	if (!self || (0 == load_relaxed (&self->prefetch_count)))
+	  return -1;
+
+	pthread_mutex_lock (&self->prefetch_lock);
+	if (0 < self->prefetch_count) {
+		index = self->prefetch_head;
+		key_len = self->prefetch_lens[index];
+		memcpy (key, self->prefetch_keys[index], key_len);
+		self->prefetch_head = (index + 1) % PREFETCH_QUEUE;
+		store_relaxed (&self->prefetch_count, self->prefetch_count - 1);
+	}
+	pthread_mutex_unlock (&self->prefetch_lock);
+
+	return key_len;
+}
+
+/* under the stripe lock, only copies, the buffer takes a whole arena */
+static size_t
+save_stripe (HevDNSCacheStripe *stripe, uint8_t *buffer, int64_t offset,
+			unsigned int *count)
+{
+	uint32_t pos = stripe->head;
+	size_t len = 0;
+	unsigned int i;
+
+	/* oldest first, as they are inserted back */
+	for (i=0; i<stripe->records; i++) {
+		HevDNSCacheEntry *entry = (HevDNSCacheEntry *) (stripe->arena + pos);
+		HevDNSCacheFileEntry *file_entry;
+		size_t size;
+
+		pos += entry->size;
+		if (stripe->wrapped && (pos == stripe->wrap))
+		  pos = 0;
+		if (!entry->live)
+		  continue;
+
+		/* a record never grows, the file header is smaller than the entry's */
+		file_entry = (HevDNSCacheFileEntry *) (buffer + len);
+		file_entry->time = entry->time + offset;
+		file_entry->expire = entry->expire + offset;
+		file_entry->key_len = entry->key_len;
+		file_entry->msg_len = entry->msg_len;
+		file_entry->ttl_count = entry->ttl_count;
+		file_entry->reserved = 0;
+		size = sizeof (uint16_t) * entry->ttl_count + entry->key_len +
+			entry->msg_len;
+		/* ttls, key and message are contiguous in the entry */
+		memcpy (file_entry + 1, entry + 1, size);
+		memset ((uint8_t *) (file_entry + 1) + size, 0, ALIGN (size) - size);
+		len += sizeof (HevDNSCacheFileEntry) + ALIGN (size);
+		(*count) ++;
+	}
+
+	return len;
+}
+
+bool
+hev_dns_cache_save (HevDNSCache *self, const char *path)
+{
+	HevDNSCacheFileHeader header;
+	char tmp_path[4096];
+	uint8_t *buffer;
+	int64_t offset;
+	unsigned int i;
+	bool res;
+	FILE *fp;
+
+	if (!self)
+	  return false;
+	if (sizeof (tmp_path) <= snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path))
+	  return false;
+	buffer = malloc (self->stripe_size);
+	if (!buffer)
+	  return false;
+	fp = fopen (tmp_path, "w");
+	if (!fp) {
+		free (buffer);
+		return false;
+	}
+
+	/* monotonic times go out as wall clock, good across a reboot */
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, FILE_MAGIC, sizeof (FILE_MAGIC));
+	header.version = FILE_VERSION;
+	header.time = get_clock (CLOCK_REALTIME);
+	offset = header.time - get_time ();
+	fwrite (&header, sizeof (header), 1, fp);
+
+	/* a stripe's writers wait for the copy only, never for the disk */
+	for (i=0; i<self->stripe_count; i++) {
+		size_t len;
+
+		pthread_mutex_lock (&self->stripes[i].lock);
+		len = save_stripe (&self->stripes[i], buffer, offset, &header.count);
+		pthread_mutex_unlock (&self->stripes[i].lock);
+		fwrite (buffer, len, 1, fp);
+	}
+	free (buffer);
+
+	/* the count of what was written, known at the end */
+	rewind (fp);
+	fwrite (&header, sizeof (header), 1, fp);
+
+	res = !ferror (fp);
+	if ((0 != fclose (fp)) || !res || (0 != rename (tmp_path, path))) {
+		unlink (tmp_path);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+check_file_entry (const HevDNSCacheFileEntry *file_entry, const uint16_t *ttls)
+{
+	unsigned int i;
+
+	if ((HEV_DNS_MAX_KEY_SIZE < file_entry->key_len) || (MAX_TTLS < file_entry->ttl_count) ||
+				((HEV_DNS_HEADER_SIZE + file_entry->key_len) > file_entry->msg_len))
+	  return false;
+	for (i=0; i<file_entry->ttl_count; i++) {
+		if ((ttls[i] + 4) > file_entry->msg_len)
+		  return false;
+	}
+
+	return true;
+}
+
+bool
+hev_dns_cache_load (HevDNSCache *self, const char *path)
+{
+	const HevDNSCacheFileHeader *header;
+	struct stat st;
+	uint8_t *map;
+	size_t offset, map_size;
+	int64_t now, shift;
+	int fd;
+
+	if (!self)
+	  return false;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (0 > fd)
+	  return false;
+	if ((0 != fstat (fd, &st)) || (sizeof (HevDNSCacheFileHeader) > st.st_size)) {
+		close (fd);
+		return false;
+	}
+	map_size = st.st_size;
+	map = mmap (NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close (fd);
+	if (MAP_FAILED == map)
+	  return false;
+
+	header = (const HevDNSCacheFileHeader *) map;
+	if ((0 != memcmp (header->magic, FILE_MAGIC, sizeof (FILE_MAGIC))) ||
+				(FILE_VERSION != header->version)) {
+		munmap (map, map_size);
+		return false;
+	}
+
+	/* wall clock back to monotonic, time spent down counts against ttls */
+	now = get_time ();
+	shift = now - get_clock (CLOCK_REALTIME);
+	for (offset=sizeof (HevDNSCacheFileHeader);
+				(offset + sizeof (HevDNSCacheFileEntry)) <= map_size;) {
+		const HevDNSCacheFileEntry *file_entry = (const void *) (map + offset);
+		const uint16_t *ttls = (const void *) (file_entry + 1);
+		const uint8_t *key = (const uint8_t *) (ttls + file_entry->ttl_count);
+		const uint8_t *msg = key + file_entry->key_len;
+		int64_t expire = file_entry->expire + shift;
+		size_t size;
+
+		size = sizeof (uint16_t) * file_entry->ttl_count + file_entry->key_len +
+			file_entry->msg_len;
+		if (((offset + sizeof (HevDNSCacheFileEntry) + size) > map_size) ||
+					!check_file_entry (file_entry, ttls))
+		  break;
+		offset += sizeof (HevDNSCacheFileEntry) + ALIGN (size);
+		if (now >= (expire + MAX_STALE))
+		  continue;
+
+		store_entry (self, hev_dns_message_hash_key (key, file_entry->key_len),
+					key, file_entry->key_len, msg, file_entry->msg_len,
+					ttls, file_entry->ttl_count, file_entry->time + shift, expire,
+					-1, 0);
+	}
+
+	munmap (map, map_size);
+
+	return true;
+}
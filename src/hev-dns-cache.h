@@ -0,0 +1,46 @@
+/*
+ ============================================================================
+ Name        : hev-dns-cache.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS response cache
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_CACHE_H__
+#define __HEV_DNS_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct _HevDNSCache HevDNSCache;
+
+/* size bytes in all, index included, shared by the threads, lookups take
+ * no lock; when full the oldest answers go, unless asked for more often
+ * than the one coming in */
+HevDNSCache * hev_dns_cache_new (size_t size);
+
+HevDNSCache * hev_dns_cache_ref (HevDNSCache *self);
+void hev_dns_cache_unref (HevDNSCache *self);
+
+ssize_t hev_dns_cache_lookup (HevDNSCache *self, const void *request, size_t len,
+			void *buffer, size_t size);
+/* an expired answer, with short ttls, when no fresh one can be had */
+ssize_t hev_dns_cache_lookup_stale (HevDNSCache *self, const void *request, size_t len,
+			void *buffer, size_t size);
+/* keyed by the request, the answer is checked against it */
+void hev_dns_cache_insert (HevDNSCache *self, const void *request, size_t request_len,
+			const void *response, size_t len);
+
+/* snapshot, replaced whole, and loaded back with ttls aged */
+bool hev_dns_cache_save (HevDNSCache *self, const char *path);
+bool hev_dns_cache_load (HevDNSCache *self, const char *path);
+
+/* popular entries hit close to expiry, to be asked again before they lapse */
+unsigned int hev_dns_cache_get_prefetch_count (HevDNSCache *self);
+ssize_t hev_dns_cache_take_prefetch (HevDNSCache *self, uint8_t *key);
+
+#endif /* __HEV_DNS_CACHE_H__ */
+
@@ -7,6 +7,7 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -16,92 +17,188 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "hev-dns-forwarder.h"
 #include "hev-dns-session.h"
+#include "hev-dns-stream.h"
+#include "hev-dns-server.h"
+#include "hev-dns-cache.h"
+#include "hev-dns-sender.h"
+#include "hev-dns-message.h"
+#include "hev-dns-address.h"
+#include "hev-dns-stats.h"
+#include "hev-event-source-fds.h"
 
-#define TIMEOUT		(10 * 1000)
+#define UPSTREAM_POOL_SIZE	(4)
+#define BATCH_SIZE	(32)
+#define MESSAGE_SIZE	(4096)
+#define SESSION_BUCKETS	(4096)
+/* client tcp connections per thread, the oldest idle one makes room */
+#define MAX_STREAMS	(128)
+/* cache refreshes per tick, and only while clients leave room for them */
+#define PREFETCH_INTERVAL	(100)
+#define PREFETCH_BURST	(8)
+#define PREFETCH_MAX_SESSIONS	(256)
+/* rfc 8767 client response timer */
+#define STALE_DELAY	(1800)
 
 struct _HevDNSForwarder
 {
 	int listen_fd;
+	int tcp_listen_fd;
 	unsigned int ref_count;
 	HevEventSource *listener_source;
-	HevEventSource *timeout_source;
-	HevSList *session_list;
+	HevDNSSession *session_list;
+	unsigned int session_count;
+	HevDNSStream *stream_list;
+	unsigned int stream_count;
+	/* in-flight sessions by question */
+	HevDNSSession *session_table[SESSION_BUCKETS];
+	HevEventTimer prefetch_timer;
 
 	HevEventLoop *loop;
-	struct sockaddr_in upstream;
+	HevDNSCache *cache;
+	HevDNSSender *sender;
+	unsigned int server_count;
+	unsigned int hedge_delay;
+	unsigned int stale_delay;
+	HevDNSServer *servers[HEV_DNS_SERVER_MAX];
+
+	unsigned int batch_size;
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+	struct sockaddr_storage *addrs;
+	uint8_t *buffers;
 };
 
 static bool listener_source_handler (HevEventSourceFD *fd, void *data);
-static bool timeout_source_handler (void *data);
+static void listener_datagram_handler (HevEventLoopDatagram *datagrams,
+			unsigned int count, void *data);
 static void session_close_handler (HevDNSSession *session, void *data);
+static void stream_query_handler (HevDNSStream *stream, uint8_t *msg, size_t len,
+			void *data);
+static void stream_close_handler (HevDNSStream *stream, void *data);
+static void upstream_drain_handler (HevDNSUpstream *upstream, void *data);
+static void prefetch_timer_handler (HevEventTimer *timer, void *data);
 static void remove_all_sessions (HevDNSForwarder *self);
+static void remove_all_streams (HevDNSForwarder *self);
+static void free_batch (HevDNSForwarder *self);
+static bool add_servers (HevDNSForwarder *self, const char *servers);
+
+static int
+dns_listen (const struct addrinfo *addr_ip, int type)
+{
+	int fd, nonblock = 1, reuseaddr = 1, v6only = 0;
+
+	fd = socket (addr_ip->ai_family, type, 0);
+	if (0 > fd)
+	  return -1;
+	ioctl (fd, FIONBIO, (char *) &nonblock);
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
+	/* each worker thread binds its own socket to the same port */
+	setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr, sizeof (reuseaddr));
+	if (AF_INET6 == addr_ip->ai_family)
+	  setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof (v6only));
+	if ((0 != bind (fd, addr_ip->ai_addr, addr_ip->ai_addrlen)) ||
+				((SOCK_STREAM == type) && (0 != listen (fd, 128)))) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* udp, and tcp for truncated answers and stream clients, on the first
+ * address that takes both */
+static bool
+dns_listen_addr (HevDNSForwarder *self, const char *addr, const char *port)
+{
+	int r;
+	struct addrinfo hints;
+	struct addrinfo *addr_ip, *ai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (0 != (r = getaddrinfo(addr, port, &hints, &addr_ip))) {
+		fprintf(stderr, "%s:%s:%s\n", gai_strerror(r), addr, port);
+		return false;
+	}
+	for (ai=addr_ip; ai; ai=ai->ai_next) {
+		self->listen_fd = dns_listen (ai, SOCK_DGRAM);
+		if (0 > self->listen_fd)
+		  continue;
+		self->tcp_listen_fd = dns_listen (ai, SOCK_STREAM);
+		if (0 <= self->tcp_listen_fd)
+		  break;
+		close (self->listen_fd);
+		self->listen_fd = -1;
+	}
+	freeaddrinfo(addr_ip);
+
+	return 0 <= self->listen_fd;
+}
 
 HevDNSForwarder *
 hev_dns_forwarder_new (HevEventLoop *loop, const char *addr, const char *port,
-			const char *upstream, const char *upstream_port)
+			const char *servers, HevDNSCache *cache)
 {
 	HevDNSForwarder *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSForwarder));
 	if (self) {
-		int r, nonblock = 1, reuseaddr = 1;
-		struct addrinfo hints;
-		struct addrinfo *addr_ip;
-
-		/* listen socket */
-		self->listen_fd = socket (AF_INET, SOCK_DGRAM, 0);
-		if (0 > self->listen_fd) {
-			HEV_MEMORY_ALLOCATOR_FREE (self);
-			fprintf (stderr, "socket error\n");
-			return NULL;
-		}
-		ioctl (self->listen_fd, FIONBIO, (char *) &nonblock);
-		setsockopt (self->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_DGRAM;
-		if (0 != (r = getaddrinfo(addr, port, &hints, &addr_ip))) {
-			fprintf(stderr, "%s:%s:%s\n", gai_strerror(r), addr, port);
-			return NULL;
-		}
-		if (0 != bind(self->listen_fd, addr_ip->ai_addr, addr_ip->ai_addrlen)) {
-			close (self->listen_fd);
+		/* listen sockets, an ipv6 one also takes ipv4 clients, and the
+		 * default any address falls back to ipv4 on hosts without ipv6 */
+		self->listen_fd = -1;
+		self->tcp_listen_fd = -1;
+		if (!dns_listen_addr (self, addr, port) &&
+					((0 != strcmp (addr, "::")) ||
+					 !dns_listen_addr (self, "0.0.0.0", port))) {
 			HEV_MEMORY_ALLOCATOR_FREE (self);
 			fprintf (stderr, "Can't bind address %s:%s\n", addr, port);
 			return NULL;
 		}
-		freeaddrinfo(addr_ip);
 
 		/* event source fds for listener */
 		self->listener_source = hev_event_source_fds_new ();
 		hev_event_source_set_priority (self->listener_source, 1);
-		hev_event_source_add_fd (self->listener_source, self->listen_fd, EPOLLIN | EPOLLET);
+		/* datagrams come from the loop itself with io_uring */
+		if (!hev_event_loop_add_datagram_fd (loop, self->listen_fd,
+						listener_datagram_handler, self))
+		  hev_event_source_add_fd (self->listener_source, self->listen_fd, EPOLLIN | EPOLLET);
+		hev_event_source_add_fd (self->listener_source, self->tcp_listen_fd, EPOLLIN | EPOLLET);
 		hev_event_source_set_callback (self->listener_source,
 					(HevEventSourceFunc) listener_source_handler, self, NULL);
 		hev_event_loop_add_source (loop, self->listener_source);
 		hev_event_source_unref (self->listener_source);
 
-		/* event source timeout */
-		self->timeout_source = hev_event_source_timeout_new (TIMEOUT);
-		hev_event_source_set_priority (self->timeout_source, -1);
-		hev_event_source_set_callback (self->timeout_source, timeout_source_handler, self, NULL);
-		hev_event_loop_add_source (loop, self->timeout_source);
-		hev_event_source_unref (self->timeout_source);
-
 		self->ref_count = 1;
 		self->session_list = NULL;
+		self->session_count = 0;
+		self->stream_list = NULL;
+		self->stream_count = 0;
+		memset (self->session_table, 0, sizeof (self->session_table));
+		hev_event_timer_init (&self->prefetch_timer, prefetch_timer_handler, self);
 		self->loop = loop;
+		self->sender = NULL;
+		self->msgs = NULL;
+		self->iovecs = NULL;
+		self->addrs = NULL;
+		self->buffers = NULL;
+		hev_dns_forwarder_set_batch_size (self, BATCH_SIZE);
+
+		/* shared with the other workers */
+		self->cache = hev_dns_cache_ref (cache);
 
-		/* upstream address */
-		memset (&self->upstream, 0, sizeof (self->upstream));
-		self->upstream.sin_family = AF_INET;
-		if (0 == inet_aton (upstream, &self->upstream.sin_addr)) {
-			fprintf (stderr, "invalid upstream %s\n", upstream);
+		/* upstream servers, each with its connection pool */
+		self->server_count = 0;
+		self->hedge_delay = 0;
+		self->stale_delay = STALE_DELAY;
+		if (!add_servers (self, servers)) {
+			hev_dns_forwarder_unref (self);
 			return NULL;
 		}
-		self->upstream.sin_port = htons (atoi (upstream_port));
 	}
 
 	return self;
@@ -124,59 +221,368 @@ hev_dns_forwarder_unref (HevDNSForwarder *self)
 	if (self) {
 		self->ref_count --;
 		if (0 == self->ref_count) {
+			unsigned int i;
+
 			hev_event_loop_del_source (self->loop, self->listener_source);
-			hev_event_loop_del_source (self->loop, self->timeout_source);
+			hev_event_loop_del_timer (self->loop, &self->prefetch_timer);
+			hev_event_loop_del_datagram_fd (self->loop, self->listen_fd);
 			close (self->listen_fd);
+			close (self->tcp_listen_fd);
 			remove_all_sessions (self);
+			remove_all_streams (self);
+			for (i=0; i<self->server_count; i++)
+			  hev_dns_server_unref (self->servers[i]);
+			hev_dns_cache_unref (self->cache);
+			free_batch (self);
 			HEV_MEMORY_ALLOCATOR_FREE (self);
 		}
 	}
 }
 
+static bool
+add_servers (HevDNSForwarder *self, const char *servers)
+{
+	char list[1024], *server, *saveptr = NULL;
+
+	if (!servers || (sizeof (list) <= strlen (servers)))
+	  return false;
+	strcpy (list, servers);
+
+	/* [SCHEME://]DNS[:PORT][,...], [DNS6]:PORT for ipv6 with a port,
+	 * scheme udp, tcp, tcp-pipelined (default) or tls, as tls://DNS[:PORT][/NAME] */
+	for (server=strtok_r (list, ",", &saveptr); server;
+				server=strtok_r (NULL, ",", &saveptr)) {
+		struct sockaddr_storage server_addr;
+		HevDNSServer *dns_server;
+		HevDNSTransport transport = HEV_DNS_TRANSPORT_TCP_PIPELINED;
+		HevDNSTLS *tls = NULL;
+		const char *default_port = "53";
+
+		if (HEV_DNS_SERVER_MAX <= self->server_count) {
+			fprintf (stderr, "too many upstreams, max %d\n", HEV_DNS_SERVER_MAX);
+			return false;
+		}
+		if (0 == strncmp (server, "tls://", 6)) {
+			char *name = strchr (server + 6, '/');
+
+			if (name)
+			  *name ++ = '\0';
+			tls = hev_dns_tls_new (name);
+			if (!tls) {
+				fprintf (stderr, "tls unavailable for upstream %s\n", server);
+				return false;
+			}
+			server += 6;
+			default_port = "853";
+			transport = HEV_DNS_TRANSPORT_TLS;
+		} else if (0 == strncmp (server, "udp://", 6)) {
+			server += 6;
+			transport = HEV_DNS_TRANSPORT_UDP;
+		} else if (0 == strncmp (server, "tcp://", 6)) {
+			server += 6;
+			transport = HEV_DNS_TRANSPORT_TCP;
+		} else if (0 == strncmp (server, "tcp-pipelined://", 16)) {
+			server += 16;
+		}
+		if (!hev_dns_address_parse (server, default_port, &server_addr)) {
+			fprintf (stderr, "invalid upstream %s\n", server);
+			hev_dns_tls_unref (tls);
+			return false;
+		}
+
+		dns_server = hev_dns_server_new (self->loop, &server_addr, transport, tls,
+					UPSTREAM_POOL_SIZE);
+		hev_dns_tls_unref (tls);
+		if (!dns_server)
+		  return false;
+		hev_dns_server_set_drain_notify (dns_server, upstream_drain_handler, self);
+		self->servers[self->server_count ++] = dns_server;
+	}
+
+	return 0 < self->server_count;
+}
+
+static void
+free_batch (HevDNSForwarder *self)
+{
+	hev_dns_sender_unref (self->sender);
+	hev_free (self->msgs);
+	hev_free (self->iovecs);
+	hev_free (self->addrs);
+	hev_free (self->buffers);
+}
+
+void
+hev_dns_forwarder_set_batch_size (HevDNSForwarder *self, unsigned int size)
+{
+	unsigned int i;
+
+	if (!self || (0 == size))
+	  return;
+
+	if (self->sender)
+	  hev_dns_sender_flush (self->sender);
+	free_batch (self);
+
+	self->batch_size = size;
+	self->sender = hev_dns_sender_new (self->loop, self->listen_fd, size);
+	self->msgs = hev_malloc0 (sizeof (struct mmsghdr) * size);
+	self->iovecs = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (struct iovec) * size);
+	self->addrs = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (struct sockaddr_storage) * size);
+	self->buffers = HEV_MEMORY_ALLOCATOR_ALLOC (MESSAGE_SIZE * size);
+	for (i=0; i<size; i++) {
+		self->iovecs[i].iov_base = self->buffers + MESSAGE_SIZE * i;
+		self->iovecs[i].iov_len = MESSAGE_SIZE;
+		self->msgs[i].msg_hdr.msg_iov = &self->iovecs[i];
+		self->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+void
+hev_dns_forwarder_set_hedge_delay (HevDNSForwarder *self, unsigned int delay)
+{
+	if (self)
+	  self->hedge_delay = delay;
+}
+
+void
+hev_dns_forwarder_set_stale_delay (HevDNSForwarder *self, unsigned int delay)
+{
+	if (self)
+	  self->stale_delay = delay;
+}
+
+static bool
+dns_answer_from_cache (HevDNSForwarder *self, uint8_t *msg, size_t len,
+			struct sockaddr_storage *addr, HevDNSStream *stream)
+{
+	uint8_t *buffer;
+	size_t size;
+	ssize_t res;
+
+	if (stream) {
+		uint8_t message[UINT16_MAX];
+
+		res = hev_dns_cache_lookup (self->cache, msg, len, message, sizeof (message));
+		if (0 < res)
+		  hev_dns_stream_send (stream, message, res);
+		return 0 < res;
+	}
+
+	buffer = hev_dns_sender_reserve (self->sender, &size);
+	res = hev_dns_message_get_udp_size (msg, len);
+	if (res < size)
+	  size = res;
+	res = hev_dns_cache_lookup (self->cache, msg, len, buffer, size);
+	if (0 >= res)
+	  return false;
+	if (HEV_DNS_FLAG_TC & hev_dns_message_get_flags (buffer))
+	  hev_dns_stats_inc (HEV_DNS_STATS_TRUNCATED);
+	hev_dns_sender_commit (self->sender, res, addr);
+
+	return true;
+}
+
+static void
+dns_forward_request (HevDNSForwarder *self, uint8_t *msg, size_t len,
+			struct sockaddr_storage *addr, HevDNSStream *stream)
+{
+	HevDNSSession *session = NULL, *pending = NULL;
+	uint8_t key[HEV_DNS_MAX_KEY_SIZE];
+	ssize_t key_len;
+	uint32_t hash = 0;
+
+	/* join an in-flight query for the same question */
+	key_len = hev_dns_message_get_key (msg, len, key);
+	if (0 < key_len) {
+		hash = hev_dns_message_hash_key (key, key_len);
+		pending = hev_dns_session_table_lookup (self->session_table,
+					SESSION_BUCKETS - 1, key, key_len, hash);
+		/* a refresh has nothing to add to one already asked */
+		if (pending && !addr && !stream)
+		  return;
+		if (hev_dns_session_add_client (pending, msg, len, addr, stream)) {
+			hev_dns_stats_inc (HEV_DNS_STATS_COALESCED);
+			return;
+		}
+	}
+
+	session = hev_dns_session_new (self->loop, self->sender, addr, stream, self->servers,
+				self->server_count, self->cache, session_close_handler, self);
+	hev_dns_session_set_hedge_delay (session, self->hedge_delay);
+	hev_dns_session_set_stale_delay (session, self->stale_delay);
+	hev_dns_session_list_insert (&self->session_list, session);
+	self->session_count ++;
+	/* later clients join the new session once the pending one is full */
+	if (0 < key_len) {
+		hev_dns_session_table_remove (self->session_table, SESSION_BUCKETS - 1, pending);
+		hev_dns_session_table_insert (self->session_table, SESSION_BUCKETS - 1,
+					session, key, key_len, hash);
+	}
+	hev_dns_session_start (session, msg, len);
+}
+
+static void
+dns_handle_request (HevDNSForwarder *self, uint8_t *msg, size_t len,
+			struct sockaddr_storage *addr, HevDNSStream *stream)
+{
+	if ((HEV_DNS_HEADER_SIZE > len) ||
+				(HEV_DNS_FLAG_QR & hev_dns_message_get_flags (msg))) {
+		hev_dns_stats_inc (HEV_DNS_STATS_ERROR_MALFORMED);
+		return;
+	}
+	hev_dns_stats_inc (HEV_DNS_STATS_QUERIES);
+
+	/* answer from cache */
+	if (dns_answer_from_cache (self, msg, len, addr, stream)) {
+		hev_dns_stats_inc (HEV_DNS_STATS_CACHE_HITS);
+		/* the hit may have queued a refresh */
+		if (hev_dns_cache_get_prefetch_count (self->cache) &&
+					!hev_event_timer_is_pending (&self->prefetch_timer))
+		  hev_event_loop_add_timer (self->loop, &self->prefetch_timer,
+					  PREFETCH_INTERVAL);
+		return;
+	}
+	hev_dns_stats_inc (HEV_DNS_STATS_CACHE_MISSES);
+
+	dns_forward_request (self, msg, len, addr, stream);
+}
+
+static void
+dns_remove_stream (HevDNSForwarder *self, HevDNSStream *stream)
+{
+	hev_dns_stream_list_remove (&self->stream_list, stream);
+	self->stream_count --;
+	hev_dns_stream_unref (stream);
+}
+
+static bool
+dns_evict_stream (HevDNSForwarder *self)
+{
+	HevDNSStream *stream, *oldest = NULL;
+
+	for (stream=self->stream_list; stream; stream=hev_dns_stream_list_next (stream)) {
+		if (!hev_dns_stream_is_idle (stream))
+		  continue;
+		if (!oldest || (hev_dns_stream_get_active_time (stream) <
+						hev_dns_stream_get_active_time (oldest)))
+		  oldest = stream;
+	}
+	if (!oldest)
+	  return false;
+
+	hev_dns_stream_close (oldest);
+	dns_remove_stream (self, oldest);
+
+	return true;
+}
+
+static void
+dns_accept_streams (HevDNSForwarder *self, HevEventSourceFD *fd)
+{
+	for (;;) {
+		HevDNSStream *stream;
+		int client, nodelay = 1;
+
+		client = accept4 (fd->fd, NULL, NULL, SOCK_NONBLOCK);
+		if (0 > client) {
+			if (EAGAIN == errno)
+			  fd->revents &= ~EPOLLIN;
+			break;
+		}
+		if ((MAX_STREAMS <= self->stream_count) && !dns_evict_stream (self)) {
+			close (client);
+			continue;
+		}
+		setsockopt (client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));
+		stream = hev_dns_stream_new (self->loop, client, stream_query_handler,
+					stream_close_handler, self);
+		if (!stream) {
+			close (client);
+			continue;
+		}
+		hev_dns_stream_list_insert (&self->stream_list, stream);
+		self->stream_count ++;
+	}
+}
+
+static void
+dns_begin_batch (HevDNSForwarder *self)
+{
+	unsigned int i;
+
+	for (i=0; i<self->server_count; i++)
+	  hev_dns_server_set_cork (self->servers[i], true);
+}
+
+static void
+dns_end_batch (HevDNSForwarder *self)
+{
+	unsigned int i;
+
+	for (i=0; i<self->server_count; i++)
+	  hev_dns_server_set_cork (self->servers[i], false);
+	hev_dns_sender_flush (self->sender);
+}
+
 static bool
 listener_source_handler (HevEventSourceFD *fd, void *data)
 {
 	HevDNSForwarder *self = data;
-	HevDNSSession *session = NULL;
-	HevEventSource *source = NULL;
-	ssize_t size;
+	int i, count;
+
+	if (fd->fd == self->tcp_listen_fd) {
+		dns_accept_streams (self, fd);
+		return true;
+	}
 
-	size = recvfrom (fd->fd, NULL, 0, MSG_PEEK, NULL, NULL);
-	if (0 > size) {
+	for (i=0; i<self->batch_size; i++) {
+		self->msgs[i].msg_hdr.msg_name = &self->addrs[i];
+		self->msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+	}
+	count = recvmmsg (fd->fd, self->msgs, self->batch_size, MSG_DONTWAIT, NULL);
+	if (0 > count) {
 		if (EAGAIN == errno)
 		  fd->revents &= ~EPOLLIN;
-	} else {
-		session = hev_dns_session_new (fd->fd, &self->upstream, session_close_handler, self);
-		source = hev_dns_session_get_source (session);
-		hev_event_loop_add_source (self->loop, source);
-		/* printf ("New session %p\n", session); */
-		self->session_list = hev_slist_append (self->session_list, session);
-		hev_dns_session_start (session);
+		return true;
 	}
+	/* a short batch means the socket has been drained */
+	if (count < self->batch_size)
+	  fd->revents &= ~EPOLLIN;
+
+	dns_begin_batch (self);
+	for (i=0; i<count; i++) {
+		struct msghdr *mh = &self->msgs[i].msg_hdr;
+
+		if (MSG_TRUNC & mh->msg_flags) {
+			hev_dns_stats_inc (HEV_DNS_STATS_ERROR_MALFORMED);
+			continue;
+		}
+		dns_handle_request (self, mh->msg_iov->iov_base,
+					self->msgs[i].msg_len, &self->addrs[i], NULL);
+	}
+	dns_end_batch (self);
 
 	return true;
 }
 
-static bool
-timeout_source_handler (void *data)
+static void
+listener_datagram_handler (HevEventLoopDatagram *datagrams, unsigned int count,
+			void *data)
 {
 	HevDNSForwarder *self = data;
-	HevSList *list = NULL;
-	for (list=self->session_list; list; list=hev_slist_next (list)) {
-		HevDNSSession *session = hev_slist_data (list);
-		if (hev_dns_session_get_idle (session)) {
-			/* printf ("Remove timeout session %p\n", session); */
-			hev_event_loop_del_source (self->loop,
-						hev_dns_session_get_source (session));
-			hev_dns_session_unref (session);
-			hev_slist_set_data (list, NULL);
-		} else {
-			hev_dns_session_set_idle (session);
+	unsigned int i;
+
+	dns_begin_batch (self);
+	for (i=0; i<count; i++) {
+		if (datagrams[i].truncated) {
+			hev_dns_stats_inc (HEV_DNS_STATS_ERROR_MALFORMED);
+			continue;
 		}
+		dns_handle_request (self, datagrams[i].data, datagrams[i].len,
+					datagrams[i].addr, NULL);
 	}
-	self->session_list = hev_slist_remove_all (self->session_list, NULL);
-
-	return true;
+	dns_end_batch (self);
 }
 
 static void
@@ -184,24 +590,84 @@ session_close_handler (HevDNSSession *session, void *data)
 {
 	HevDNSForwarder *self = data;
 
-	/* printf ("Remove session %p\n", session); */
-	hev_event_loop_del_source (self->loop,
-				hev_dns_session_get_source (session));
+	hev_dns_session_table_remove (self->session_table, SESSION_BUCKETS - 1, session);
+	hev_dns_session_list_remove (&self->session_list, session);
+	self->session_count --;
 	hev_dns_session_unref (session);
-	self->session_list = hev_slist_remove (self->session_list, session);
+}
+
+static void
+stream_query_handler (HevDNSStream *stream, uint8_t *msg, size_t len, void *data)
+{
+	HevDNSForwarder *self = data;
+
+	dns_handle_request (self, msg, len, NULL, stream);
+}
+
+static void
+stream_close_handler (HevDNSStream *stream, void *data)
+{
+	HevDNSForwarder *self = data;
+
+	dns_remove_stream (self, stream);
+}
+
+static void
+upstream_drain_handler (HevDNSUpstream *upstream, void *data)
+{
+	HevDNSForwarder *self = data;
+
+	hev_dns_sender_flush (self->sender);
+}
+
+static void
+prefetch_timer_handler (HevEventTimer *timer, void *data)
+{
+	HevDNSForwarder *self = data;
+	uint8_t key[HEV_DNS_MAX_KEY_SIZE];
+	uint8_t msg[HEV_DNS_HEADER_SIZE + HEV_DNS_MAX_KEY_SIZE + HEV_DNS_OPT_SIZE];
+	unsigned int i;
+
+	/* a few per tick, client queries come first */
+	dns_begin_batch (self);
+	for (i=0; (i<PREFETCH_BURST) &&
+				(PREFETCH_MAX_SESSIONS > self->session_count); i++) {
+		ssize_t key_len, len;
+
+		key_len = hev_dns_cache_take_prefetch (self->cache, key);
+		if (0 > key_len)
+		  break;
+		len = hev_dns_message_build_query (key, key_len, msg, sizeof (msg));
+		if (0 > len)
+		  continue;
+		hev_dns_stats_inc (HEV_DNS_STATS_PREFETCHES);
+		dns_forward_request (self, msg, len, NULL, NULL);
+	}
+	dns_end_batch (self);
+
+	if (hev_dns_cache_get_prefetch_count (self->cache))
+	  hev_event_loop_add_timer (self->loop, &self->prefetch_timer, PREFETCH_INTERVAL);
 }
 
 static void
 remove_all_sessions (HevDNSForwarder *self)
 {
-	HevSList *list = NULL;
-	for (list=self->session_list; list; list=hev_slist_next (list)) {
-		HevDNSSession *session = hev_slist_data (list);
-		/* printf ("Remove session %p\n", session); */
-		hev_event_loop_del_source (self->loop,
-					hev_dns_session_get_source (session));
+	while (self->session_list) {
+		HevDNSSession *session = self->session_list;
+		hev_dns_session_table_remove (self->session_table, SESSION_BUCKETS - 1, session);
+		hev_dns_session_list_remove (&self->session_list, session);
+		self->session_count --;
 		hev_dns_session_unref (session);
 	}
-	hev_slist_free (self->session_list);
 }
 
+static void
+remove_all_streams (HevDNSForwarder *self)
+{
+	while (self->stream_list) {
+		HevDNSStream *stream = self->stream_list;
+
+		hev_dns_stream_close (stream);
+		dns_remove_stream (self, stream);
+	}
+}
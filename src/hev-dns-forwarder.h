@@ -16,11 +16,15 @@
 typedef struct _HevDNSForwarder HevDNSForwarder;
 
 HevDNSForwarder * hev_dns_forwarder_new (HevEventLoop *loop,
-			const char *addr, const char *port,
-			const char *upstream, const char *upstream_port);
+			const char *addr, const char *port, const char *servers,
+			HevDNSCache *cache);
 
 HevDNSForwarder * hev_dns_forwarder_ref (HevDNSForwarder *self);
 void hev_dns_forwarder_unref (HevDNSForwarder *self);
 
+void hev_dns_forwarder_set_batch_size (HevDNSForwarder *self, unsigned int size);
+void hev_dns_forwarder_set_hedge_delay (HevDNSForwarder *self, unsigned int delay);
+void hev_dns_forwarder_set_stale_delay (HevDNSForwarder *self, unsigned int delay);
+
 #endif /* __HEV_DNS_FORWARDER_H__ */
 
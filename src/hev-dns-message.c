@@ -0,0 +1,390 @@
+/*
+ ============================================================================
+ Name        : hev-dns-message.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS message helpers
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "hev-dns-message.h"
+
+static ssize_t find_opt (const uint8_t *msg, size_t len, size_t *opt_len);
+
+ssize_t
+hev_dns_message_skip_name (const uint8_t *msg, size_t len, size_t offset)
+{
+	while (offset < len) {
+		uint8_t label = msg[offset];
+
+		/* compression pointer terminates the name */
+		if (0xc0 == (label & 0xc0))
+		  return ((offset + 2) <= len) ? (ssize_t) (offset + 2) : -1;
+		if (0 != (label & 0xc0))
+		  return -1;
+		if (0 == label)
+		  return offset + 1;
+		offset += label + 1;
+	}
+
+	return -1;
+}
+
+ssize_t
+hev_dns_message_get_question_end (const uint8_t *msg, size_t len)
+{
+	ssize_t offset;
+
+	if ((HEV_DNS_HEADER_SIZE > len) || (1 != hev_dns_message_get_u16 (msg + 4)))
+	  return -1;
+
+	offset = hev_dns_message_skip_name (msg, len, HEV_DNS_HEADER_SIZE);
+	if ((0 > offset) || ((offset + 4) > len))
+	  return -1;
+
+	return offset + 4;
+}
+
+ssize_t
+hev_dns_message_get_key (const uint8_t *msg, size_t len, uint8_t *key)
+{
+	ssize_t i, end, opt;
+	size_t opt_len;
+	uint8_t bits = 0;
+
+	end = hev_dns_message_get_question_end (msg, len);
+	if ((0 > end) || (HEV_DNS_MAX_KEY_SIZE < (end - HEV_DNS_HEADER_SIZE + 1)))
+	  return -1;
+
+	/* qname is case-insensitive, label lengths never hit 'A'..'Z' */
+	for (i=HEV_DNS_HEADER_SIZE; i<(end - 4); i++) {
+		uint8_t c = msg[i];
+		key[i - HEV_DNS_HEADER_SIZE] = (('A' <= c) && ('Z' >= c)) ? (c | 0x20) : c;
+	}
+	memcpy (key + i - HEV_DNS_HEADER_SIZE, msg + i, 4);
+
+	/* dnssec records, unchecked data and the opt record differ with them */
+	if (HEV_DNS_FLAG_CD & hev_dns_message_get_flags (msg))
+	  bits |= HEV_DNS_KEY_CD;
+	opt = find_opt (msg, len, &opt_len);
+	if (0 <= opt) {
+		bits |= HEV_DNS_KEY_EDNS;
+		if (HEV_DNS_EDNS_DO & hev_dns_message_get_u16 (msg + opt + 7))
+		  bits |= HEV_DNS_KEY_DO;
+	}
+	key[end - HEV_DNS_HEADER_SIZE] = bits;
+
+	return end - HEV_DNS_HEADER_SIZE + 1;
+}
+
+bool
+hev_dns_message_match_question (const uint8_t *msg, size_t len,
+			const uint8_t *other, size_t other_len)
+{
+	uint8_t key[HEV_DNS_MAX_KEY_SIZE];
+	uint8_t other_key[HEV_DNS_MAX_KEY_SIZE];
+	ssize_t key_len;
+
+	key_len = hev_dns_message_get_key (msg, len, key);
+	if (0 > key_len)
+	  return false;
+
+	/* the edns bits of an answer need not be those of the query */
+	return (key_len == hev_dns_message_get_key (other, other_len, other_key)) &&
+		(0 == memcmp (key, other_key, hev_dns_message_get_key_question_len (key_len)));
+}
+
+uint32_t
+hev_dns_message_hash_key (const uint8_t *key, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	/* fnv-1a */
+	for (i=0; i<len; i++) {
+		hash ^= key[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void
+put_opt (uint8_t *opt, uint8_t rcode, uint16_t flags)
+{
+	/* our udp size, the extended rcode, version 0 */
+	opt[0] = 0;
+	hev_dns_message_set_u16 (opt + 1, HEV_DNS_TYPE_OPT);
+	hev_dns_message_set_u16 (opt + 3, HEV_DNS_MAX_UDP_SIZE);
+	opt[5] = rcode;
+	opt[6] = 0;
+	hev_dns_message_set_u16 (opt + 7, flags);
+	hev_dns_message_set_u16 (opt + 9, 0);
+}
+
+ssize_t
+hev_dns_message_build_query (const uint8_t *key, size_t key_len,
+			uint8_t *buf, size_t size)
+{
+	size_t question_len, opt_len;
+	uint8_t bits;
+
+	if (0 == key_len)
+	  return -1;
+	question_len = hev_dns_message_get_key_question_len (key_len);
+	bits = key[question_len];
+	opt_len = (HEV_DNS_KEY_EDNS & bits) ? HEV_DNS_OPT_SIZE : 0;
+	if ((HEV_DNS_HEADER_SIZE + question_len + opt_len) > size)
+	  return -1;
+
+	/* rd set, one question */
+	memset (buf, 0, HEV_DNS_HEADER_SIZE);
+	hev_dns_message_set_u16 (buf + 2, 0x0100 |
+				((HEV_DNS_KEY_CD & bits) ? HEV_DNS_FLAG_CD : 0));
+	hev_dns_message_set_u16 (buf + 4, 1);
+	memcpy (buf + HEV_DNS_HEADER_SIZE, key, question_len);
+	if (0 < opt_len) {
+		hev_dns_message_set_u16 (buf + 10, 1);
+		put_opt (buf + HEV_DNS_HEADER_SIZE + question_len, 0,
+					(HEV_DNS_KEY_DO & bits) ? HEV_DNS_EDNS_DO : 0);
+	}
+
+	return HEV_DNS_HEADER_SIZE + question_len + opt_len;
+}
+
+static ssize_t
+skip_questions (const uint8_t *msg, size_t len)
+{
+	unsigned int i, qdcount = hev_dns_message_get_u16 (msg + 4);
+	ssize_t offset = HEV_DNS_HEADER_SIZE;
+
+	for (i=0; i<qdcount; i++) {
+		offset = hev_dns_message_skip_name (msg, len, offset);
+		if ((0 > offset) || ((offset + 4) > len))
+		  return -1;
+		offset += 4;
+	}
+
+	return offset;
+}
+
+static ssize_t
+find_opt (const uint8_t *msg, size_t len, size_t *opt_len)
+{
+	unsigned int i, skip, arcount;
+	ssize_t offset;
+
+	if (HEV_DNS_HEADER_SIZE > len)
+	  return -1;
+
+	offset = skip_questions (msg, len);
+	skip = hev_dns_message_get_u16 (msg + 6) + hev_dns_message_get_u16 (msg + 8);
+	arcount = hev_dns_message_get_u16 (msg + 10);
+	for (i=0; (0 <= offset) && (i<(skip + arcount)); i++) {
+		ssize_t start = offset;
+		uint16_t type, rdlen;
+
+		offset = hev_dns_message_skip_name (msg, len, offset);
+		if ((0 > offset) || ((offset + 10) > len))
+		  return -1;
+		type = hev_dns_message_get_u16 (msg + offset);
+		rdlen = hev_dns_message_get_u16 (msg + offset + 8);
+		offset += 10 + rdlen;
+		if (offset > len)
+		  return -1;
+		/* owned by the root, in the additional section */
+		if ((i >= skip) && (HEV_DNS_TYPE_OPT == type) && (0 == msg[start])) {
+			*opt_len = offset - start;
+			return start;
+		}
+	}
+
+	return -1;
+}
+
+unsigned int
+hev_dns_message_get_udp_size (const uint8_t *msg, size_t len)
+{
+	unsigned int size = HEV_DNS_MIN_UDP_SIZE;
+	size_t opt_len;
+	ssize_t opt;
+
+	/* requestor's payload size sits in the class of the opt record */
+	opt = find_opt (msg, len, &opt_len);
+	if (0 <= opt)
+	  size = hev_dns_message_get_u16 (msg + opt + 3);
+	if (HEV_DNS_MIN_UDP_SIZE > size)
+	  size = HEV_DNS_MIN_UDP_SIZE;
+	if (HEV_DNS_MAX_UDP_SIZE < size)
+	  size = HEV_DNS_MAX_UDP_SIZE;
+
+	return size;
+}
+
+ssize_t
+hev_dns_message_truncate (const uint8_t *msg, size_t len,
+			uint8_t *buf, size_t size)
+{
+	size_t opt_len = 0;
+	ssize_t end, opt;
+
+	if (HEV_DNS_HEADER_SIZE > len)
+	  return -1;
+
+	/* header with tc set, the question and the opt record, buf may be msg */
+	end = skip_questions (msg, len);
+	if (0 > end)
+	  return -1;
+	opt = find_opt (msg, len, &opt_len);
+	if (0 > opt)
+	  opt_len = 0;
+	if ((end + opt_len) > size)
+	  return -1;
+
+	memmove (buf, msg, end);
+	if (0 < opt_len)
+	  memmove (buf + end, msg + opt, opt_len);
+	hev_dns_message_set_u16 (buf + 2, hev_dns_message_get_flags (buf) | HEV_DNS_FLAG_TC);
+	hev_dns_message_set_u16 (buf + 6, 0);
+	hev_dns_message_set_u16 (buf + 8, 0);
+	hev_dns_message_set_u16 (buf + 10, (0 < opt_len) ? 1 : 0);
+
+	return end + opt_len;
+}
+
+ssize_t
+hev_dns_message_set_opt (const uint8_t *msg, size_t len,
+			const uint8_t *request, size_t request_len, uint8_t *buf, size_t size)
+{
+	size_t opt_len = 0, request_opt_len, end;
+	uint16_t flags = 0;
+	uint8_t rcode = 0;
+	ssize_t opt;
+	bool edns;
+
+	if (HEV_DNS_HEADER_SIZE > len)
+	  return -1;
+
+	/* options are the upstream's to the first client, only the extended
+	 * rcode and do carry over */
+	opt = find_opt (msg, len, &opt_len);
+	if (0 <= opt) {
+		rcode = msg[opt + 5];
+		flags = hev_dns_message_get_u16 (msg + opt + 7) & HEV_DNS_EDNS_DO;
+	} else {
+		opt_len = 0;
+	}
+	edns = 0 <= find_opt (request, request_len, &request_opt_len);
+	end = len - opt_len;
+	if ((end + (edns ? HEV_DNS_OPT_SIZE : 0)) > size)
+	  return -1;
+
+	if (0 > opt) {
+		memmove (buf, msg, len);
+	} else {
+		memmove (buf, msg, opt);
+		memmove (buf + opt, msg + opt + opt_len, len - opt - opt_len);
+		hev_dns_message_set_u16 (buf + 10, hev_dns_message_get_u16 (buf + 10) - 1);
+	}
+	if (edns) {
+		put_opt (buf + end, rcode, flags);
+		hev_dns_message_set_u16 (buf + 10, hev_dns_message_get_u16 (buf + 10) + 1);
+		end += HEV_DNS_OPT_SIZE;
+	}
+
+	return end;
+}
+
+int
+hev_dns_message_find_ttls (const uint8_t *msg, size_t len,
+			uint16_t *offsets, int max, uint32_t *min_ttl)
+{
+	unsigned int i, qdcount, rrcount;
+	ssize_t offset = HEV_DNS_HEADER_SIZE;
+	uint32_t min = UINT32_MAX;
+	int count = 0;
+
+	if (HEV_DNS_HEADER_SIZE > len)
+	  return -1;
+
+	qdcount = hev_dns_message_get_u16 (msg + 4);
+	rrcount = hev_dns_message_get_u16 (msg + 6) +
+		hev_dns_message_get_u16 (msg + 8) +
+		hev_dns_message_get_u16 (msg + 10);
+
+	for (i=0; i<qdcount; i++) {
+		offset = hev_dns_message_skip_name (msg, len, offset);
+		if ((0 > offset) || ((offset + 4) > len))
+		  return -1;
+		offset += 4;
+	}
+
+	for (i=0; i<rrcount; i++) {
+		uint16_t type, rdlen;
+
+		offset = hev_dns_message_skip_name (msg, len, offset);
+		if ((0 > offset) || ((offset + 10) > len))
+		  return -1;
+		type = hev_dns_message_get_u16 (msg + offset);
+		rdlen = hev_dns_message_get_u16 (msg + offset + 8);
+		/* OPT pseudo-record carries flags in the TTL field */
+		if (HEV_DNS_TYPE_OPT != type) {
+			uint32_t ttl = hev_dns_message_get_u32 (msg + offset + 4);
+
+			if (count >= max)
+			  return -1;
+			offsets[count ++] = offset + 4;
+			if (ttl < min)
+			  min = ttl;
+		}
+		offset += 10 + rdlen;
+		if (offset > len)
+		  return -1;
+	}
+
+	if (min_ttl)
+	  *min_ttl = (0 < count) ? min : 0;
+
+	return count;
+}
+
+
+ssize_t
+hev_dns_message_find_soa (const uint8_t *msg, size_t len,
+			uint32_t *negative_ttl)
+{
+	unsigned int i, ancount, nscount;
+	ssize_t offset;
+
+	if (HEV_DNS_HEADER_SIZE > len)
+	  return -1;
+
+	offset = skip_questions (msg, len);
+	ancount = hev_dns_message_get_u16 (msg + 6);
+	nscount = hev_dns_message_get_u16 (msg + 8);
+	for (i=0; (0 <= offset) && (i<(ancount + nscount)); i++) {
+		uint16_t type, rdlen;
+
+		offset = hev_dns_message_skip_name (msg, len, offset);
+		if ((0 > offset) || ((offset + 10) > len))
+		  return -1;
+		type = hev_dns_message_get_u16 (msg + offset);
+		rdlen = hev_dns_message_get_u16 (msg + offset + 8);
+		if ((offset + 10 + rdlen) > len)
+		  return -1;
+		/* rfc 2308: the lower of the soa's ttl and its minimum, the last field */
+		if ((i >= ancount) && (HEV_DNS_TYPE_SOA == type) && (22 <= rdlen)) {
+			uint32_t ttl = hev_dns_message_get_u32 (msg + offset + 4);
+			uint32_t minimum = hev_dns_message_get_u32 (msg + offset + 6 + rdlen);
+
+			if (negative_ttl)
+			  *negative_ttl = (ttl < minimum) ? ttl : minimum;
+			return offset + 4;
+		}
+		offset += 10 + rdlen;
+	}
+
+	return -1;
+}
@@ -0,0 +1,123 @@
+/*
+ ============================================================================
+ Name        : hev-dns-message.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS message helpers
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_MESSAGE_H__
+#define __HEV_DNS_MESSAGE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define HEV_DNS_HEADER_SIZE	(12)
+/* lower-cased qname, qtype and qclass, then the edns bits the answer
+ * depends on */
+#define HEV_DNS_MAX_KEY_SIZE	(255 + 4 + 1)
+#define HEV_DNS_KEY_EDNS	(0x01)
+#define HEV_DNS_KEY_DO		(0x02)
+#define HEV_DNS_KEY_CD		(0x04)
+
+/* without edns, and the most a udp reply may use, below any path mtu */
+#define HEV_DNS_MIN_UDP_SIZE	(512)
+#define HEV_DNS_MAX_UDP_SIZE	(1232)
+/* root owner, type, class, ttl and rdlength, no options */
+#define HEV_DNS_OPT_SIZE	(11)
+
+#define HEV_DNS_TYPE_SOA	(6)
+#define HEV_DNS_TYPE_OPT	(41)
+
+#define HEV_DNS_FLAG_QR		(0x8000)
+#define HEV_DNS_FLAG_TC		(0x0200)
+#define HEV_DNS_FLAG_CD		(0x0010)
+#define HEV_DNS_OPCODE_MASK	(0x7800)
+#define HEV_DNS_RCODE_MASK	(0x000f)
+#define HEV_DNS_RCODE_SERVFAIL	(2)
+#define HEV_DNS_RCODE_NXDOMAIN	(3)
+#define HEV_DNS_EDNS_DO		(0x8000)
+
+static inline uint16_t
+hev_dns_message_get_u16 (const uint8_t *data)
+{
+	return (data[0] << 8) | data[1];
+}
+
+static inline void
+hev_dns_message_set_u16 (uint8_t *data, uint16_t value)
+{
+	data[0] = value >> 8;
+	data[1] = value & 0xff;
+}
+
+static inline uint32_t
+hev_dns_message_get_u32 (const uint8_t *data)
+{
+	return ((uint32_t) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static inline void
+hev_dns_message_set_u32 (uint8_t *data, uint32_t value)
+{
+	data[0] = value >> 24;
+	data[1] = (value >> 16) & 0xff;
+	data[2] = (value >> 8) & 0xff;
+	data[3] = value & 0xff;
+}
+
+static inline uint16_t
+hev_dns_message_get_id (const uint8_t *msg)
+{
+	return hev_dns_message_get_u16 (msg);
+}
+
+static inline void
+hev_dns_message_set_id (uint8_t *msg, uint16_t id)
+{
+	hev_dns_message_set_u16 (msg, id);
+}
+
+static inline uint16_t
+hev_dns_message_get_flags (const uint8_t *msg)
+{
+	return hev_dns_message_get_u16 (msg + 2);
+}
+
+ssize_t hev_dns_message_skip_name (const uint8_t *msg, size_t len, size_t offset);
+ssize_t hev_dns_message_get_question_end (const uint8_t *msg, size_t len);
+
+ssize_t hev_dns_message_get_key (const uint8_t *msg, size_t len, uint8_t *key);
+static inline size_t
+hev_dns_message_get_key_question_len (size_t key_len)
+{
+	/* as on the wire, without the edns bits */
+	return key_len - 1;
+}
+/* same qname, in any case, qtype and qclass */
+bool hev_dns_message_match_question (const uint8_t *msg, size_t len,
+			const uint8_t *other, size_t other_len);
+uint32_t hev_dns_message_hash_key (const uint8_t *key, size_t len);
+/* a recursive query for the question in key, with its cd and opt */
+ssize_t hev_dns_message_build_query (const uint8_t *key, size_t key_len,
+			uint8_t *buf, size_t size);
+
+unsigned int hev_dns_message_get_udp_size (const uint8_t *msg, size_t len);
+ssize_t hev_dns_message_truncate (const uint8_t *msg, size_t len,
+			uint8_t *buf, size_t size);
+/* the answer's opt record as the requestor's, none if it sent none, else
+ * a bare one of ours, buf may be msg */
+ssize_t hev_dns_message_set_opt (const uint8_t *msg, size_t len,
+			const uint8_t *request, size_t request_len, uint8_t *buf, size_t size);
+
+int hev_dns_message_find_ttls (const uint8_t *msg, size_t len,
+			uint16_t *offsets, int max, uint32_t *min_ttl);
+/* offset of the authority soa's ttl, and the negative ttl it gives */
+ssize_t hev_dns_message_find_soa (const uint8_t *msg, size_t len,
+			uint32_t *negative_ttl);
+
+#endif /* __HEV_DNS_MESSAGE_H__ */
+
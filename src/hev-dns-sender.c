@@ -0,0 +1,200 @@
+/*
+ ============================================================================
+ Name        : hev-dns-sender.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS batched datagram sender
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "hev-dns-sender.h"
+#include "hev-dns-address.h"
+#include "hev-dns-stats.h"
+#include "hev-memory-allocator.h"
+
+#define MESSAGE_SIZE	(4096)
+
+struct _HevDNSSender
+{
+	int fd;
+	unsigned int ref_count;
+	unsigned int batch_size;
+	unsigned int count;
+	HevEventLoop *loop;
+
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+	struct sockaddr_storage *addrs;
+	uint8_t *buffers;
+};
+
+HevDNSSender *
+hev_dns_sender_new (HevEventLoop *loop, int fd, unsigned int batch_size)
+{
+	HevDNSSender *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSSender));
+	if (self) {
+		unsigned int i;
+
+		if (0 == batch_size)
+		  batch_size = 1;
+		self->fd = fd;
+		self->ref_count = 1;
+		self->batch_size = batch_size;
+		self->count = 0;
+		self->loop = (HEV_EVENT_LOOP_BACKEND_IO_URING == hev_event_loop_get_backend (loop)) ?
+			loop : NULL;
+		self->msgs = hev_malloc0 (sizeof (struct mmsghdr) * batch_size);
+		self->iovecs = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (struct iovec) * batch_size);
+		self->addrs = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (struct sockaddr_storage) * batch_size);
+		self->buffers = HEV_MEMORY_ALLOCATOR_ALLOC (MESSAGE_SIZE * batch_size);
+		if (!self->msgs || !self->iovecs || !self->addrs || !self->buffers) {
+			hev_dns_sender_unref (self);
+			return NULL;
+		}
+		for (i=0; i<batch_size; i++) {
+			self->iovecs[i].iov_base = self->buffers + MESSAGE_SIZE * i;
+			self->msgs[i].msg_hdr.msg_name = &self->addrs[i];
+			self->msgs[i].msg_hdr.msg_iov = &self->iovecs[i];
+			self->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	return self;
+}
+
+HevDNSSender *
+hev_dns_sender_ref (HevDNSSender *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_dns_sender_unref (HevDNSSender *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			hev_free (self->msgs);
+			hev_free (self->iovecs);
+			hev_free (self->addrs);
+			hev_free (self->buffers);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+void *
+hev_dns_sender_reserve (HevDNSSender *self, size_t *size)
+{
+	if (!self)
+	  return NULL;
+
+	if (self->count == self->batch_size)
+	  hev_dns_sender_flush (self);
+	if (size)
+	  *size = MESSAGE_SIZE;
+	/* the slot may have pointed to a queued message */
+	self->iovecs[self->count].iov_base = self->buffers + MESSAGE_SIZE * self->count;
+
+	return self->iovecs[self->count].iov_base;
+}
+
+static void
+sender_push (HevDNSSender *self, size_t len, struct sockaddr_storage *addr)
+{
+	socklen_t addr_len = hev_dns_address_get_len (addr);
+
+	self->iovecs[self->count].iov_len = len;
+	memcpy (&self->addrs[self->count], addr, addr_len);
+	self->msgs[self->count].msg_hdr.msg_namelen = addr_len;
+	self->count ++;
+	if (self->count == self->batch_size)
+	  hev_dns_sender_flush (self);
+}
+
+void
+hev_dns_sender_commit (HevDNSSender *self, size_t len, struct sockaddr_storage *addr)
+{
+	if (self && (MESSAGE_SIZE >= len))
+	  sender_push (self, len, addr);
+}
+
+void
+hev_dns_sender_queue (HevDNSSender *self, const void *msg, size_t len,
+			struct sockaddr_storage *addr)
+{
+	if (!self)
+	  return;
+
+	/* sent from where it is, the caller keeps it until the flush */
+	if (self->count == self->batch_size)
+	  hev_dns_sender_flush (self);
+	self->iovecs[self->count].iov_base = (void *) msg;
+	sender_push (self, len, addr);
+}
+
+void
+hev_dns_sender_send (HevDNSSender *self, const void *msg, size_t len,
+			struct sockaddr_storage *addr)
+{
+	void *buffer;
+
+	if (!self)
+	  return;
+
+	/* too large for a batch slot, send it alone */
+	if (MESSAGE_SIZE < len) {
+		if (0 > sendto (self->fd, msg, len, 0, (struct sockaddr *) addr,
+						hev_dns_address_get_len (addr)))
+		  hev_dns_stats_inc (HEV_DNS_STATS_ERROR_SEND);
+		else
+		  hev_dns_stats_inc (HEV_DNS_STATS_RESPONSES);
+		return;
+	}
+
+	buffer = hev_dns_sender_reserve (self, NULL);
+	memcpy (buffer, msg, len);
+	hev_dns_sender_commit (self, len, addr);
+}
+
+void
+hev_dns_sender_flush (HevDNSSender *self)
+{
+	unsigned int sent = 0, dropped = 0;
+
+	if (!self)
+	  return;
+
+	/* sent with the loop's next wait, what does not fit goes now */
+	if (self->loop)
+	  sent = hev_event_loop_send_datagrams (self->loop, self->fd, self->msgs, self->count);
+	while ((sent + dropped) < self->count) {
+		int res = sendmmsg (self->fd, self->msgs + sent + dropped,
+					self->count - sent - dropped, 0);
+		if (0 < res) {
+			sent += res;
+			continue;
+		}
+		/* drop what the socket refuses, as a lost datagram */
+		if (EAGAIN == errno) {
+			dropped = self->count - sent;
+			break;
+		}
+		dropped ++;
+	}
+	self->count = 0;
+	if (0 < sent)
+	  hev_dns_stats_add (HEV_DNS_STATS_RESPONSES, sent);
+	if (0 < dropped)
+	  hev_dns_stats_add (HEV_DNS_STATS_ERROR_SEND, dropped);
+}
+
@@ -0,0 +1,37 @@
+/*
+ ============================================================================
+ Name        : hev-dns-sender.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS batched datagram sender
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_SENDER_H__
+#define __HEV_DNS_SENDER_H__
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "hev-event-loop.h"
+
+typedef struct _HevDNSSender HevDNSSender;
+
+/* with an io_uring loop, batches are queued on it instead of sendmmsg */
+HevDNSSender * hev_dns_sender_new (HevEventLoop *loop, int fd, unsigned int batch_size);
+
+HevDNSSender * hev_dns_sender_ref (HevDNSSender *self);
+void hev_dns_sender_unref (HevDNSSender *self);
+
+void * hev_dns_sender_reserve (HevDNSSender *self, size_t *size);
+void hev_dns_sender_commit (HevDNSSender *self, size_t len, struct sockaddr_storage *addr);
+
+void hev_dns_sender_send (HevDNSSender *self, const void *msg, size_t len,
+			struct sockaddr_storage *addr);
+/* no copy, msg must stay valid until the next flush */
+void hev_dns_sender_queue (HevDNSSender *self, const void *msg, size_t len,
+			struct sockaddr_storage *addr);
+void hev_dns_sender_flush (HevDNSSender *self);
+
+#endif /* __HEV_DNS_SENDER_H__ */
+
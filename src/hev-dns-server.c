@@ -0,0 +1,246 @@
+/*
+ ============================================================================
+ Name        : hev-dns-server.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS upstream server
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "hev-dns-server.h"
+#include "hev-memory-allocator.h"
+
+/* consecutive failures before a server is taken out of rotation */
+#define MAX_FAILURES	(3)
+#define BACKOFF		(1000)
+#define MAX_BACKOFF_SHIFT	(5)
+/* a failure counts as a sample this slow */
+#define FAILURE_RTT	(2 * 1000)
+/* resample a server that has not been picked for this long */
+#define PROBE_INTERVAL	(10 * 1000)
+
+struct _HevDNSServer
+{
+	unsigned int ref_count;
+	unsigned int pool_size;
+	unsigned int failures;
+	/* smoothed rtt in 1/8 ms, as in tcp */
+	unsigned int srtt;
+	bool sampled;
+	uint64_t sample_time;
+	uint64_t probe_time;
+	uint64_t down_until;
+
+	HevEventLoop *loop;
+	HevDNSUpstream **upstreams;
+	/* a udp server's tcp connection, opened on the first truncation */
+	HevDNSUpstream *stream_upstream;
+};
+
+HevDNSServer *
+hev_dns_server_new (HevEventLoop *loop, struct sockaddr_storage *addr,
+			HevDNSTransport transport, HevDNSTLS *tls, unsigned int pool_size)
+{
+	HevDNSServer *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSServer));
+	if (self) {
+		unsigned int i;
+
+		if (0 == pool_size)
+		  pool_size = 1;
+		self->upstreams = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSUpstream *) * pool_size);
+		if (!self->upstreams) {
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		self->ref_count = 1;
+		self->pool_size = pool_size;
+		self->failures = 0;
+		self->srtt = 0;
+		self->sampled = false;
+		self->sample_time = 0;
+		self->probe_time = 0;
+		self->down_until = 0;
+		self->loop = loop;
+		for (i=0; i<pool_size; i++)
+		  self->upstreams[i] = hev_dns_upstream_new (loop, addr, transport, tls);
+		self->stream_upstream = NULL;
+		if (HEV_DNS_TRANSPORT_UDP == transport)
+		  self->stream_upstream = hev_dns_upstream_new (loop, addr,
+					  HEV_DNS_TRANSPORT_TCP_PIPELINED, NULL);
+	}
+
+	return self;
+}
+
+HevDNSServer *
+hev_dns_server_ref (HevDNSServer *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_dns_server_unref (HevDNSServer *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			unsigned int i;
+
+			for (i=0; i<self->pool_size; i++)
+			  hev_dns_upstream_unref (self->upstreams[i]);
+			hev_dns_upstream_unref (self->stream_upstream);
+			HEV_MEMORY_ALLOCATOR_FREE (self->upstreams);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+HevDNSUpstream *
+hev_dns_server_get_upstream (HevDNSServer *self)
+{
+	HevDNSUpstream *upstream;
+	unsigned int i;
+
+	if (!self)
+	  return NULL;
+
+	/* least pending queries */
+	upstream = self->upstreams[0];
+	for (i=1; i<self->pool_size; i++) {
+		if (hev_dns_upstream_get_pending (self->upstreams[i]) <
+					hev_dns_upstream_get_pending (upstream))
+		  upstream = self->upstreams[i];
+	}
+
+	return upstream;
+}
+
+HevDNSUpstream *
+hev_dns_server_get_stream_upstream (HevDNSServer *self)
+{
+	if (!self)
+	  return NULL;
+
+	return self->stream_upstream ? self->stream_upstream : hev_dns_server_get_upstream (self);
+}
+
+void
+hev_dns_server_set_cork (HevDNSServer *self, bool cork)
+{
+	unsigned int i;
+
+	if (!self)
+	  return;
+
+	for (i=0; i<self->pool_size; i++)
+	  hev_dns_upstream_set_cork (self->upstreams[i], cork);
+	hev_dns_upstream_set_cork (self->stream_upstream, cork);
+}
+
+void
+hev_dns_server_set_drain_notify (HevDNSServer *self,
+			HevDNSUpstreamDrainNotify notify, void *notify_data)
+{
+	unsigned int i;
+
+	if (!self)
+	  return;
+
+	for (i=0; i<self->pool_size; i++)
+	  hev_dns_upstream_set_drain_notify (self->upstreams[i], notify, notify_data);
+	hev_dns_upstream_set_drain_notify (self->stream_upstream, notify, notify_data);
+}
+
+static void
+update_srtt (HevDNSServer *self, unsigned int rtt, uint64_t now)
+{
+	/* first or stale sample replaces the estimate, else srtt += (rtt - srtt) / 8 */
+	if (!self->sampled || ((self->sample_time + PROBE_INTERVAL) <= now))
+	  self->srtt = rtt << 3;
+	else
+	  self->srtt = self->srtt - (self->srtt >> 3) + rtt;
+	self->sampled = true;
+	self->sample_time = now;
+}
+
+void
+hev_dns_server_report_rtt (HevDNSServer *self, unsigned int rtt)
+{
+	if (!self)
+	  return;
+
+	if (FAILURE_RTT < rtt)
+	  rtt = FAILURE_RTT;
+	update_srtt (self, rtt, hev_event_loop_get_time (self->loop));
+	self->failures = 0;
+	self->down_until = 0;
+}
+
+void
+hev_dns_server_report_failure (HevDNSServer *self)
+{
+	uint64_t now;
+	unsigned int shift;
+
+	if (!self)
+	  return;
+
+	now = hev_event_loop_get_time (self->loop);
+	update_srtt (self, FAILURE_RTT, now);
+	self->failures ++;
+	if (MAX_FAILURES > self->failures)
+	  return;
+
+	/* back off exponentially, a retry after it is a probe */
+	shift = self->failures - MAX_FAILURES;
+	if (MAX_BACKOFF_SHIFT < shift)
+	  shift = MAX_BACKOFF_SHIFT;
+	self->down_until = now + (BACKOFF << shift);
+}
+
+int
+hev_dns_server_select (HevDNSServer **servers, unsigned int count,
+			uint32_t exclude)
+{
+	uint64_t now;
+	int i, best = -1, fallback = -1;
+
+	if (!servers || (0 == count))
+	  return -1;
+	if (HEV_DNS_SERVER_MAX < count)
+	  count = HEV_DNS_SERVER_MAX;
+
+	now = hev_event_loop_get_time (servers[0]->loop);
+	for (i=0; i<count; i++) {
+		HevDNSServer *server = servers[i];
+
+		if (exclude & (1u << i))
+		  continue;
+		/* backing off, only used if every server is */
+		if (now < server->down_until) {
+			if ((0 > fallback) ||
+						(server->down_until < servers[fallback]->down_until))
+			  fallback = i;
+			continue;
+		}
+		/* let an idle server be measured again, once per interval */
+		if (server->sampled &&
+					((server->sample_time + PROBE_INTERVAL) <= now) &&
+					((server->probe_time + PROBE_INTERVAL) <= now)) {
+			server->probe_time = now;
+			return i;
+		}
+		if ((0 > best) || (!server->sampled && servers[best]->sampled) ||
+					((server->sampled == servers[best]->sampled) &&
+					 (server->srtt < servers[best]->srtt)))
+		  best = i;
+	}
+
+	return (0 <= best) ? best : fallback;
+}
+
@@ -0,0 +1,43 @@
+/*
+ ============================================================================
+ Name        : hev-dns-server.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS upstream server
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_SERVER_H__
+#define __HEV_DNS_SERVER_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "hev-dns-upstream.h"
+
+#define HEV_DNS_SERVER_MAX	(32)
+
+typedef struct _HevDNSServer HevDNSServer;
+
+HevDNSServer * hev_dns_server_new (HevEventLoop *loop, struct sockaddr_storage *addr,
+			HevDNSTransport transport, HevDNSTLS *tls, unsigned int pool_size);
+
+HevDNSServer * hev_dns_server_ref (HevDNSServer *self);
+void hev_dns_server_unref (HevDNSServer *self);
+
+HevDNSUpstream * hev_dns_server_get_upstream (HevDNSServer *self);
+/* for answers truncated over udp */
+HevDNSUpstream * hev_dns_server_get_stream_upstream (HevDNSServer *self);
+
+void hev_dns_server_set_cork (HevDNSServer *self, bool cork);
+void hev_dns_server_set_drain_notify (HevDNSServer *self,
+			HevDNSUpstreamDrainNotify notify, void *notify_data);
+
+void hev_dns_server_report_rtt (HevDNSServer *self, unsigned int rtt);
+void hev_dns_server_report_failure (HevDNSServer *self);
+
+int hev_dns_server_select (HevDNSServer **servers, unsigned int count,
+			uint32_t exclude);
+
+#endif /* __HEV_DNS_SERVER_H__ */
+
@@ -7,74 +7,153 @@
  ============================================================================
  */
 
-#include <errno.h>
-#include <netdb.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
-#include <sys/epoll.h>
-#include <sys/socket.h>
 
 #include "hev-dns-session.h"
+#include "hev-dns-message.h"
+#include "hev-dns-address.h"
+#include "hev-dns-stats.h"
 
-enum
-{
-	REMOTE_IN = (1 << 1),
-	REMOTE_OUT = (1 << 0),
-};
+#define TIMEOUT		(2 * 1000)
+#define MAX_QUERIES	(2)
+/* no answer yet, try another server even without hedging */
+#define FAILOVER_DELAY	(TIMEOUT / 2)
+/* clients sharing one upstream query */
+#define MAX_CLIENTS	(64)
 
 enum
 {
 	STEP_NULL,
-	STEP_WAIT_CONNECT,
 	STEP_WRITE_REQUEST,
 	STEP_READ_RESPONSE,
 	STEP_WRITE_RESPONSE,
 	STEP_CLOSE_SESSION,
 };
 
+typedef struct _HevDNSSessionQuery HevDNSSessionQuery;
+typedef struct _HevDNSSessionClient HevDNSSessionClient;
+
+struct _HevDNSSessionQuery
+{
+	int handle;
+	uint64_t time;
+	HevDNSServer *server;
+	HevDNSUpstream *upstream;
+	HevDNSSession *session;
+};
+
+struct _HevDNSSessionClient
+{
+	HevDNSSessionClient *next;
+	uint16_t id;
+	uint16_t udp_size;
+	/* answered on the stream when set, else by datagram */
+	HevDNSStream *stream;
+	struct sockaddr_storage addr;
+	/* as the client spelled it */
+	uint8_t question[];
+};
+
 struct _HevDNSSession
 {
-	int cfd;
-	int rfd;
 	unsigned int ref_count;
 	unsigned int step;
-	bool idle;
-	uint8_t revents;
-	HevEventSourceFD *remote_fd;
-	HevRingBuffer *forward_buffer;
-	HevRingBuffer *backward_buffer;
-	HevEventSource *source;
+	unsigned int hedge_delay;
+	unsigned int stale_delay;
+	unsigned int server_count;
+	/* servers already asked, by index */
+	uint32_t tried;
+	HevEventTimer timer;
+	HevEventTimer hedge_timer;
+	HevEventTimer stale_timer;
+	HevEventLoop *loop;
+	HevDNSCache *cache;
+	HevDNSSender *sender;
+	HevDNSServer **servers;
 	HevDNSSessionCloseNotify notify;
 	void *notify_data;
-	struct sockaddr_in *upstream;
-	struct sockaddr_in client_addr;
+	struct sockaddr_storage client_addr;
+	unsigned int udp_size;
+	HevDNSStream *stream;
+	/* no client of its own, a refresh of the cache */
+	bool detached;
+
+	/* the first query and a hedged one */
+	HevDNSSessionQuery queries[MAX_QUERIES];
+	uint8_t *request;
+	size_t request_len;
+
+	/* other clients asking the same question */
+	HevDNSSessionClient *clients;
+	unsigned int client_count;
+
+	/* owner's session list, linked in place */
+	HevDNSSession *_prev;
+	HevDNSSession *_next;
+
+	/* owner's in-flight table, by question */
+	HevDNSSession *_hash_next;
+	bool _hashed;
+	uint32_t hash;
+	uint16_t key_len;
+	uint8_t key[HEV_DNS_MAX_KEY_SIZE];
 };
 
-static int dns_read_request (HevDNSSession *self);
-static void dns_do_connect (HevDNSSession *self);
 static void dns_close_session (HevDNSSession *self);
-static bool session_source_forward_handler (HevEventSourceFD *fd, void *data);
+static void dns_release_clients (HevDNSSession *self);
+static void dns_cancel_queries (HevDNSSession *self);
+static void session_upstream_response_handler (void *msg, size_t len, void *data);
+static void session_timeout_handler (HevEventTimer *timer, void *data);
+static void session_hedge_handler (HevEventTimer *timer, void *data);
+static void session_stale_handler (HevEventTimer *timer, void *data);
 
 HevDNSSession *
-hev_dns_session_new (int fd, struct sockaddr_in *upstream,
+hev_dns_session_new (HevEventLoop *loop, HevDNSSender *sender, struct sockaddr_storage *addr,
+			HevDNSStream *stream, HevDNSServer **servers, unsigned int server_count, HevDNSCache *cache,
 			HevDNSSessionCloseNotify notify, void *notify_data)
 {
 	HevDNSSession *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSSession));
 	if (self) {
+		unsigned int i;
+
 		self->ref_count = 1;
-		self->cfd = fd;
-		self->rfd = -1;
-		self->revents = 0;
-		self->idle = false;
-		self->remote_fd = NULL;
-		self->forward_buffer = hev_ring_buffer_new (2000);
-		self->backward_buffer = hev_ring_buffer_new (2000);
-		self->source = NULL;
 		self->step = STEP_NULL;
+		self->hedge_delay = 0;
+		self->stale_delay = 0;
+		self->loop = loop;
+		hev_event_timer_init (&self->timer, session_timeout_handler, self);
+		hev_event_timer_init (&self->hedge_timer, session_hedge_handler, self);
+		hev_event_timer_init (&self->stale_timer, session_stale_handler, self);
+		self->cache = hev_dns_cache_ref (cache);
+		self->sender = hev_dns_sender_ref (sender);
+		/* the servers are owned by the forwarder, which outlives sessions */
+		self->servers = servers;
+		self->server_count = (HEV_DNS_SERVER_MAX < server_count) ?
+			HEV_DNS_SERVER_MAX : server_count;
+		self->tried = 0;
+		for (i=0; i<MAX_QUERIES; i++) {
+			self->queries[i].handle = -1;
+			self->queries[i].server = NULL;
+			self->queries[i].upstream = NULL;
+			self->queries[i].session = self;
+		}
+		self->request = NULL;
+		self->request_len = 0;
+		self->udp_size = HEV_DNS_MIN_UDP_SIZE;
+		self->clients = NULL;
+		self->client_count = 0;
+		self->_hash_next = NULL;
+		self->_hashed = false;
+		self->key_len = 0;
 		self->notify = notify;
-		self->upstream = upstream;
 		self->notify_data = notify_data;
+		self->_prev = NULL;
+		self->_next = NULL;
+		self->stream = hev_dns_stream_hold (stream);
+		self->detached = !addr && !stream;
+		if (addr)
+		  memcpy (&self->client_addr, addr, hev_dns_address_get_len (addr));
+		hev_dns_stats_inc (HEV_DNS_STATS_SESSIONS_OPENED);
 	}
 
 	return self;
@@ -95,328 +174,482 @@ hev_dns_session_unref (HevDNSSession *self)
 	if (self) {
 		self->ref_count --;
 		if (0 == self->ref_count) {
-			if (-1 < self->rfd)
-			  close (self->rfd);
-			hev_ring_buffer_unref (self->forward_buffer);
-			hev_ring_buffer_unref (self->backward_buffer);
-			if (self->source)
-			  hev_event_source_unref (self->source);
+			hev_event_loop_del_timer (self->loop, &self->timer);
+			hev_event_loop_del_timer (self->loop, &self->hedge_timer);
+			hev_event_loop_del_timer (self->loop, &self->stale_timer);
+			dns_cancel_queries (self);
+			dns_release_clients (self);
+			HEV_MEMORY_ALLOCATOR_FREE (self->request);
+			hev_dns_cache_unref (self->cache);
+			hev_dns_sender_unref (self->sender);
 			HEV_MEMORY_ALLOCATOR_FREE (self);
+			hev_dns_stats_inc (HEV_DNS_STATS_SESSIONS_CLOSED);
 		}
 	}
 }
 
-HevEventSource *
-hev_dns_session_get_source (HevDNSSession *self)
+static void
+dns_release_clients (HevDNSSession *self)
 {
-	if (self) {
-		if (self->source)
-		  return self->source;
-		self->source = hev_event_source_fds_new ();
-		if (self->source) {
-			hev_event_source_set_callback (self->source,
-						(HevEventSourceFunc) session_source_forward_handler, self, NULL);
-		}
-		return self->source;
+	while (self->clients) {
+		HevDNSSessionClient *client = self->clients;
+		self->clients = client->next;
+		hev_dns_stream_release (client->stream);
+		HEV_MEMORY_ALLOCATOR_FREE (client);
 	}
-
-	return NULL;
+	self->client_count = 0;
+	hev_dns_stream_release (self->stream);
+	self->stream = NULL;
+	self->detached = true;
 }
 
-void
-hev_dns_session_start (HevDNSSession *self)
+static void
+dns_cancel_queries (HevDNSSession *self)
 {
-	if (self) {
-		if (0 <= dns_read_request (self))
-		  dns_do_connect (self);
+	unsigned int i;
+
+	for (i=0; i<MAX_QUERIES; i++) {
+		HevDNSSessionQuery *query = &self->queries[i];
+
+		if (0 <= query->handle) {
+			hev_dns_upstream_cancel (query->upstream, query->handle);
+			query->handle = -1;
+		}
 	}
 }
 
-void
-hev_dns_session_set_idle (HevDNSSession *self)
+static unsigned int
+dns_get_pending_queries (HevDNSSession *self)
 {
-	if (self)
-	  self->idle = true;
+	unsigned int i, count = 0;
+
+	for (i=0; i<MAX_QUERIES; i++) {
+		if (0 <= self->queries[i].handle)
+		  count ++;
+	}
+
+	return count;
 }
 
-bool
-hev_dns_session_get_idle (HevDNSSession *self)
+static bool
+dns_send_query (HevDNSSession *self, HevDNSSessionQuery *query)
 {
-	return self ? self->idle : false;
+	int index;
+
+	/* fastest healthy server not asked yet, fail over on errors */
+	while (0 <= (index = hev_dns_server_select (self->servers,
+						self->server_count, self->tried))) {
+		HevDNSServer *server = self->servers[index];
+
+		self->tried |= 1u << index;
+		query->upstream = hev_dns_server_get_upstream (server);
+		query->handle = hev_dns_upstream_query (query->upstream,
+					self->request, self->request_len,
+					session_upstream_response_handler, query);
+		if (0 <= query->handle) {
+			query->server = server;
+			query->time = hev_event_loop_get_time (self->loop);
+			return true;
+		}
+		hev_dns_server_report_failure (server);
+	}
+
+	return false;
 }
 
-static size_t
-iovec_size (struct iovec *iovec, size_t iovec_len)
+static bool
+dns_write_request (HevDNSSession *self, const void *msg, size_t len)
 {
-	size_t i = 0, size = 0;
-
-	for (i=0; i<iovec_len; i++)
-	  size += iovec[i].iov_len;
+	/* kept for failover and hedging */
+	self->request = HEV_MEMORY_ALLOCATOR_ALLOC (len);
+	if (!self->request)
+	  return false;
+	memcpy (self->request, msg, len);
+	self->request_len = len;
+	self->udp_size = hev_dns_message_get_udp_size (msg, len);
+
+	if (!dns_send_query (self, &self->queries[0]))
+	  return false;
+
+	hev_event_loop_add_timer (self->loop, &self->timer, TIMEOUT);
+	if (1 < self->server_count)
+	  hev_event_loop_add_timer (self->loop, &self->hedge_timer,
+				  self->hedge_delay ? self->hedge_delay : FAILOVER_DELAY);
+	if (self->stale_delay && (TIMEOUT > self->stale_delay))
+	  hev_event_loop_add_timer (self->loop, &self->stale_timer, self->stale_delay);
+	self->step = STEP_READ_RESPONSE;
 
-	return size;
+	return true;
 }
 
-static ssize_t
-read_data (int fd, HevRingBuffer *buffer, struct sockaddr_in *addr)
+static void
+dns_send_truncated (HevDNSSession *self, const uint8_t *msg, size_t len,
+			unsigned int udp_size, struct sockaddr_storage *addr)
 {
-	struct msghdr mh;
-	struct iovec iovec[2];
-	size_t iovec_len = 0, inc_len = 0;
-	ssize_t size = -2;
-
-	iovec_len = hev_ring_buffer_writing (buffer, iovec);
-	if (0 < iovec_len) {
-		/* recv data */
-		memset (&mh, 0, sizeof (mh));
-		if (addr) {
-			mh.msg_name = addr;
-			mh.msg_namelen = sizeof (struct sockaddr_in);
-		}
-		mh.msg_iov = iovec;
-		mh.msg_iovlen = iovec_len;
-		size = recvmsg (fd, &mh, 0);
-		inc_len = (0 > size) ? 0 : size;
-		hev_ring_buffer_write_finish (buffer, inc_len);
-	}
-
-	return size;
+	uint8_t *buffer;
+	size_t size;
+	ssize_t res;
+
+	buffer = hev_dns_sender_reserve (self->sender, &size);
+	if (udp_size < size)
+	  size = udp_size;
+	res = hev_dns_message_truncate (msg, len, buffer, size);
+	if (0 > res)
+	  return;
+	hev_dns_sender_commit (self->sender, res, addr);
+	hev_dns_stats_inc (HEV_DNS_STATS_TRUNCATED);
 }
 
-static ssize_t
-write_data (int fd, HevRingBuffer *buffer, struct sockaddr_in *addr)
+static void
+dns_write_response (HevDNSSession *self, void *msg, size_t len, bool copy)
 {
-	struct msghdr mh;
-	struct iovec iovec[2];
-	size_t iovec_len = 0, inc_len = 0;
-	ssize_t size = -2;
-
-	iovec_len = hev_ring_buffer_reading (buffer, iovec);
-	if (0 < iovec_len) {
-		/* send data */
-		memset (&mh, 0, sizeof (mh));
-		if (addr) {
-			mh.msg_name = addr;
-			mh.msg_namelen = sizeof (struct sockaddr_in);
+	HevDNSSessionClient *client;
+	uint8_t buffer[UINT16_MAX];
+	uint16_t id = hev_dns_message_get_id (msg);
+	size_t question_len = hev_dns_message_get_key_question_len (self->key_len);
+	ssize_t res;
+	bool spelled;
+
+	/* the opt record as asked, the same for every client with the same
+	 * edns bits, in place unless one has to be added */
+	res = hev_dns_message_set_opt (msg, len, self->request, self->request_len, msg, len);
+	if (0 > res) {
+		res = hev_dns_message_set_opt (msg, len, self->request, self->request_len,
+					buffer, sizeof (buffer));
+		if (0 <= res) {
+			msg = buffer;
+			copy = true;
 		}
-		mh.msg_iov = iovec;
-		mh.msg_iovlen = iovec_len;
-		size = sendmsg (fd, &mh, 0);
-		inc_len = (0 > size) ? 0 : size;
-		hev_ring_buffer_read_finish (buffer, inc_len);
+	}
+	if (0 <= res)
+	  len = res;
+
+	/* fan out with each client's id and question spelling, copied over
+	 * only the very question they asked */
+	spelled = (0 < self->key_len) &&
+		hev_dns_message_match_question (msg, len, self->request, self->request_len);
+	for (client=self->clients; client; client=client->next) {
+		hev_dns_message_set_id (msg, client->id);
+		if (spelled)
+		  memcpy (msg + HEV_DNS_HEADER_SIZE, client->question, question_len);
+		if (client->stream)
+		  hev_dns_stream_send (client->stream, msg, len);
+		else if (len > client->udp_size)
+		  dns_send_truncated (self, msg, len, client->udp_size, &client->addr);
+		else
+		  hev_dns_sender_send (self->sender, msg, len, &client->addr);
 	}
 
-	return size;
+	if (self->detached) {
+		self->step = STEP_CLOSE_SESSION;
+		return;
+	}
+
+	/* the first client's answer goes out of the upstream's buffer as is */
+	if (self->clients) {
+		hev_dns_message_set_id (msg, id);
+		if (spelled)
+		  memcpy (msg + HEV_DNS_HEADER_SIZE, self->request + HEV_DNS_HEADER_SIZE,
+					  question_len);
+	}
+	if (self->stream)
+	  hev_dns_stream_send (self->stream, msg, len);
+	else if (len > self->udp_size)
+	  dns_send_truncated (self, msg, len, self->udp_size, &self->client_addr);
+	else if (copy)
+	  hev_dns_sender_send (self->sender, msg, len, &self->client_addr);
+	else
+	  hev_dns_sender_queue (self->sender, msg, len, &self->client_addr);
+	self->step = STEP_CLOSE_SESSION;
 }
 
 static bool
-remote_read (HevDNSSession *self)
+dns_check_answer (HevDNSSession *self, const uint8_t *msg, size_t len)
 {
-	ssize_t size = read_data (self->remote_fd->fd, self->backward_buffer, NULL);
-	if (-2 < size) {
-		if (-1 == size) {
-			if (EAGAIN == errno) {
-				self->revents &= ~REMOTE_IN;
-				self->remote_fd->revents &= ~EPOLLIN;
-			} else {
-				return false;
-			}
-		} else if (0 == size) {
-			return false;
-		}
-	} else {
-		self->remote_fd->revents &= ~EPOLLIN;
-	}
+	/* no question, an error with no records that could belong to one */
+	if ((HEV_DNS_HEADER_SIZE <= len) && (0 == hev_dns_message_get_u16 (msg + 4)))
+	  return (0 == hev_dns_message_get_u16 (msg + 6)) &&
+		  (0 == hev_dns_message_get_u16 (msg + 8));
 
-	return true;
+	return hev_dns_message_match_question (msg, len, self->request, self->request_len);
 }
 
 static bool
-remote_write (HevDNSSession *self)
+dns_answer_stale (HevDNSSession *self)
 {
-	ssize_t size = write_data (self->remote_fd->fd, self->forward_buffer, NULL);
-	if (-2 < size) {
-		if (-1 == size) {
-			if (EAGAIN == errno) {
-				self->revents &= ~REMOTE_OUT;
-				self->remote_fd->revents &= ~EPOLLOUT;
-			} else {
-				return false;
-			}
-		}
-	} else {
-		self->remote_fd->revents &= ~EPOLLOUT;
-	}
+	uint8_t msg[UINT16_MAX];
+	ssize_t len;
+
+	if (!self->stale_delay || (self->detached && !self->clients))
+	  return false;
+
+	/* rfc 8767: the expired answer beats none, the query goes on to refresh it */
+	len = hev_dns_cache_lookup_stale (self->cache, self->request, self->request_len,
+				msg, sizeof (msg));
+	if (0 >= len)
+	  return false;
+	hev_dns_stats_inc (HEV_DNS_STATS_STALE);
+	dns_write_response (self, msg, len, true);
+	/* off the receive path, nothing else flushes it */
+	hev_dns_sender_flush (self->sender);
+	dns_release_clients (self);
+	self->step = STEP_READ_RESPONSE;
 
 	return true;
 }
 
-static int
-dns_read_request (HevDNSSession *self)
+static void
+dns_close_session (HevDNSSession *self)
 {
-	ssize_t size;
-	struct iovec iovec[2];
-	unsigned short *plen;
-
-	hev_ring_buffer_writing (self->forward_buffer, iovec);
-	hev_ring_buffer_write_finish (self->forward_buffer, 2);
-	size = read_data (self->cfd, self->forward_buffer, &self->client_addr);
-	if (0 > size) {
-		dns_close_session (self);
-		return -1;
-	}
-
-	plen = iovec[0].iov_base;
-	*plen = htons (size);
+	self->step = STEP_CLOSE_SESSION;
+	if (self->notify)
+	  self->notify (self, self->notify_data);
+}
 
-	return 0;
+void
+hev_dns_session_set_hedge_delay (HevDNSSession *self, unsigned int delay)
+{
+	if (self)
+	  self->hedge_delay = delay;
 }
 
-static void
-dns_do_connect (HevDNSSession *self)
+void
+hev_dns_session_set_stale_delay (HevDNSSession *self, unsigned int delay)
 {
-	int nonblock = 1;
+	if (self)
+	  self->stale_delay = delay;
+}
 
-	self->rfd = socket (AF_INET, SOCK_STREAM, 0);
-	if (-1 == self->rfd) {
-		dns_close_session (self);
-		return;
-	}
-	ioctl (self->rfd, FIONBIO, (char *) &nonblock);
-	/* add fd to source */
-	if (self->source)
-	  self->remote_fd = hev_event_source_add_fd (self->source,
-				  self->rfd, EPOLLIN | EPOLLOUT | EPOLLET);
-	/* connect to remote host */
-	if (0 > connect (self->rfd, (struct sockaddr *) self->upstream, sizeof (struct sockaddr_in))) {
-		if (EINPROGRESS != errno) {
+void
+hev_dns_session_start (HevDNSSession *self, const void *msg, size_t len)
+{
+	if (self) {
+		self->step = STEP_WRITE_REQUEST;
+		if (!dns_write_request (self, msg, len)) {
+			hev_dns_stats_inc (HEV_DNS_STATS_ERROR_NO_SERVER);
+			dns_answer_stale (self);
 			dns_close_session (self);
-			return;
 		}
 	}
 }
 
-static bool
-dns_wait_connect (HevDNSSession *self)
+bool
+hev_dns_session_add_client (HevDNSSession *self, const void *msg, size_t len,
+			struct sockaddr_storage *addr, HevDNSStream *stream)
 {
-	if (!(REMOTE_OUT & self->revents))
-	  return true;
+	HevDNSSessionClient *client;
+	size_t question_len;
+
+	if (!self || (STEP_READ_RESPONSE != self->step) || (0 == self->key_len) ||
+				(MAX_CLIENTS <= self->client_count))
+	  return false;
+	question_len = hev_dns_message_get_key_question_len (self->key_len);
+	if ((HEV_DNS_HEADER_SIZE + question_len) > len)
+	  return false;
+
+	client = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSSessionClient) + question_len);
+	if (!client)
+	  return false;
+	client->id = hev_dns_message_get_id (msg);
+	client->udp_size = hev_dns_message_get_udp_size (msg, len);
+	client->stream = hev_dns_stream_hold (stream);
+	if (addr)
+	  memcpy (&client->addr, addr, hev_dns_address_get_len (addr));
+	memcpy (client->question, msg + HEV_DNS_HEADER_SIZE, question_len);
+	client->next = self->clients;
+	self->clients = client;
+	self->client_count ++;
 
-	self->step = STEP_WRITE_REQUEST;
+	return true;
+}
 
-	return false;
+void
+hev_dns_session_list_insert (HevDNSSession **list, HevDNSSession *self)
+{
+	if (list && self) {
+		self->_prev = NULL;
+		self->_next = *list;
+		if (*list)
+		  (*list)->_prev = self;
+		*list = self;
+	}
 }
 
-static bool
-dns_write_request (HevDNSSession *self)
+void
+hev_dns_session_list_remove (HevDNSSession **list, HevDNSSession *self)
 {
-	self->step = STEP_READ_RESPONSE;
+	if (list && self) {
+		if (self->_prev)
+		  self->_prev->_next = self->_next;
+		else
+		  *list = self->_next;
+		if (self->_next)
+		  self->_next->_prev = self->_prev;
+		self->_prev = NULL;
+		self->_next = NULL;
+	}
+}
 
-	return false;
+void
+hev_dns_session_table_insert (HevDNSSession **buckets, unsigned int mask,
+			HevDNSSession *self, const uint8_t *key, size_t key_len, uint32_t hash)
+{
+	HevDNSSession **bucket;
+
+	if (!buckets || !self || self->_hashed || (HEV_DNS_MAX_KEY_SIZE < key_len))
+	  return;
+
+	memcpy (self->key, key, key_len);
+	self->key_len = key_len;
+	self->hash = hash;
+	bucket = &buckets[hash & mask];
+	self->_hash_next = *bucket;
+	*bucket = self;
+	self->_hashed = true;
 }
 
-static bool
-dns_read_response (HevDNSSession *self)
+void
+hev_dns_session_table_remove (HevDNSSession **buckets, unsigned int mask,
+			HevDNSSession *self)
 {
-	struct iovec iovec[2];
-	size_t iovec_len = 0, size = 0;
-	unsigned short *plen, len;
-
-	iovec_len = hev_ring_buffer_reading (self->backward_buffer, iovec);
-	size = iovec_size (iovec, iovec_len);
-	if (2 > size)
-	  return true;
-	plen = iovec[0].iov_base;
-	len = ntohs (*plen);
-	if ((len + 2) > size)
-	  return true;
+	HevDNSSession **psession;
 
-	self->step = STEP_WRITE_RESPONSE;
-	hev_ring_buffer_read_finish (self->backward_buffer, 2);
+	if (!buckets || !self || !self->_hashed)
+	  return;
 
-	return false;
+	for (psession=&buckets[self->hash & mask]; *psession;
+				psession=&(*psession)->_hash_next) {
+		if (self == *psession) {
+			*psession = self->_hash_next;
+			break;
+		}
+	}
+	self->_hash_next = NULL;
+	self->_hashed = false;
 }
 
-static bool
-dns_write_response (HevDNSSession *self)
+HevDNSSession *
+hev_dns_session_table_lookup (HevDNSSession **buckets, unsigned int mask,
+			const uint8_t *key, size_t key_len, uint32_t hash)
 {
-	write_data (self->cfd, self->backward_buffer, &self->client_addr);
-	self->step = STEP_CLOSE_SESSION;
+	HevDNSSession *session;
 
-	return false;
+	if (!buckets)
+	  return NULL;
+
+	for (session=buckets[hash & mask]; session; session=session->_hash_next) {
+		if ((session->hash == hash) && (session->key_len == key_len) &&
+					(0 == memcmp (session->key, key, key_len)))
+		  return session;
+	}
+
+	return NULL;
 }
 
 static void
-dns_close_session (HevDNSSession *self)
+session_upstream_response_handler (void *msg, size_t len, void *data)
 {
-	if (self->notify)
-	  self->notify (self, self->notify_data);
-}
+	HevDNSSessionQuery *query = data;
+	HevDNSSession *self = query->session;
+	uint64_t now;
+	unsigned int i;
+
+	query->handle = -1;
+	/* the same query once more over tcp, the session goes on waiting */
+	if (msg && (HEV_DNS_FLAG_TC & hev_dns_message_get_flags (msg)) &&
+				(HEV_DNS_TRANSPORT_UDP == hev_dns_upstream_get_transport (query->upstream))) {
+		hev_dns_stats_inc (HEV_DNS_STATS_UPSTREAM_TRUNCATED);
+		query->upstream = hev_dns_server_get_stream_upstream (query->server);
+		query->handle = hev_dns_upstream_query (query->upstream,
+					self->request, self->request_len,
+					session_upstream_response_handler, query);
+		if (0 <= query->handle)
+		  return;
+		msg = NULL;
+	}
+	/* an answer to another question, late on a reused id, is none */
+	if (msg && !dns_check_answer (self, msg, len)) {
+		hev_dns_stats_inc (HEV_DNS_STATS_ERROR_MALFORMED);
+		msg = NULL;
+	}
+	if (!msg) {
+		hev_dns_server_report_failure (query->server);
+		/* wait for the other query, or ask the next server */
+		if ((0 < dns_get_pending_queries (self)) || dns_send_query (self, query))
+		  return;
+		hev_dns_stats_inc (HEV_DNS_STATS_ERROR_NO_SERVER);
+		hev_event_loop_del_timer (self->loop, &self->timer);
+		hev_event_loop_del_timer (self->loop, &self->hedge_timer);
+		hev_event_loop_del_timer (self->loop, &self->stale_timer);
+		dns_answer_stale (self);
+		dns_close_session (self);
+		return;
+	}
 
-static int
-handle_forward (HevDNSSession *self)
-{
-	bool wait = false;
-
-	switch (self->step) {
-	case STEP_NULL:
-		self->step = STEP_WAIT_CONNECT;
-	case STEP_WAIT_CONNECT:
-		wait = dns_wait_connect (self);
-		break;
-	case STEP_WRITE_REQUEST:
-		wait = dns_write_request (self);
-		break;
-	case STEP_READ_RESPONSE:
-		wait = dns_read_response (self);
-		break;
-	case STEP_WRITE_RESPONSE:
-		wait = dns_write_response (self);
-		break;
-	case STEP_CLOSE_SESSION:
-	default:
-		return -1;
+	now = hev_event_loop_get_time (self->loop);
+	hev_dns_server_report_rtt (query->server, now - query->time);
+	hev_dns_stats_observe_rtt (now - query->time);
+	/* first answer wins, the loser was at least this slow */
+	for (i=0; i<MAX_QUERIES; i++) {
+		if (0 <= self->queries[i].handle)
+		  hev_dns_server_report_rtt (self->queries[i].server,
+					  now - self->queries[i].time);
 	}
+	dns_cancel_queries (self);
+	hev_event_loop_del_timer (self->loop, &self->timer);
+	hev_event_loop_del_timer (self->loop, &self->hedge_timer);
+	hev_event_loop_del_timer (self->loop, &self->stale_timer);
+	self->step = STEP_WRITE_RESPONSE;
+	hev_dns_cache_insert (self->cache, self->request, self->request_len, msg, len);
+	/* stale data rather than a server failure */
+	if ((HEV_DNS_RCODE_SERVFAIL != (HEV_DNS_RCODE_MASK & hev_dns_message_get_flags (msg))) ||
+				!dns_answer_stale (self))
+	  dns_write_response (self, msg, len, false);
 
-	return wait ? 1 : 0;
+	dns_close_session (self);
 }
-static bool
-session_source_forward_handler (HevEventSourceFD *fd, void *data)
+
+static void
+session_timeout_handler (HevEventTimer *timer, void *data)
 {
 	HevDNSSession *self = data;
-	int wait = -1;
-
-	if ((EPOLLERR | EPOLLHUP) & fd->revents)
-	  goto close_session;
+	unsigned int i;
 
-	if (fd == self->remote_fd) {
-		if (EPOLLIN & fd->revents)
-		  self->revents |= REMOTE_IN;
-		if (EPOLLOUT & fd->revents)
-		  self->revents |= REMOTE_OUT;
+	for (i=0; i<MAX_QUERIES; i++) {
+		if (0 <= self->queries[i].handle)
+		  hev_dns_server_report_failure (self->queries[i].server);
 	}
+	dns_cancel_queries (self);
+	hev_event_loop_del_timer (self->loop, &self->hedge_timer);
+	hev_event_loop_del_timer (self->loop, &self->stale_timer);
+	hev_dns_stats_inc (HEV_DNS_STATS_TIMEOUTS);
+	dns_answer_stale (self);
+	dns_close_session (self);
+}
 
-	do {
-		if (REMOTE_OUT & self->revents) {
-			if (!remote_write (self))
-			  goto close_session;
-		}
-		if (REMOTE_IN & self->revents) {
-			if (!remote_read (self))
-			  goto close_session;
-		}
+static void
+session_hedge_handler (HevEventTimer *timer, void *data)
+{
+	HevDNSSession *self = data;
+	unsigned int i;
 
-		wait = handle_forward (self);
-		if (-1 == wait)
-		  goto close_session;
-	} while (0 == wait);
+	/* slow answer, race a duplicate on the next best server */
+	for (i=0; i<MAX_QUERIES; i++) {
+		HevDNSSessionQuery *query = &self->queries[i];
 
-	self->idle = false;
+		if (0 > query->handle) {
+			if (dns_send_query (self, query))
+			  hev_dns_stats_inc (HEV_DNS_STATS_HEDGED);
+			break;
+		}
+	}
+}
 
-	return true;
 
-close_session:
-	dns_close_session (self);
+static void
+session_stale_handler (HevEventTimer *timer, void *data)
+{
+	HevDNSSession *self = data;
 
-	return true;
+	dns_answer_stale (self);
 }
-
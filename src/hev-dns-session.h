@@ -13,24 +13,42 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#include "hev-ring-buffer.h"
-#include "hev-event-source.h"
-#include "hev-event-source-fds.h"
+#include "hev-dns-cache.h"
+#include "hev-dns-sender.h"
+#include "hev-dns-server.h"
+#include "hev-dns-stream.h"
+#include "hev-memory-allocator.h"
 
 typedef struct _HevDNSSession HevDNSSession;
 typedef void (*HevDNSSessionCloseNotify) (HevDNSSession *self, void *data);
 
-HevDNSSession * hev_dns_session_new (int fd, struct sockaddr_in *upstream,
+/* without addr and stream the answer only goes to the cache and joined clients */
+HevDNSSession * hev_dns_session_new (HevEventLoop *loop,
+			HevDNSSender *sender, struct sockaddr_storage *addr,
+			HevDNSStream *stream, HevDNSServer **servers, unsigned int server_count, HevDNSCache *cache,
 			HevDNSSessionCloseNotify notify, void *notify_data);
 
 HevDNSSession * hev_dns_session_ref (HevDNSSession *self);
 void hev_dns_session_unref (HevDNSSession *self);
 
-HevEventSource * hev_dns_session_get_source (HevDNSSession *self);
-void hev_dns_session_start (HevDNSSession *self);
+void hev_dns_session_set_hedge_delay (HevDNSSession *self, unsigned int delay);
+/* ms until clients get an expired cached answer, 0 never */
+void hev_dns_session_set_stale_delay (HevDNSSession *self, unsigned int delay);
 
-void hev_dns_session_set_idle (HevDNSSession *self);
-bool hev_dns_session_get_idle (HevDNSSession *self);
+void hev_dns_session_start (HevDNSSession *self, const void *msg, size_t len);
+
+bool hev_dns_session_add_client (HevDNSSession *self, const void *msg, size_t len,
+			struct sockaddr_storage *addr, HevDNSStream *stream);
+
+void hev_dns_session_list_insert (HevDNSSession **list, HevDNSSession *self);
+void hev_dns_session_list_remove (HevDNSSession **list, HevDNSSession *self);
+
+void hev_dns_session_table_insert (HevDNSSession **buckets, unsigned int mask,
+			HevDNSSession *self, const uint8_t *key, size_t key_len, uint32_t hash);
+void hev_dns_session_table_remove (HevDNSSession **buckets, unsigned int mask,
+			HevDNSSession *self);
+HevDNSSession * hev_dns_session_table_lookup (HevDNSSession **buckets, unsigned int mask,
+			const uint8_t *key, size_t key_len, uint32_t hash);
 
 #endif /* __HEV_DNS_SESSION_H__ */
 
@@ -0,0 +1,293 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stats-server.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS statistics endpoint
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "hev-dns-stats-server.h"
+#include "hev-dns-stats.h"
+#include "hev-dns-address.h"
+#include "hev-event-source-fds.h"
+#include "hev-memory-allocator.h"
+
+#define DEFAULT_PORT	"9153"
+#define MAX_CLIENTS	(16)
+/* a client that sent no request by then is dropped for a new one */
+#define CLIENT_TIMEOUT	(5 * 1000)
+#define BUFFER_SIZE	(16 * 1024)
+
+struct _HevDNSStatsServer
+{
+	int fd;
+	int type;
+	unsigned int ref_count;
+	HevEventLoop *loop;
+	HevEventSource *source;
+	int clients[MAX_CLIENTS];
+	uint64_t client_times[MAX_CLIENTS];
+	/* unix socket, removed again on unref */
+	char path[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+};
+
+static bool stats_source_handler (HevEventSourceFD *fd, void *data);
+
+static int
+stats_socket (HevDNSStatsServer *self, const char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	int fd, reuseaddr = 1;
+
+	/* /PATH or unix:PATH, udp://ADDR[:PORT], else tcp ADDR[:PORT] */
+	memset (&ss, 0, sizeof (ss));
+	self->type = SOCK_STREAM;
+	if (('/' == addr[0]) || (0 == strncmp (addr, "unix:", 5))) {
+		struct sockaddr_un *un = (struct sockaddr_un *) &ss;
+
+		if ('/' != addr[0])
+		  addr += 5;
+		if ((0 == addr[0]) || (sizeof (self->path) <= strlen (addr)))
+		  return -1;
+		un->sun_family = AF_UNIX;
+		strcpy (un->sun_path, addr);
+		ss_len = sizeof (struct sockaddr_un);
+		unlink (addr);
+	} else {
+		if (0 == strncmp (addr, "udp://", 6)) {
+			self->type = SOCK_DGRAM;
+			addr += 6;
+		}
+		if (!hev_dns_address_parse (addr, DEFAULT_PORT, &ss))
+		  return -1;
+		ss_len = hev_dns_address_get_len (&ss);
+	}
+
+	fd = socket (ss.ss_family, self->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (0 > fd)
+	  return -1;
+	if (AF_UNIX != ss.ss_family)
+	  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof (reuseaddr));
+	if ((0 != bind (fd, (struct sockaddr *) &ss, ss_len)) ||
+				((SOCK_STREAM == self->type) && (0 != listen (fd, MAX_CLIENTS)))) {
+		close (fd);
+		return -1;
+	}
+	if (AF_UNIX == ss.ss_family)
+	  strcpy (self->path, addr);
+
+	return fd;
+}
+
+HevDNSStatsServer *
+hev_dns_stats_server_new (HevEventLoop *loop, const char *addr)
+{
+	HevDNSStatsServer *self;
+	unsigned int i;
+
+	if (!addr)
+	  return NULL;
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSStatsServer));
+	if (!self)
+	  return NULL;
+
+	self->path[0] = '\0';
+	self->fd = stats_socket (self, addr);
+	if (0 > self->fd) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		fprintf (stderr, "Can't bind stats address %s\n", addr);
+		return NULL;
+	}
+	self->ref_count = 1;
+	self->loop = loop;
+	for (i=0; i<MAX_CLIENTS; i++)
+	  self->clients[i] = -1;
+
+	self->source = hev_event_source_fds_new ();
+	hev_event_source_add_fd (self->source, self->fd, EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (self->source,
+				(HevEventSourceFunc) stats_source_handler, self, NULL);
+	hev_event_loop_add_source (loop, self->source);
+
+	return self;
+}
+
+HevDNSStatsServer *
+hev_dns_stats_server_ref (HevDNSStatsServer *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_dns_stats_server_unref (HevDNSStatsServer *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			unsigned int i;
+
+			hev_event_loop_del_source (self->loop, self->source);
+			hev_event_source_unref (self->source);
+			for (i=0; i<MAX_CLIENTS; i++) {
+				if (-1 < self->clients[i])
+				  close (self->clients[i]);
+			}
+			close (self->fd);
+			if (self->path[0])
+			  unlink (self->path);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+static void
+stats_close_client (HevDNSStatsServer *self, unsigned int index)
+{
+	hev_event_source_del_fd (self->source, self->clients[index]);
+	close (self->clients[index]);
+	self->clients[index] = -1;
+}
+
+static void
+stats_accept (HevDNSStatsServer *self, HevEventSourceFD *fd)
+{
+	uint64_t now = hev_event_loop_get_time (self->loop);
+	int client;
+
+	for (;;) {
+		unsigned int i, slot = MAX_CLIENTS, oldest = 0;
+
+		client = accept4 (self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (0 > client) {
+			if (EAGAIN == errno)
+			  fd->revents &= ~EPOLLIN;
+			break;
+		}
+
+		/* a free slot, else the oldest client once it is stale */
+		for (i=0; i<MAX_CLIENTS; i++) {
+			if (-1 == self->clients[i]) {
+				slot = i;
+				break;
+			}
+			if (self->client_times[i] < self->client_times[oldest])
+			  oldest = i;
+		}
+		if ((MAX_CLIENTS == slot) &&
+					((self->client_times[oldest] + CLIENT_TIMEOUT) <= now)) {
+			stats_close_client (self, oldest);
+			slot = oldest;
+		}
+		if (MAX_CLIENTS == slot) {
+			close (client);
+			continue;
+		}
+		self->clients[slot] = client;
+		self->client_times[slot] = now;
+		hev_event_source_add_fd (self->source, client, EPOLLIN | EPOLLET);
+	}
+}
+
+static void
+stats_respond (HevDNSStatsServer *self, unsigned int index, HevEventSourceFD *fd)
+{
+	char buffer[BUFFER_SIZE];
+	struct iovec iovec[2];
+	char header[128];
+	ssize_t size;
+	bool request = false;
+
+	/* the request itself does not matter, any one gets the metrics */
+	for (;;) {
+		size = read (fd->fd, buffer, sizeof (buffer));
+		if (0 < size) {
+			request = true;
+			continue;
+		}
+		if ((0 > size) && (EAGAIN == errno) && !request) {
+			fd->revents &= ~EPOLLIN;
+			return;
+		}
+		break;
+	}
+
+	if (request) {
+		size = hev_dns_stats_format (buffer, sizeof (buffer));
+		iovec[0].iov_base = header;
+		iovec[0].iov_len = snprintf (header, sizeof (header),
+					"HTTP/1.0 200 OK\r\n"
+					"Content-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %zd\r\n\r\n", size);
+		iovec[1].iov_base = buffer;
+		iovec[1].iov_len = size;
+		/* small enough for an empty socket buffer */
+		if (0 > writev (fd->fd, iovec, 2)) {
+			/* nothing to do, the client is closed anyway */
+		}
+	}
+	stats_close_client (self, index);
+}
+
+static void
+stats_reply_datagrams (HevDNSStatsServer *self, HevEventSourceFD *fd)
+{
+	char buffer[BUFFER_SIZE];
+
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof (addr);
+		ssize_t size;
+
+		size = recvfrom (self->fd, buffer, sizeof (buffer), 0,
+					(struct sockaddr *) &addr, &addr_len);
+		if (0 > size) {
+			if (EAGAIN == errno)
+			  fd->revents &= ~EPOLLIN;
+			break;
+		}
+		size = hev_dns_stats_format (buffer, sizeof (buffer));
+		sendto (self->fd, buffer, size, 0, (struct sockaddr *) &addr, addr_len);
+	}
+}
+
+static bool
+stats_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevDNSStatsServer *self = data;
+	unsigned int i;
+
+	if (fd->fd == self->fd) {
+		if (SOCK_DGRAM == self->type)
+		  stats_reply_datagrams (self, fd);
+		else
+		  stats_accept (self, fd);
+		return true;
+	}
+
+	for (i=0; i<MAX_CLIENTS; i++) {
+		if (fd->fd == self->clients[i]) {
+			stats_respond (self, i, fd);
+			return true;
+		}
+	}
+	fd->revents = 0;
+
+	return true;
+}
+
@@ -0,0 +1,23 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stats-server.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS statistics endpoint
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_STATS_SERVER_H__
+#define __HEV_DNS_STATS_SERVER_H__
+
+#include "hev-event-loop.h"
+
+typedef struct _HevDNSStatsServer HevDNSStatsServer;
+
+HevDNSStatsServer * hev_dns_stats_server_new (HevEventLoop *loop, const char *addr);
+
+HevDNSStatsServer * hev_dns_stats_server_ref (HevDNSStatsServer *self);
+void hev_dns_stats_server_unref (HevDNSStatsServer *self);
+
+#endif /* __HEV_DNS_STATS_SERVER_H__ */
+
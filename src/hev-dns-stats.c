@@ -0,0 +1,265 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stats.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS runtime statistics
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hev-dns-stats.h"
+#include "hev-memory-allocator.h"
+
+#define CACHE_LINE	(64)
+#define RTT_BUCKETS	(11)
+
+typedef struct _HevDNSStats HevDNSStats;
+typedef struct _HevDNSStatsMetric HevDNSStatsMetric;
+typedef struct _HevDNSStatsAllocatorMetric HevDNSStatsAllocatorMetric;
+
+/* written by its own thread only, read by any with relaxed loads */
+struct _HevDNSStats
+{
+	HevDNSStats *next;
+	/* the thread's own, never freed, so safe to read from any */
+	HevMemoryAllocator *allocator;
+	unsigned int thread;
+	uint64_t counters[HEV_DNS_STATS_COUNTER_COUNT];
+	/* upstream rtt in ms, the last bucket is +Inf */
+	uint64_t rtt_buckets[RTT_BUCKETS + 1];
+	uint64_t rtt_sum;
+};
+
+struct _HevDNSStatsMetric
+{
+	const char *name;
+	const char *help;
+	HevDNSStatsCounter counter;
+};
+
+struct _HevDNSStatsAllocatorMetric
+{
+	const char *name;
+	const char *help;
+	size_t offset;
+};
+
+static const unsigned int rtt_bounds[RTT_BUCKETS] =
+{
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000,
+};
+
+static const HevDNSStatsMetric counter_metrics[] =
+{
+	{ "queries", "Queries received from clients.", HEV_DNS_STATS_QUERIES },
+	{ "responses", "Responses sent to clients.", HEV_DNS_STATS_RESPONSES },
+	{ "truncated", "Responses cut to fit the client's udp size.", HEV_DNS_STATS_TRUNCATED },
+	{ "tcp_connections", "Client tcp connections accepted.", HEV_DNS_STATS_STREAMS },
+	{ "cache_hits", "Queries answered from the cache.", HEV_DNS_STATS_CACHE_HITS },
+	{ "cache_misses", "Queries not in the cache.", HEV_DNS_STATS_CACHE_MISSES },
+	{ "coalesced", "Queries joined to an identical one in flight.", HEV_DNS_STATS_COALESCED },
+	{ "prefetches", "Popular cache entries asked again before they expired.", HEV_DNS_STATS_PREFETCHES },
+	{ "stale_answers", "Expired cache entries served for a late or failed query.", HEV_DNS_STATS_STALE },
+	{ "cache_evictions", "Live cache entries pushed out to make room.", HEV_DNS_STATS_CACHE_EVICTIONS },
+	{ "cache_rejected", "Answers not cached, asked for less than what they would push out.", HEV_DNS_STATS_CACHE_REJECTED },
+	{ "sessions", "Sessions started.", HEV_DNS_STATS_SESSIONS_OPENED },
+	{ "timeouts", "Sessions closed unanswered at the deadline.", HEV_DNS_STATS_TIMEOUTS },
+	{ "upstream_queries", "Queries sent to upstream servers.", HEV_DNS_STATS_UPSTREAM_QUERIES },
+	{ "upstream_connects", "Upstream connections opened.", HEV_DNS_STATS_UPSTREAM_CONNECTS },
+	{ "upstream_retries", "Queries resent after a connection reset.", HEV_DNS_STATS_UPSTREAM_RETRIES },
+	{ "upstream_truncated", "Truncated udp answers asked again over tcp.", HEV_DNS_STATS_UPSTREAM_TRUNCATED },
+	{ "hedged", "Queries raced on a second server.", HEV_DNS_STATS_HEDGED },
+};
+
+static const HevDNSStatsMetric error_metrics[] =
+{
+	{ "malformed", NULL, HEV_DNS_STATS_ERROR_MALFORMED },
+	{ "send", NULL, HEV_DNS_STATS_ERROR_SEND },
+	{ "connect", NULL, HEV_DNS_STATS_ERROR_CONNECT },
+	{ "reset", NULL, HEV_DNS_STATS_ERROR_RESET },
+	{ "upstream_timeout", NULL, HEV_DNS_STATS_ERROR_UPSTREAM_TIMEOUT },
+	{ "no_server", NULL, HEV_DNS_STATS_ERROR_NO_SERVER },
+};
+
+static const HevDNSStatsAllocatorMetric allocator_metrics[] =
+{
+	{ "hits", "Allocations served from a free list.",
+		offsetof (HevMemoryAllocatorStats, hits) },
+	{ "misses", "Allocations that carved a new slab.",
+		offsetof (HevMemoryAllocatorStats, misses) },
+	{ "large", "Allocations above the largest size class, passed to malloc.",
+		offsetof (HevMemoryAllocatorStats, large) },
+};
+
+/* blocks are never freed, totals must not go back when a thread exits */
+static HevDNSStats *stats_list = NULL;
+static unsigned int stats_threads = 0;
+
+static HevDNSStats *
+hev_dns_stats_default (void)
+{
+	static __thread HevDNSStats *stats = NULL;
+
+	if (!stats) {
+		/* a line of its own, threads never share one */
+		if (0 != posix_memalign ((void **) &stats, CACHE_LINE, sizeof (HevDNSStats)))
+		  return NULL;
+		memset (stats, 0, sizeof (HevDNSStats));
+		stats->allocator = hev_memory_allocator_default ();
+		stats->thread = __atomic_fetch_add (&stats_threads, 1, __ATOMIC_RELAXED);
+		stats->next = __atomic_load_n (&stats_list, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n (&stats_list, &stats->next, stats,
+						true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		  ;
+	}
+
+	return stats;
+}
+
+static inline void
+counter_add (uint64_t *counter, uint64_t value)
+{
+	/* single writer, a plain add that readers never see torn */
+	__atomic_store_n (counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void
+hev_dns_stats_add (HevDNSStatsCounter counter, unsigned long value)
+{
+	HevDNSStats *stats = hev_dns_stats_default ();
+
+	if (stats && (HEV_DNS_STATS_COUNTER_COUNT > counter))
+	  counter_add (&stats->counters[counter], value);
+}
+
+void
+hev_dns_stats_observe_rtt (unsigned int rtt)
+{
+	HevDNSStats *stats = hev_dns_stats_default ();
+	unsigned int i;
+
+	if (!stats)
+	  return;
+
+	for (i=0; (i<RTT_BUCKETS) && (rtt > rtt_bounds[i]); i++)
+	  ;
+	counter_add (&stats->rtt_buckets[i], 1);
+	counter_add (&stats->rtt_sum, rtt);
+}
+
+static uint64_t
+sum_counter (HevDNSStatsCounter counter)
+{
+	HevDNSStats *stats;
+	uint64_t sum = 0;
+
+	for (stats=__atomic_load_n (&stats_list, __ATOMIC_ACQUIRE); stats;
+				stats=stats->next)
+	  sum += __atomic_load_n (&stats->counters[counter], __ATOMIC_RELAXED);
+
+	return sum;
+}
+
+static void
+append (char *buf, size_t size, size_t *len, const char *format, ...)
+{
+	va_list ap;
+	int res;
+
+	if (*len >= size)
+	  return;
+
+	va_start (ap, format);
+	res = vsnprintf (buf + *len, size - *len, format, ap);
+	va_end (ap);
+	if (0 < res)
+	  *len += res;
+}
+
+size_t
+hev_dns_stats_format (char *buf, size_t size)
+{
+	uint64_t buckets[RTT_BUCKETS + 1] = { 0 }, rtt_sum = 0, count = 0, closed;
+	HevDNSStats *stats;
+	size_t i, len = 0;
+
+	if (!buf || (0 == size))
+	  return 0;
+
+	/* prometheus text exposition format */
+	for (i=0; i<(sizeof (counter_metrics) / sizeof (counter_metrics[0])); i++) {
+		const HevDNSStatsMetric *metric = &counter_metrics[i];
+
+		append (buf, size, &len, "# HELP hev_dns_%s_total %s\n"
+					"# TYPE hev_dns_%s_total counter\n"
+					"hev_dns_%s_total %llu\n",
+					metric->name, metric->help, metric->name, metric->name,
+					(unsigned long long) sum_counter (metric->counter));
+	}
+
+	/* closed first, a session opened meanwhile can not make it negative */
+	closed = sum_counter (HEV_DNS_STATS_SESSIONS_CLOSED);
+	append (buf, size, &len, "# HELP hev_dns_sessions_in_flight Sessions waiting for an answer.\n"
+				"# TYPE hev_dns_sessions_in_flight gauge\n"
+				"hev_dns_sessions_in_flight %llu\n",
+				(unsigned long long) (sum_counter (HEV_DNS_STATS_SESSIONS_OPENED) - closed));
+
+	append (buf, size, &len, "# HELP hev_dns_errors_total Errors by kind.\n"
+				"# TYPE hev_dns_errors_total counter\n");
+	for (i=0; i<(sizeof (error_metrics) / sizeof (error_metrics[0])); i++) {
+		const HevDNSStatsMetric *metric = &error_metrics[i];
+
+		append (buf, size, &len, "hev_dns_errors_total{kind=\"%s\"} %llu\n",
+					metric->name, (unsigned long long) sum_counter (metric->counter));
+	}
+
+	for (stats=__atomic_load_n (&stats_list, __ATOMIC_ACQUIRE); stats;
+				stats=stats->next) {
+		for (i=0; i<=RTT_BUCKETS; i++)
+		  buckets[i] += __atomic_load_n (&stats->rtt_buckets[i], __ATOMIC_RELAXED);
+		rtt_sum += __atomic_load_n (&stats->rtt_sum, __ATOMIC_RELAXED);
+	}
+	append (buf, size, &len, "# HELP hev_dns_upstream_rtt_seconds Time to the first upstream answer.\n"
+				"# TYPE hev_dns_upstream_rtt_seconds histogram\n");
+	for (i=0; i<RTT_BUCKETS; i++) {
+		count += buckets[i];
+		append (buf, size, &len, "hev_dns_upstream_rtt_seconds_bucket{le=\"%g\"} %llu\n",
+					rtt_bounds[i] / 1000.0, (unsigned long long) count);
+	}
+	count += buckets[RTT_BUCKETS];
+	append (buf, size, &len, "hev_dns_upstream_rtt_seconds_bucket{le=\"+Inf\"} %llu\n"
+				"hev_dns_upstream_rtt_seconds_sum %.3f\n"
+				"hev_dns_upstream_rtt_seconds_count %llu\n",
+				(unsigned long long) count, rtt_sum / 1000.0,
+				(unsigned long long) count);
+
+	/* per thread, each has its own slabs */
+	for (i=0; i<(sizeof (allocator_metrics) / sizeof (allocator_metrics[0])); i++) {
+		const HevDNSStatsAllocatorMetric *metric = &allocator_metrics[i];
+
+		append (buf, size, &len, "# HELP hev_dns_allocator_%s_total %s\n"
+					"# TYPE hev_dns_allocator_%s_total counter\n",
+					metric->name, metric->help, metric->name);
+		for (stats=__atomic_load_n (&stats_list, __ATOMIC_ACQUIRE); stats;
+					stats=stats->next) {
+			HevMemoryAllocatorStats alloc_stats;
+
+			if (!stats->allocator)
+			  continue;
+			hev_memory_allocator_get_stats (stats->allocator, &alloc_stats);
+			append (buf, size, &len, "hev_dns_allocator_%s_total{thread=\"%u\"} %lu\n",
+						metric->name, stats->thread,
+						*((unsigned long *) (((uint8_t *) &alloc_stats) + metric->offset)));
+		}
+	}
+
+	return (len < size) ? len : size - 1;
+}
+
@@ -0,0 +1,58 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stats.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS runtime statistics
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_STATS_H__
+#define __HEV_DNS_STATS_H__
+
+#include <stddef.h>
+
+typedef enum _HevDNSStatsCounter HevDNSStatsCounter;
+
+enum _HevDNSStatsCounter
+{
+	/* client side */
+	HEV_DNS_STATS_QUERIES,
+	HEV_DNS_STATS_RESPONSES,
+	HEV_DNS_STATS_TRUNCATED,
+	HEV_DNS_STATS_STREAMS,
+	HEV_DNS_STATS_CACHE_HITS,
+	HEV_DNS_STATS_CACHE_MISSES,
+	HEV_DNS_STATS_COALESCED,
+	HEV_DNS_STATS_PREFETCHES,
+	HEV_DNS_STATS_STALE,
+	HEV_DNS_STATS_CACHE_EVICTIONS,
+	HEV_DNS_STATS_CACHE_REJECTED,
+	HEV_DNS_STATS_SESSIONS_OPENED,
+	HEV_DNS_STATS_SESSIONS_CLOSED,
+	HEV_DNS_STATS_TIMEOUTS,
+	/* upstream side */
+	HEV_DNS_STATS_UPSTREAM_QUERIES,
+	HEV_DNS_STATS_UPSTREAM_CONNECTS,
+	HEV_DNS_STATS_UPSTREAM_RETRIES,
+	HEV_DNS_STATS_UPSTREAM_TRUNCATED,
+	HEV_DNS_STATS_HEDGED,
+	/* errors by kind */
+	HEV_DNS_STATS_ERROR_MALFORMED,
+	HEV_DNS_STATS_ERROR_SEND,
+	HEV_DNS_STATS_ERROR_CONNECT,
+	HEV_DNS_STATS_ERROR_RESET,
+	HEV_DNS_STATS_ERROR_UPSTREAM_TIMEOUT,
+	HEV_DNS_STATS_ERROR_NO_SERVER,
+	HEV_DNS_STATS_COUNTER_COUNT,
+};
+
+void hev_dns_stats_add (HevDNSStatsCounter counter, unsigned long value);
+#define hev_dns_stats_inc(counter)	hev_dns_stats_add (counter, 1)
+
+void hev_dns_stats_observe_rtt (unsigned int rtt);
+
+size_t hev_dns_stats_format (char *buf, size_t size);
+
+#endif /* __HEV_DNS_STATS_H__ */
+
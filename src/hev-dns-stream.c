@@ -0,0 +1,449 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stream.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS client stream connection
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "hev-dns-stream.h"
+#include "hev-dns-stats.h"
+#include "hev-event-source-fds.h"
+
+/* pipelined queries owed an answer, reading pauses beyond */
+#define MAX_QUERIES	(64)
+#define IDLE_TIMEOUT	(10 * 1000)
+#define BUFFER_SIZE	(4 * 1024)
+/* answers the client does not read, it is dropped beyond */
+#define MAX_OUTPUT	(1024 * 1024)
+
+struct _HevDNSStream
+{
+	int fd;
+	unsigned int ref_count;
+	unsigned int pending;
+	/* the client shut down its side, answer what is pending */
+	bool eof;
+	bool blocked;
+	uint64_t active_time;
+	HevEventLoop *loop;
+	HevEventSource *source;
+	HevEventSourceFD *client_fd;
+	HevEventTimer timer;
+	HevEventTimer resume_timer;
+
+	uint8_t *in_buffer;
+	size_t in_size;
+	size_t in_len;
+	uint8_t *out_buffer;
+	size_t out_size;
+	size_t out_len;
+	size_t out_off;
+
+	HevDNSStreamQueryNotify query_notify;
+	HevDNSStreamCloseNotify close_notify;
+	void *notify_data;
+
+	/* owner's stream list, linked in place */
+	HevDNSStream *_prev;
+	HevDNSStream *_next;
+};
+
+static bool stream_source_handler (HevEventSourceFD *fd, void *data);
+static void stream_timeout_handler (HevEventTimer *timer, void *data);
+static void stream_resume_handler (HevEventTimer *timer, void *data);
+
+HevDNSStream *
+hev_dns_stream_new (HevEventLoop *loop, int fd,
+			HevDNSStreamQueryNotify query_notify,
+			HevDNSStreamCloseNotify close_notify, void *notify_data)
+{
+	HevDNSStream *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSStream));
+	if (self) {
+		self->fd = fd;
+		self->ref_count = 1;
+		self->pending = 0;
+		self->eof = false;
+		self->blocked = false;
+		self->loop = loop;
+		self->active_time = hev_event_loop_get_time (loop);
+		self->in_buffer = NULL;
+		self->in_size = 0;
+		self->in_len = 0;
+		self->out_buffer = NULL;
+		self->out_size = 0;
+		self->out_len = 0;
+		self->out_off = 0;
+		self->query_notify = query_notify;
+		self->close_notify = close_notify;
+		self->notify_data = notify_data;
+		self->_prev = NULL;
+		self->_next = NULL;
+		hev_event_timer_init (&self->timer, stream_timeout_handler, self);
+		hev_event_timer_init (&self->resume_timer, stream_resume_handler, self);
+		hev_event_loop_add_timer (loop, &self->timer, IDLE_TIMEOUT);
+
+		self->source = hev_event_source_fds_new ();
+		self->client_fd = hev_event_source_add_fd (self->source, fd,
+					EPOLLIN | EPOLLOUT | EPOLLET);
+		hev_event_source_set_callback (self->source,
+					(HevEventSourceFunc) stream_source_handler, self, NULL);
+		hev_event_loop_add_source (loop, self->source);
+		hev_dns_stats_inc (HEV_DNS_STATS_STREAMS);
+	}
+
+	return self;
+}
+
+HevDNSStream *
+hev_dns_stream_ref (HevDNSStream *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_dns_stream_unref (HevDNSStream *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			hev_dns_stream_close (self);
+			hev_event_source_unref (self->source);
+			HEV_MEMORY_ALLOCATOR_FREE (self->in_buffer);
+			HEV_MEMORY_ALLOCATOR_FREE (self->out_buffer);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+void
+hev_dns_stream_close (HevDNSStream *self)
+{
+	if (!self || (-1 == self->fd))
+	  return;
+
+	hev_event_loop_del_timer (self->loop, &self->timer);
+	hev_event_loop_del_timer (self->loop, &self->resume_timer);
+	hev_event_loop_del_source (self->loop, self->source);
+	hev_event_source_del_fd (self->source, self->fd);
+	close (self->fd);
+	self->fd = -1;
+	self->client_fd = NULL;
+}
+
+static void
+stream_close (HevDNSStream *self)
+{
+	hev_dns_stream_close (self);
+	if (self->close_notify)
+	  self->close_notify (self, self->notify_data);
+}
+
+static bool
+stream_is_done (HevDNSStream *self)
+{
+	return self->eof && (0 == self->pending) && (self->out_off == self->out_len);
+}
+
+static bool
+stream_flush (HevDNSStream *self)
+{
+	while (self->out_off < self->out_len) {
+		ssize_t size = write (self->fd, self->out_buffer + self->out_off,
+					self->out_len - self->out_off);
+		if (0 > size) {
+			if (EAGAIN == errno) {
+				self->blocked = true;
+				if (self->client_fd)
+				  self->client_fd->revents &= ~EPOLLOUT;
+				return true;
+			}
+			return false;
+		}
+		self->out_off += size;
+	}
+	self->out_off = 0;
+	self->out_len = 0;
+
+	return true;
+}
+
+void
+hev_dns_stream_send (HevDNSStream *self, const void *msg, size_t len)
+{
+	size_t need = len + 2;
+
+	if (!self || (-1 == self->fd) || (UINT16_MAX < len))
+	  return;
+
+	/* keep unsent bytes at the start, grow for the rest */
+	if ((0 < self->out_off) && ((self->out_len + need) > self->out_size)) {
+		memmove (self->out_buffer, self->out_buffer + self->out_off,
+					self->out_len - self->out_off);
+		self->out_len -= self->out_off;
+		self->out_off = 0;
+	}
+	if ((self->out_len + need) > self->out_size) {
+		size_t size = self->out_size ? self->out_size : BUFFER_SIZE;
+		uint8_t *buffer;
+
+		while ((self->out_len + need) > size)
+		  size <<= 1;
+		if (MAX_OUTPUT < size) {
+			stream_close (self);
+			return;
+		}
+		buffer = HEV_MEMORY_ALLOCATOR_ALLOC (size);
+		if (!buffer)
+		  return;
+		if (self->out_buffer) {
+			memcpy (buffer, self->out_buffer, self->out_len);
+			HEV_MEMORY_ALLOCATOR_FREE (self->out_buffer);
+		}
+		self->out_buffer = buffer;
+		self->out_size = size;
+	}
+
+	self->out_buffer[self->out_len ++] = len >> 8;
+	self->out_buffer[self->out_len ++] = len & 0xff;
+	memcpy (self->out_buffer + self->out_len, msg, len);
+	self->out_len += len;
+	self->active_time = hev_event_loop_get_time (self->loop);
+	hev_dns_stats_inc (HEV_DNS_STATS_RESPONSES);
+
+	if (!self->blocked && !stream_flush (self))
+	  stream_close (self);
+}
+
+HevDNSStream *
+hev_dns_stream_hold (HevDNSStream *self)
+{
+	if (self) {
+		self->pending ++;
+		self->ref_count ++;
+	}
+
+	return self;
+}
+
+void
+hev_dns_stream_release (HevDNSStream *self)
+{
+	if (!self)
+	  return;
+
+	/* resume reading or finish later, not inside the caller */
+	self->pending --;
+	if ((-1 < self->fd) && ((MAX_QUERIES - 1) == self->pending || stream_is_done (self)))
+	  hev_event_loop_add_timer (self->loop, &self->resume_timer, 0);
+	hev_dns_stream_unref (self);
+}
+
+bool
+hev_dns_stream_is_idle (HevDNSStream *self)
+{
+	return self && (0 == self->pending) && (self->out_off == self->out_len);
+}
+
+uint64_t
+hev_dns_stream_get_active_time (HevDNSStream *self)
+{
+	return self ? self->active_time : 0;
+}
+
+void
+hev_dns_stream_list_insert (HevDNSStream **list, HevDNSStream *self)
+{
+	if (list && self) {
+		self->_prev = NULL;
+		self->_next = *list;
+		if (*list)
+		  (*list)->_prev = self;
+		*list = self;
+	}
+}
+
+void
+hev_dns_stream_list_remove (HevDNSStream **list, HevDNSStream *self)
+{
+	if (list && self) {
+		if (self->_prev)
+		  self->_prev->_next = self->_next;
+		else
+		  *list = self->_next;
+		if (self->_next)
+		  self->_next->_prev = self->_prev;
+		self->_prev = NULL;
+		self->_next = NULL;
+	}
+}
+
+HevDNSStream *
+hev_dns_stream_list_next (HevDNSStream *self)
+{
+	return self ? self->_next : NULL;
+}
+
+static bool
+stream_process_input (HevDNSStream *self)
+{
+	size_t offset = 0;
+	bool res = true;
+
+	hev_dns_stream_ref (self);
+	while ((offset + 2) <= self->in_len) {
+		uint8_t *frame = self->in_buffer + offset;
+		size_t len = (frame[0] << 8) | frame[1];
+
+		if ((offset + 2 + len) > self->in_len)
+		  break;
+		/* answers are owed, stop reading until some are sent */
+		if (MAX_QUERIES <= self->pending) {
+			res = false;
+			break;
+		}
+		offset += 2 + len;
+		self->active_time = hev_event_loop_get_time (self->loop);
+		self->query_notify (self, frame + 2, len, self->notify_data);
+		if (-1 == self->fd) {
+			res = false;
+			break;
+		}
+	}
+	if (-1 < self->fd) {
+		self->in_len -= offset;
+		memmove (self->in_buffer, self->in_buffer + offset, self->in_len);
+	}
+	hev_dns_stream_unref (self);
+
+	return res;
+}
+
+static bool
+stream_reserve_input (HevDNSStream *self)
+{
+	size_t size = BUFFER_SIZE;
+	uint8_t *buffer;
+
+	/* a partial frame is at the start, make room for all of it */
+	if (2 <= self->in_len)
+	  size = 2 + ((self->in_buffer[0] << 8) | self->in_buffer[1]);
+	if (BUFFER_SIZE > size)
+	  size = BUFFER_SIZE;
+	if (size <= self->in_size)
+	  return true;
+
+	buffer = HEV_MEMORY_ALLOCATOR_ALLOC (size);
+	if (!buffer)
+	  return false;
+	if (self->in_buffer) {
+		memcpy (buffer, self->in_buffer, self->in_len);
+		HEV_MEMORY_ALLOCATOR_FREE (self->in_buffer);
+	}
+	self->in_buffer = buffer;
+	self->in_size = size;
+
+	return true;
+}
+
+static bool
+stream_read (HevDNSStream *self)
+{
+	for (;;) {
+		ssize_t size;
+
+		/* paused, or closed by a handler */
+		if (!stream_process_input (self)) {
+			if (self->client_fd)
+			  self->client_fd->revents &= ~EPOLLIN;
+			break;
+		}
+		if (!stream_reserve_input (self))
+		  return false;
+		size = read (self->fd, self->in_buffer + self->in_len,
+					self->in_size - self->in_len);
+		if (0 > size) {
+			if (EAGAIN == errno) {
+				self->client_fd->revents &= ~EPOLLIN;
+				break;
+			}
+			return false;
+		} else if (0 == size) {
+			self->eof = true;
+			self->client_fd->revents &= ~EPOLLIN;
+			break;
+		}
+		self->in_len += size;
+	}
+
+	return true;
+}
+
+static bool
+stream_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevDNSStream *self = data;
+	bool res = true;
+
+	if (fd != self->client_fd) {
+		fd->revents = 0;
+		return true;
+	}
+
+	hev_dns_stream_ref (self);
+	if ((EPOLLIN & fd->revents) && !self->eof)
+	  res = stream_read (self);
+	if (res && (-1 < self->fd) && (EPOLLOUT & fd->revents)) {
+		self->blocked = false;
+		res = stream_flush (self);
+	}
+	if (res && ((EPOLLERR | EPOLLHUP) & fd->revents))
+	  res = false;
+	if (-1 < self->fd) {
+		if (!res || stream_is_done (self))
+		  stream_close (self);
+		else if (self->eof)
+		  fd->revents &= ~EPOLLIN;
+	}
+	hev_dns_stream_unref (self);
+
+	return true;
+}
+
+static void
+stream_timeout_handler (HevEventTimer *timer, void *data)
+{
+	HevDNSStream *self = data;
+	uint64_t idle = hev_event_loop_get_time (self->loop) - self->active_time;
+
+	/* idle connections are closed, busy ones are left alone */
+	if (hev_dns_stream_is_idle (self) && (IDLE_TIMEOUT <= idle)) {
+		stream_close (self);
+		return;
+	}
+	hev_event_loop_add_timer (self->loop, &self->timer,
+				(IDLE_TIMEOUT > idle) ? (IDLE_TIMEOUT - idle) : IDLE_TIMEOUT);
+}
+
+static void
+stream_resume_handler (HevEventTimer *timer, void *data)
+{
+	HevDNSStream *self = data;
+
+	hev_dns_stream_ref (self);
+	if (!self->eof && !stream_read (self))
+	  stream_close (self);
+	else if (stream_is_done (self))
+	  stream_close (self);
+	hev_dns_stream_unref (self);
+}
+
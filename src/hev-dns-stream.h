@@ -0,0 +1,45 @@
+/*
+ ============================================================================
+ Name        : hev-dns-stream.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS client stream connection
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_STREAM_H__
+#define __HEV_DNS_STREAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hev-event-loop.h"
+
+typedef struct _HevDNSStream HevDNSStream;
+typedef void (*HevDNSStreamQueryNotify) (HevDNSStream *self, uint8_t *msg,
+			size_t len, void *data);
+typedef void (*HevDNSStreamCloseNotify) (HevDNSStream *self, void *data);
+
+HevDNSStream * hev_dns_stream_new (HevEventLoop *loop, int fd,
+			HevDNSStreamQueryNotify query_notify,
+			HevDNSStreamCloseNotify close_notify, void *notify_data);
+
+HevDNSStream * hev_dns_stream_ref (HevDNSStream *self);
+void hev_dns_stream_unref (HevDNSStream *self);
+
+void hev_dns_stream_close (HevDNSStream *self);
+void hev_dns_stream_send (HevDNSStream *self, const void *msg, size_t len);
+
+/* a query is owed an answer while held */
+HevDNSStream * hev_dns_stream_hold (HevDNSStream *self);
+void hev_dns_stream_release (HevDNSStream *self);
+
+bool hev_dns_stream_is_idle (HevDNSStream *self);
+uint64_t hev_dns_stream_get_active_time (HevDNSStream *self);
+
+void hev_dns_stream_list_insert (HevDNSStream **list, HevDNSStream *self);
+void hev_dns_stream_list_remove (HevDNSStream **list, HevDNSStream *self);
+HevDNSStream * hev_dns_stream_list_next (HevDNSStream *self);
+
+#endif /* __HEV_DNS_STREAM_H__ */
+
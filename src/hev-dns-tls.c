@@ -0,0 +1,250 @@
+/*
+ ============================================================================
+ Name        : hev-dns-tls.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS over TLS context
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <string.h>
+#if defined(ENABLE_TLS)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "hev-dns-tls.h"
+#include "hev-memory-allocator.h"
+
+#if defined(ENABLE_TLS)
+
+/* tls 1.3 tickets are used once, keep a few for parallel handshakes */
+#define MAX_SESSIONS	(8)
+
+struct _HevDNSTLS
+{
+	unsigned int ref_count;
+	unsigned int session_count;
+
+	SSL_CTX *ctx;
+	/* tickets from the server, newest last, each resumes one handshake */
+	SSL_SESSION *sessions[MAX_SESSIONS];
+	char *server_name;
+};
+
+struct _HevDNSTLSConn
+{
+	SSL *ssl;
+	HevDNSTLS *tls;
+};
+
+static int
+tls_new_session_handler (SSL *ssl, SSL_SESSION *session)
+{
+	HevDNSTLS *self = SSL_CTX_get_app_data (SSL_get_SSL_CTX (ssl));
+
+	if (MAX_SESSIONS == self->session_count) {
+		SSL_SESSION_free (self->sessions[0]);
+		memmove (self->sessions, self->sessions + 1,
+					sizeof (SSL_SESSION *) * (MAX_SESSIONS - 1));
+		self->session_count --;
+	}
+	self->sessions[self->session_count ++] = session;
+
+	/* keep the reference */
+	return 1;
+}
+
+HevDNSTLS *
+hev_dns_tls_new (const char *server_name)
+{
+	HevDNSTLS *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSTLS));
+	if (self) {
+		self->ctx = SSL_CTX_new (TLS_client_method ());
+		if (!self->ctx) {
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+			return NULL;
+		}
+		self->ref_count = 1;
+		self->session_count = 0;
+		self->server_name = NULL;
+
+		SSL_CTX_set_app_data (self->ctx, self);
+		SSL_CTX_set_min_proto_version (self->ctx, TLS1_2_VERSION);
+		SSL_CTX_set_mode (self->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+					SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SSL_CTX_set_session_cache_mode (self->ctx,
+					SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb (self->ctx, tls_new_session_handler);
+
+		/* strict profile with a name, opportunistic without (rfc 7858) */
+		if (server_name && ('\0' != server_name[0])) {
+			self->server_name = HEV_MEMORY_ALLOCATOR_ALLOC (strlen (server_name) + 1);
+			if (self->server_name)
+			  strcpy (self->server_name, server_name);
+			SSL_CTX_set_default_verify_paths (self->ctx);
+			SSL_CTX_set_verify (self->ctx, SSL_VERIFY_PEER, NULL);
+		} else {
+			SSL_CTX_set_verify (self->ctx, SSL_VERIFY_NONE, NULL);
+		}
+	}
+
+	return self;
+}
+
+HevDNSTLS *
+hev_dns_tls_ref (HevDNSTLS *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_dns_tls_unref (HevDNSTLS *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			while (0 < self->session_count)
+			  SSL_SESSION_free (self->sessions[-- self->session_count]);
+			SSL_CTX_free (self->ctx);
+			HEV_MEMORY_ALLOCATOR_FREE (self->server_name);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+HevDNSTLSConn *
+hev_dns_tls_conn_new (HevDNSTLS *self, int fd)
+{
+	HevDNSTLSConn *conn;
+
+	if (!self)
+	  return NULL;
+
+	conn = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSTLSConn));
+	if (!conn)
+	  return NULL;
+	conn->ssl = SSL_new (self->ctx);
+	if (!conn->ssl || !SSL_set_fd (conn->ssl, fd)) {
+		hev_dns_tls_conn_free (conn);
+		return NULL;
+	}
+	if (self->server_name) {
+		SSL_set_tlsext_host_name (conn->ssl, self->server_name);
+		SSL_set1_host (conn->ssl, self->server_name);
+	}
+	if (0 < self->session_count) {
+		SSL_SESSION *session = self->sessions[-- self->session_count];
+
+		SSL_set_session (conn->ssl, session);
+		SSL_SESSION_free (session);
+	}
+	SSL_set_connect_state (conn->ssl);
+	conn->tls = hev_dns_tls_ref (self);
+
+	return conn;
+}
+
+void
+hev_dns_tls_conn_free (HevDNSTLSConn *conn)
+{
+	if (conn) {
+		if (conn->ssl)
+		  SSL_free (conn->ssl);
+		hev_dns_tls_unref (conn->tls);
+		HEV_MEMORY_ALLOCATOR_FREE (conn);
+	}
+}
+
+static ssize_t
+tls_error (HevDNSTLSConn *conn, int res)
+{
+	switch (SSL_get_error (conn->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	default:
+		ERR_clear_error ();
+		errno = EIO;
+		return -1;
+	}
+}
+
+ssize_t
+hev_dns_tls_conn_read (HevDNSTLSConn *conn, void *buf, size_t len)
+{
+	int res;
+
+	/* the handshake runs inside, on whichever side is ready */
+	res = SSL_read (conn->ssl, buf, len);
+	if (0 < res)
+	  return res;
+
+	return tls_error (conn, res);
+}
+
+ssize_t
+hev_dns_tls_conn_write (HevDNSTLSConn *conn, const void *buf, size_t len)
+{
+	int res;
+
+	res = SSL_write (conn->ssl, buf, len);
+	if (0 < res)
+	  return res;
+
+	return tls_error (conn, res);
+}
+
+#else /* !ENABLE_TLS */
+
+HevDNSTLS *
+hev_dns_tls_new (const char *server_name)
+{
+	return NULL;
+}
+
+HevDNSTLS *
+hev_dns_tls_ref (HevDNSTLS *self)
+{
+	return NULL;
+}
+
+void
+hev_dns_tls_unref (HevDNSTLS *self)
+{
+}
+
+HevDNSTLSConn *
+hev_dns_tls_conn_new (HevDNSTLS *self, int fd)
+{
+	return NULL;
+}
+
+void
+hev_dns_tls_conn_free (HevDNSTLSConn *conn)
+{
+}
+
+ssize_t
+hev_dns_tls_conn_read (HevDNSTLSConn *conn, void *buf, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t
+hev_dns_tls_conn_write (HevDNSTLSConn *conn, const void *buf, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
+
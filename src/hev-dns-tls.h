@@ -0,0 +1,32 @@
+/*
+ ============================================================================
+ Name        : hev-dns-tls.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS over TLS context
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_TLS_H__
+#define __HEV_DNS_TLS_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct _HevDNSTLS HevDNSTLS;
+typedef struct _HevDNSTLSConn HevDNSTLSConn;
+
+HevDNSTLS * hev_dns_tls_new (const char *server_name);
+
+HevDNSTLS * hev_dns_tls_ref (HevDNSTLS *self);
+void hev_dns_tls_unref (HevDNSTLS *self);
+
+HevDNSTLSConn * hev_dns_tls_conn_new (HevDNSTLS *self, int fd);
+void hev_dns_tls_conn_free (HevDNSTLSConn *conn);
+
+/* -1 with errno EAGAIN when the socket is not ready, as read/write */
+ssize_t hev_dns_tls_conn_read (HevDNSTLSConn *conn, void *buf, size_t len);
+ssize_t hev_dns_tls_conn_write (HevDNSTLSConn *conn, const void *buf, size_t len);
+
+#endif /* __HEV_DNS_TLS_H__ */
+
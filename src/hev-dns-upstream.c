@@ -0,0 +1,1047 @@
+/*
+ ============================================================================
+ Name        : hev-dns-upstream.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS upstream connection
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include "hev-dns-upstream.h"
+#include "hev-dns-address.h"
+#include "hev-dns-message.h"
+#include "hev-dns-stats.h"
+#include "hev-ring-buffer.h"
+#include "hev-event-source-fds.h"
+
+#define MAX_PENDING	(256)
+#define MAX_RETRIES	(1)
+#define BUFFER_SIZE	(128 * 1024)
+/* grown to the length prefix of a larger response */
+#define RECV_SIZE	(16 * 1024)
+#define TIMEOUT		(5 * 1000)
+/* udp: datagrams per system call, and the room for each */
+#define DATAGRAM_BATCH	(16)
+#define DATAGRAM_SIZE	(4096)
+/* udp: queries spread over a few sockets, so a few source ports, each
+ * replaced by a fresh one after half to all of this many queries */
+#define UDP_SOCKETS	(4)
+#define ROTATE_QUERIES	(256)
+/* random bytes taken from the kernel at a time */
+#define RANDOM_POOL	(256)
+
+enum
+{
+	REMOTE_IN = (1 << 1),
+	REMOTE_OUT = (1 << 0),
+};
+
+typedef struct _HevDNSUpstreamSlot HevDNSUpstreamSlot;
+typedef struct _HevDNSUpstreamSocket HevDNSUpstreamSocket;
+
+struct _HevDNSUpstreamSlot
+{
+	uint16_t id;
+	uint16_t orig_id;
+	uint16_t len;
+	uint8_t retries;
+	/* udp: the socket it went out on, and must come back on */
+	uint8_t sock;
+	bool used;
+	uint8_t *msg;
+	HevDNSUpstreamNotify notify;
+	void *notify_data;
+};
+
+struct _HevDNSUpstreamSocket
+{
+	int fd;
+	unsigned int pending;
+	unsigned int queries;
+	unsigned int limit;
+	HevEventSourceFD *remote_fd;
+};
+
+struct _HevDNSUpstream
+{
+	int fd;
+	unsigned int ref_count;
+	unsigned int pending;
+	unsigned int free_count;
+	uint8_t revents;
+	bool busy;
+	bool cork;
+	/* some bytes went through since connecting */
+	bool connected;
+	HevDNSTransport transport;
+	/* tcp: one query on the wire, the rest wait in the forward buffer */
+	bool waiting;
+	size_t frame_left;
+	/* udp: ids of queries not sent yet, and the sockets they go out on */
+	unsigned int unsent_head;
+	unsigned int unsent_tail;
+	uint16_t unsent[MAX_PENDING];
+	HevDNSUpstreamSocket socks[UDP_SOCKETS];
+	HevEventSourceFD *remote_fd;
+	HevEventSource *source;
+	HevEventLoop *loop;
+	HevEventTimer timer;
+	HevRingBuffer *forward_buffer;
+	/* responses are dispatched in place, contiguous */
+	uint8_t *recv_buffer;
+	size_t recv_size;
+	size_t recv_len;
+	HevDNSUpstreamDrainNotify drain_notify;
+	void *drain_notify_data;
+	/* dns over tls when set */
+	HevDNSTLS *tls;
+	HevDNSTLSConn *tls_conn;
+	struct sockaddr_storage addr;
+	uint16_t free_slots[MAX_PENDING];
+	HevDNSUpstreamSlot slots[MAX_PENDING];
+	/* random ids, the slot of each, checked against the slot's id */
+	uint8_t id_slots[UINT16_MAX + 1];
+};
+
+static bool dns_do_connect (HevDNSUpstream *self);
+static void dns_do_close (HevDNSUpstream *self);
+static void dns_do_reset (HevDNSUpstream *self);
+static bool remote_write (HevDNSUpstream *self);
+static bool upstream_source_handler (HevEventSourceFD *fd, void *data);
+static void upstream_timeout_handler (HevEventTimer *timer, void *data);
+
+static bool
+dns_random (void *buf, size_t len)
+{
+	static __thread uint8_t pool[RANDOM_POOL];
+	static __thread size_t left = 0;
+
+	/* the kernel's csprng, nothing on the wire tells of what comes next */
+	if (left < len) {
+		ssize_t res;
+
+		do {
+			res = getrandom (pool, sizeof (pool), 0);
+		} while ((0 > res) && (EINTR == errno));
+		if (sizeof (pool) != res)
+		  return false;
+		left = sizeof (pool);
+	}
+	left -= len;
+	memcpy (buf, pool + left, len);
+
+	return true;
+}
+
+HevDNSUpstream *
+hev_dns_upstream_new (HevEventLoop *loop, struct sockaddr_storage *addr,
+			HevDNSTransport transport, HevDNSTLS *tls)
+{
+	HevDNSUpstream *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevDNSUpstream));
+	if (self) {
+		unsigned int i;
+
+		self->fd = -1;
+		self->ref_count = 1;
+		self->pending = 0;
+		self->revents = 0;
+		self->busy = false;
+		self->cork = false;
+		self->connected = false;
+		self->transport = transport;
+		self->waiting = false;
+		self->frame_left = 0;
+		self->unsent_head = 0;
+		self->unsent_tail = 0;
+		self->drain_notify = NULL;
+		self->drain_notify_data = NULL;
+		self->remote_fd = NULL;
+		self->tls = (HEV_DNS_TRANSPORT_TLS == transport) ?
+			hev_dns_tls_ref (tls) : NULL;
+		self->tls_conn = NULL;
+		self->loop = loop;
+		hev_event_timer_init (&self->timer, upstream_timeout_handler, self);
+		memcpy (&self->addr, addr, hev_dns_address_get_len (addr));
+		for (i=0; i<MAX_PENDING; i++) {
+			self->slots[i].used = false;
+			self->free_slots[i] = MAX_PENDING - 1 - i;
+		}
+		for (i=0; i<UDP_SOCKETS; i++) {
+			self->socks[i].fd = -1;
+			self->socks[i].pending = 0;
+			self->socks[i].queries = 0;
+			self->socks[i].limit = 0;
+			self->socks[i].remote_fd = NULL;
+		}
+		memset (self->id_slots, 0, sizeof (self->id_slots));
+		self->free_count = MAX_PENDING;
+		/* datagrams are sent straight from the slots */
+		self->forward_buffer = (HEV_DNS_TRANSPORT_UDP != transport) ?
+			hev_ring_buffer_new (BUFFER_SIZE) : NULL;
+		self->recv_buffer = NULL;
+		self->recv_size = 0;
+		self->recv_len = 0;
+
+		self->source = hev_event_source_fds_new ();
+		hev_event_source_set_callback (self->source,
+					(HevEventSourceFunc) upstream_source_handler, self, NULL);
+		hev_event_loop_add_source (loop, self->source);
+	}
+
+	return self;
+}
+
+HevDNSUpstream *
+hev_dns_upstream_ref (HevDNSUpstream *self)
+{
+	if (self)
+	  self->ref_count ++;
+
+	return self;
+}
+
+void
+hev_dns_upstream_unref (HevDNSUpstream *self)
+{
+	if (self) {
+		self->ref_count --;
+		if (0 == self->ref_count) {
+			unsigned int i;
+
+			hev_event_loop_del_timer (self->loop, &self->timer);
+			dns_do_close (self);
+			hev_event_loop_del_source (self->loop, self->source);
+			hev_event_source_unref (self->source);
+			hev_dns_tls_unref (self->tls);
+			for (i=0; i<MAX_PENDING; i++) {
+				if (self->slots[i].used)
+				  HEV_MEMORY_ALLOCATOR_FREE (self->slots[i].msg);
+			}
+			hev_ring_buffer_unref (self->forward_buffer);
+			HEV_MEMORY_ALLOCATOR_FREE (self);
+		}
+	}
+}
+
+static size_t
+iovec_size (struct iovec *iovec, size_t iovec_len)
+{
+	size_t i = 0, size = 0;
+
+	for (i=0; i<iovec_len; i++)
+	  size += iovec[i].iov_len;
+
+	return size;
+}
+
+static void
+iovec_copy_out (struct iovec *iovec, size_t iovec_len, void *data, size_t len)
+{
+	size_t i;
+
+	for (i=0; (i<iovec_len) && (0 < len); i++) {
+		size_t n = (iovec[i].iov_len < len) ? iovec[i].iov_len : len;
+
+		memcpy (data, iovec[i].iov_base, n);
+		data += n;
+		len -= n;
+	}
+}
+
+static size_t
+iovec_limit (struct iovec *iovec, size_t iovec_len, size_t len)
+{
+	size_t i;
+
+	for (i=0; (i<iovec_len) && (0 < len); i++) {
+		if (iovec[i].iov_len > len)
+		  iovec[i].iov_len = len;
+		len -= iovec[i].iov_len;
+	}
+
+	return i;
+}
+
+static void
+iovec_copy_in (struct iovec *iovec, size_t iovec_len, size_t offset,
+			const void *data, size_t len)
+{
+	size_t i;
+
+	for (i=0; (i<iovec_len) && (0 < len); i++) {
+		size_t n;
+
+		if (offset >= iovec[i].iov_len) {
+			offset -= iovec[i].iov_len;
+			continue;
+		}
+		n = iovec[i].iov_len - offset;
+		if (n > len)
+		  n = len;
+		memcpy (iovec[i].iov_base + offset, data, n);
+		data += n;
+		len -= n;
+		offset = 0;
+	}
+}
+
+static HevDNSUpstreamSlot *
+dns_find_slot (HevDNSUpstream *self, uint16_t id)
+{
+	HevDNSUpstreamSlot *slot = &self->slots[self->id_slots[id]];
+
+	return (slot->used && (slot->id == id)) ? slot : NULL;
+}
+
+static bool
+dns_enqueue_request (HevDNSUpstream *self, HevDNSUpstreamSlot *slot)
+{
+	struct iovec iovec[2];
+	size_t iovec_len;
+	uint16_t plen = htons (slot->len);
+
+	if (HEV_DNS_TRANSPORT_UDP == self->transport) {
+		/* at most one live id per slot, drop stale ones when full */
+		if (MAX_PENDING == self->unsent_tail) {
+			unsigned int i, tail = 0;
+
+			for (i=self->unsent_head; i<self->unsent_tail; i++) {
+				if (dns_find_slot (self, self->unsent[i]))
+				  self->unsent[tail ++] = self->unsent[i];
+			}
+			self->unsent_head = 0;
+			self->unsent_tail = tail;
+		}
+		self->unsent[self->unsent_tail ++] = slot->id;
+		return true;
+	}
+
+	iovec_len = hev_ring_buffer_writing (self->forward_buffer, iovec);
+	if ((slot->len + 2) > iovec_size (iovec, iovec_len))
+	  return false;
+
+	iovec_copy_in (iovec, iovec_len, 0, &plen, 2);
+	iovec_copy_in (iovec, iovec_len, 2, slot->msg, slot->len);
+	hev_ring_buffer_write_finish (self->forward_buffer, slot->len + 2);
+
+	return true;
+}
+
+static HevDNSUpstreamSlot *
+dns_alloc_slot (HevDNSUpstream *self)
+{
+	HevDNSUpstreamSlot *slot;
+	uint16_t index, id;
+
+	if (0 == self->free_count)
+	  return NULL;
+
+	/* all 16 bits random, one in flight is never handed out twice */
+	do {
+		if (!dns_random (&id, sizeof (id)))
+		  return NULL;
+	} while (dns_find_slot (self, id));
+
+	self->free_count --;
+	index = self->free_slots[self->free_count];
+	slot = &self->slots[index];
+	slot->id = id;
+	self->id_slots[id] = index;
+	slot->sock = 0;
+	slot->used = true;
+	slot->retries = 0;
+	self->pending ++;
+
+	return slot;
+}
+
+static void
+dns_free_slot (HevDNSUpstream *self, HevDNSUpstreamSlot *slot)
+{
+	HEV_MEMORY_ALLOCATOR_FREE (slot->msg);
+	slot->msg = NULL;
+	slot->used = false;
+	if (HEV_DNS_TRANSPORT_UDP == self->transport)
+	  self->socks[slot->sock].pending --;
+	self->free_slots[self->free_count ++] = slot - self->slots;
+	self->pending --;
+	if (0 == self->pending)
+	  hev_event_loop_del_timer (self->loop, &self->timer);
+}
+
+static bool
+dns_open_socket (HevDNSUpstream *self, HevDNSUpstreamSocket *sock)
+{
+	int nonblock = 1;
+	uint16_t limit;
+
+	if (!dns_random (&limit, sizeof (limit)))
+	  return false;
+	sock->fd = socket (self->addr.ss_family, SOCK_DGRAM, 0);
+	if (-1 == sock->fd)
+	  return false;
+	ioctl (sock->fd, FIONBIO, (char *) &nonblock);
+	/* the sockets do not wear out all at once */
+	sock->queries = 0;
+	sock->limit = ROTATE_QUERIES / 2 + limit % (ROTATE_QUERIES / 2);
+	hev_dns_stats_inc (HEV_DNS_STATS_UPSTREAM_CONNECTS);
+	sock->remote_fd = hev_event_source_add_fd (self->source,
+				sock->fd, EPOLLIN | EPOLLOUT | EPOLLET);
+	/* a random port by it, and only answers from the server get through */
+	return 0 == connect (sock->fd, (struct sockaddr *) &self->addr,
+				hev_dns_address_get_len (&self->addr));
+}
+
+static void
+dns_close_socket (HevDNSUpstream *self, HevDNSUpstreamSocket *sock)
+{
+	if (-1 < sock->fd) {
+		hev_event_source_del_fd (self->source, sock->fd);
+		close (sock->fd);
+		sock->fd = -1;
+	}
+	sock->remote_fd = NULL;
+}
+
+static int
+dns_pick_socket (HevDNSUpstream *self)
+{
+	unsigned int i;
+	uint8_t start;
+
+	if (!dns_random (&start, sizeof (start)))
+	  return -1;
+
+	/* any that is not used up, or used up and idle, so given a new port */
+	for (i=0; i<UDP_SOCKETS; i++) {
+		unsigned int index = (start + i) % UDP_SOCKETS;
+		HevDNSUpstreamSocket *sock = &self->socks[index];
+
+		if ((-1 == self->fd) || (sock->queries < sock->limit))
+		  return index;
+		if ((0 < sock->pending) || self->busy)
+		  continue;
+		dns_close_socket (self, sock);
+		if (!dns_open_socket (self, sock))
+		  dns_close_socket (self, sock);
+		/* none, when the first failed, opened again by the next query */
+		self->fd = self->socks[0].fd;
+		if (-1 < sock->fd)
+		  return index;
+	}
+
+	/* all still waiting on answers, they take a few more */
+	for (i=0; i<UDP_SOCKETS; i++) {
+		unsigned int index = (start + i) % UDP_SOCKETS;
+
+		if (-1 < self->socks[index].fd)
+		  return index;
+	}
+
+	return -1;
+}
+
+int
+hev_dns_upstream_query (HevDNSUpstream *self, const void *msg, size_t len,
+			HevDNSUpstreamNotify notify, void *notify_data)
+{
+	HevDNSUpstreamSlot *slot;
+	const uint8_t *data = msg;
+	int sock = 0;
+
+	if (!self || !msg || (12 > len) || (UINT16_MAX < len))
+	  return -1;
+
+	if (HEV_DNS_TRANSPORT_UDP == self->transport) {
+		sock = dns_pick_socket (self);
+		if (0 > sock)
+		  return -1;
+	}
+
+	slot = dns_alloc_slot (self);
+	if (!slot)
+	  return -1;
+	if (HEV_DNS_TRANSPORT_UDP == self->transport) {
+		slot->sock = sock;
+		self->socks[sock].pending ++;
+	}
+
+	slot->msg = HEV_MEMORY_ALLOCATOR_ALLOC (len);
+	if (!slot->msg) {
+		slot->msg = NULL;
+		dns_free_slot (self, slot);
+		return -1;
+	}
+	memcpy (slot->msg, msg, len);
+	slot->len = len;
+	slot->orig_id = (data[0] << 8) | data[1];
+	slot->msg[0] = slot->id >> 8;
+	slot->msg[1] = slot->id & 0xff;
+	slot->notify = notify;
+	slot->notify_data = notify_data;
+
+	if (!dns_enqueue_request (self, slot)) {
+		dns_free_slot (self, slot);
+		return -1;
+	}
+	hev_dns_stats_inc (HEV_DNS_STATS_UPSTREAM_QUERIES);
+	/* a connection that stops answering is reset */
+	if (!hev_event_timer_is_pending (&self->timer))
+	  hev_event_loop_add_timer (self->loop, &self->timer, TIMEOUT);
+
+	if ((-1 == self->fd) && !dns_do_connect (self)) {
+		dns_do_close (self);
+		dns_free_slot (self, slot);
+		return -1;
+	}
+	if (HEV_DNS_TRANSPORT_UDP == self->transport)
+	  self->socks[sock].queries ++;
+	if (self->busy || self->cork) {
+		/* requests will be flushed after dispatching or uncorking */
+	} else if (REMOTE_OUT & self->revents) {
+		/* on error, the connection will be reset by event handler */
+		if (!remote_write (self))
+		  self->revents &= ~REMOTE_OUT;
+	}
+
+	return slot->id;
+}
+
+void
+hev_dns_upstream_cancel (HevDNSUpstream *self, int handle)
+{
+	if (self && (0 <= handle) && (UINT16_MAX >= handle)) {
+		HevDNSUpstreamSlot *slot = dns_find_slot (self, handle);
+		if (slot)
+		  dns_free_slot (self, slot);
+	}
+}
+
+void
+hev_dns_upstream_set_cork (HevDNSUpstream *self, bool cork)
+{
+	if (!self || (self->cork == cork))
+	  return;
+
+	self->cork = cork;
+	if (!cork && !self->busy && (REMOTE_OUT & self->revents)) {
+		if (!remote_write (self))
+		  self->revents &= ~REMOTE_OUT;
+	}
+}
+
+void
+hev_dns_upstream_set_drain_notify (HevDNSUpstream *self,
+			HevDNSUpstreamDrainNotify notify, void *notify_data)
+{
+	if (self) {
+		self->drain_notify = notify;
+		self->drain_notify_data = notify_data;
+	}
+}
+
+unsigned int
+hev_dns_upstream_get_pending (HevDNSUpstream *self)
+{
+	return self ? self->pending : 0;
+}
+
+HevDNSTransport
+hev_dns_upstream_get_transport (HevDNSUpstream *self)
+{
+	return self ? self->transport : HEV_DNS_TRANSPORT_TCP_PIPELINED;
+}
+
+static bool
+dns_do_connect (HevDNSUpstream *self)
+{
+	int nonblock = 1;
+	unsigned int i;
+
+	/* udp: those closed, writable at once, fd tells the first one */
+	if (HEV_DNS_TRANSPORT_UDP == self->transport) {
+		for (i=0; i<UDP_SOCKETS; i++) {
+			if ((-1 == self->socks[i].fd) &&
+						!dns_open_socket (self, &self->socks[i]))
+			  return false;
+		}
+		self->fd = self->socks[0].fd;
+		self->revents = REMOTE_OUT;
+		self->connected = true;
+		return true;
+	}
+
+	self->fd = socket (self->addr.ss_family, SOCK_STREAM, 0);
+	if (-1 == self->fd)
+	  return false;
+	ioctl (self->fd, FIONBIO, (char *) &nonblock);
+	if (self->tls) {
+		self->tls_conn = hev_dns_tls_conn_new (self->tls, self->fd);
+		if (!self->tls_conn)
+		  return false;
+	}
+	self->revents = 0;
+	self->connected = false;
+	hev_dns_stats_inc (HEV_DNS_STATS_UPSTREAM_CONNECTS);
+	/* add fd to source */
+	self->remote_fd = hev_event_source_add_fd (self->source,
+				self->fd, EPOLLIN | EPOLLOUT | EPOLLET);
+	/* connect to remote host */
+	if (0 > connect (self->fd, (struct sockaddr *) &self->addr,
+					hev_dns_address_get_len (&self->addr))) {
+		if (EINPROGRESS != errno)
+		  return false;
+	}
+
+	return true;
+}
+
+static void
+dns_do_close (HevDNSUpstream *self)
+{
+	unsigned int i;
+
+	hev_dns_tls_conn_free (self->tls_conn);
+	self->tls_conn = NULL;
+	if (HEV_DNS_TRANSPORT_UDP == self->transport) {
+		for (i=0; i<UDP_SOCKETS; i++)
+		  dns_close_socket (self, &self->socks[i]);
+		self->fd = -1;
+	} else if (-1 < self->fd) {
+		hev_event_source_del_fd (self->source, self->fd);
+		close (self->fd);
+		self->fd = -1;
+	}
+	self->remote_fd = NULL;
+	self->revents = 0;
+	self->waiting = false;
+	self->frame_left = 0;
+	self->unsent_head = 0;
+	self->unsent_tail = 0;
+	hev_ring_buffer_reset (self->forward_buffer);
+	HEV_MEMORY_ALLOCATOR_FREE (self->recv_buffer);
+	self->recv_buffer = NULL;
+	self->recv_size = 0;
+	self->recv_len = 0;
+}
+
+static void
+dns_do_reset (HevDNSUpstream *self)
+{
+	HevDNSUpstreamNotify notifies[MAX_PENDING];
+	void *notify_datas[MAX_PENDING];
+	unsigned int i, failed = 0;
+	bool retry;
+
+	dns_do_close (self);
+
+	/* resend pending requests on a new connection, fail if retried too many */
+	retry = (0 < self->pending) && dns_do_connect (self);
+	for (i=0; i<MAX_PENDING; i++) {
+		HevDNSUpstreamSlot *slot = &self->slots[i];
+
+		if (!slot->used)
+		  continue;
+		if (retry && (MAX_RETRIES > slot->retries) &&
+					dns_enqueue_request (self, slot)) {
+			slot->retries ++;
+			hev_dns_stats_inc (HEV_DNS_STATS_UPSTREAM_RETRIES);
+			continue;
+		}
+		notifies[failed] = slot->notify;
+		notify_datas[failed] = slot->notify_data;
+		failed ++;
+		dns_free_slot (self, slot);
+	}
+	if (0 == self->pending)
+	  dns_do_close (self);
+	else
+	  hev_event_loop_add_timer (self->loop, &self->timer, TIMEOUT);
+
+	for (i=0; i<failed; i++)
+	  notifies[i] (NULL, 0, notify_datas[i]);
+}
+
+static ssize_t
+dns_read (HevDNSUpstream *self, void *buf, size_t len)
+{
+	if (self->tls_conn)
+	  return hev_dns_tls_conn_read (self->tls_conn, buf, len);
+
+	return read (self->fd, buf, len);
+}
+
+static ssize_t
+dns_writev (HevDNSUpstream *self, struct iovec *iovec, size_t iovec_len)
+{
+	if (self->tls_conn)
+	  return hev_dns_tls_conn_write (self->tls_conn, iovec[0].iov_base,
+				  iovec[0].iov_len);
+
+	return writev (self->fd, iovec, iovec_len);
+}
+
+static bool
+remote_write_datagrams (HevDNSUpstream *self)
+{
+	unsigned int i;
+
+	while (self->unsent_head < self->unsent_tail) {
+		struct mmsghdr msgs[DATAGRAM_BATCH];
+		struct iovec iovec[DATAGRAM_BATCH];
+		unsigned int ends[DATAGRAM_BATCH];
+		unsigned int i, count = 0;
+		HevDNSUpstreamSocket *sock = NULL;
+		int res;
+
+		/* straight from the slots, cancelled ones are skipped, a run of
+		 * those on the same socket at a time */
+		for (i=self->unsent_head; (i<self->unsent_tail) && (DATAGRAM_BATCH > count); i++) {
+			HevDNSUpstreamSlot *slot = dns_find_slot (self, self->unsent[i]);
+
+			if (!slot)
+			  continue;
+			if (!sock)
+			  sock = &self->socks[slot->sock];
+			else if (sock != &self->socks[slot->sock])
+			  break;
+			iovec[count].iov_base = slot->msg;
+			iovec[count].iov_len = slot->len;
+			memset (&msgs[count], 0, sizeof (struct mmsghdr));
+			msgs[count].msg_hdr.msg_iov = &iovec[count];
+			msgs[count].msg_hdr.msg_iovlen = 1;
+			ends[count ++] = i + 1;
+		}
+		if (0 == count) {
+			self->unsent_head = i;
+			continue;
+		}
+
+		res = sendmmsg (sock->fd, msgs, count, 0);
+		if (0 > res) {
+			if (EAGAIN == errno) {
+				self->revents &= ~REMOTE_OUT;
+				if (sock->remote_fd)
+				  sock->remote_fd->revents &= ~EPOLLOUT;
+				return true;
+			}
+			return false;
+		}
+		self->unsent_head = ends[res - 1];
+	}
+
+	self->unsent_head = 0;
+	self->unsent_tail = 0;
+	for (i=0; i<UDP_SOCKETS; i++) {
+		if (self->socks[i].remote_fd)
+		  self->socks[i].remote_fd->revents &= ~EPOLLOUT;
+	}
+
+	return true;
+}
+
+static bool
+remote_write (HevDNSUpstream *self)
+{
+	if (HEV_DNS_TRANSPORT_UDP == self->transport)
+	  return remote_write_datagrams (self);
+
+	for (;;) {
+		struct iovec iovec[2];
+		size_t iovec_len;
+		ssize_t size;
+
+		iovec_len = hev_ring_buffer_reading (self->forward_buffer, iovec);
+		if ((0 == iovec_len) || self->waiting) {
+			if (self->remote_fd)
+			  self->remote_fd->revents &= ~EPOLLOUT;
+			break;
+		}
+		/* not pipelined, only the next query until it is answered */
+		if (HEV_DNS_TRANSPORT_TCP == self->transport) {
+			if (0 == self->frame_left) {
+				uint8_t plen[2];
+
+				iovec_copy_out (iovec, iovec_len, plen, 2);
+				self->frame_left = 2 + hev_dns_message_get_u16 (plen);
+			}
+			iovec_len = iovec_limit (iovec, iovec_len, self->frame_left);
+		}
+		size = dns_writev (self, iovec, iovec_len);
+		if (0 > size) {
+			if (EAGAIN == errno) {
+				self->revents &= ~REMOTE_OUT;
+				if (self->remote_fd)
+				  self->remote_fd->revents &= ~EPOLLOUT;
+				break;
+			}
+			return false;
+		}
+		hev_ring_buffer_read_finish (self->forward_buffer, size);
+		self->connected = true;
+		if (HEV_DNS_TRANSPORT_TCP == self->transport) {
+			self->frame_left -= size;
+			self->waiting = 0 == self->frame_left;
+		}
+	}
+
+	return true;
+}
+
+static void
+dns_dispatch_response (HevDNSUpstream *self, HevDNSUpstreamSocket *sock,
+			uint8_t *msg, size_t len)
+{
+	HevDNSUpstreamSlot *slot;
+	HevDNSUpstreamNotify notify;
+	void *notify_data;
+	uint16_t id;
+
+	if (12 > len)
+	  return;
+
+	id = (msg[0] << 8) | msg[1];
+	slot = dns_find_slot (self, id);
+	if (!slot)
+	  return;
+	/* a datagram must come in on its socket */
+	if ((HEV_DNS_TRANSPORT_UDP == self->transport) && (sock != &self->socks[slot->sock]))
+	  return;
+	/* any answer must echo the question as sent, a late one may find its id
+	 * reused by another query, a bare header is left to the session */
+	if (HEV_DNS_HEADER_SIZE < len) {
+		ssize_t end = hev_dns_message_get_question_end (slot->msg, slot->len);
+
+		if ((0 > end) || (end > len) ||
+					(0 != memcmp (msg + HEV_DNS_HEADER_SIZE,
+							slot->msg + HEV_DNS_HEADER_SIZE,
+							end - HEV_DNS_HEADER_SIZE)))
+		  return;
+	}
+
+	/* restore client's message id */
+	msg[0] = slot->orig_id >> 8;
+	msg[1] = slot->orig_id & 0xff;
+	notify = slot->notify;
+	notify_data = slot->notify_data;
+	dns_free_slot (self, slot);
+
+	notify (msg, len, notify_data);
+}
+
+static size_t
+dns_read_responses (HevDNSUpstream *self)
+{
+	size_t offset = 0;
+
+	while ((offset + 2) <= self->recv_len) {
+		uint8_t *frame = self->recv_buffer + offset;
+		size_t len = (frame[0] << 8) | frame[1];
+
+		if ((offset + 2 + len) > self->recv_len)
+		  break;
+		self->waiting = false;
+		dns_dispatch_response (self, NULL, frame + 2, len);
+		offset += 2 + len;
+	}
+
+	return offset;
+}
+
+static bool
+dns_reserve_recv (HevDNSUpstream *self)
+{
+	size_t size = RECV_SIZE;
+	uint8_t *buffer;
+
+	/* a partial frame is at the start, make room for all of it */
+	if (2 <= self->recv_len)
+	  size = 2 + ((self->recv_buffer[0] << 8) | self->recv_buffer[1]);
+	if (RECV_SIZE > size)
+	  size = RECV_SIZE;
+	if (size <= self->recv_size)
+	  return true;
+
+	buffer = HEV_MEMORY_ALLOCATOR_ALLOC (size);
+	if (!buffer)
+	  return false;
+	if (self->recv_buffer) {
+		memcpy (buffer, self->recv_buffer, self->recv_len);
+		HEV_MEMORY_ALLOCATOR_FREE (self->recv_buffer);
+	}
+	self->recv_buffer = buffer;
+	self->recv_size = size;
+
+	return true;
+}
+
+static bool
+remote_read_datagrams (HevDNSUpstream *self, HevDNSUpstreamSocket *sock)
+{
+	if (!self->recv_buffer) {
+		self->recv_buffer = HEV_MEMORY_ALLOCATOR_ALLOC (DATAGRAM_BATCH * DATAGRAM_SIZE);
+		if (!self->recv_buffer)
+		  return false;
+		self->recv_size = DATAGRAM_BATCH * DATAGRAM_SIZE;
+	}
+
+	for (;;) {
+		struct mmsghdr msgs[DATAGRAM_BATCH];
+		struct iovec iovec[DATAGRAM_BATCH];
+		int i, count;
+
+		for (i=0; i<DATAGRAM_BATCH; i++) {
+			iovec[i].iov_base = self->recv_buffer + i * DATAGRAM_SIZE;
+			iovec[i].iov_len = DATAGRAM_SIZE;
+			memset (&msgs[i], 0, sizeof (struct mmsghdr));
+			msgs[i].msg_hdr.msg_iov = &iovec[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		count = recvmmsg (sock->fd, msgs, DATAGRAM_BATCH, 0, NULL);
+		if (0 > count) {
+			if (EAGAIN == errno) {
+				self->revents &= ~REMOTE_IN;
+				sock->remote_fd->revents &= ~EPOLLIN;
+				break;
+			}
+			return false;
+		}
+		if (0 < self->pending)
+		  hev_event_loop_add_timer (self->loop, &self->timer, TIMEOUT);
+
+		for (i=0; i<count; i++) {
+			uint8_t *msg = iovec[i].iov_base;
+			size_t len = msgs[i].msg_len;
+
+			/* too large to hold, the header alone asks for tcp */
+			if ((MSG_TRUNC & msgs[i].msg_hdr.msg_flags) &&
+						(HEV_DNS_HEADER_SIZE <= len)) {
+				hev_dns_message_set_u16 (msg + 2,
+							hev_dns_message_get_flags (msg) | HEV_DNS_FLAG_TC);
+				len = HEV_DNS_HEADER_SIZE;
+			}
+			dns_dispatch_response (self, sock, msg, len);
+		}
+		/* dispatched responses may be referenced until the drain */
+		if (self->drain_notify)
+		  self->drain_notify (self, self->drain_notify_data);
+	}
+
+	return true;
+}
+
+static bool
+remote_read (HevDNSUpstream *self)
+{
+	for (;;) {
+		size_t offset;
+		ssize_t size;
+
+		if (!dns_reserve_recv (self))
+		  return false;
+		size = dns_read (self, self->recv_buffer + self->recv_len,
+					self->recv_size - self->recv_len);
+		if (0 > size) {
+			if (EAGAIN == errno) {
+				self->revents &= ~REMOTE_IN;
+				self->remote_fd->revents &= ~EPOLLIN;
+				break;
+			}
+			return false;
+		} else if (0 == size) {
+			return false;
+		}
+		self->recv_len += size;
+		self->connected = true;
+		if (0 < self->pending)
+		  hev_event_loop_add_timer (self->loop, &self->timer, TIMEOUT);
+
+		offset = dns_read_responses (self);
+		if (0 == offset)
+		  continue;
+		/* dispatched responses may be referenced until the drain */
+		if (self->drain_notify)
+		  self->drain_notify (self, self->drain_notify_data);
+		self->recv_len -= offset;
+		if (0 < self->recv_len) {
+			memmove (self->recv_buffer, self->recv_buffer + offset, self->recv_len);
+		} else if (RECV_SIZE < self->recv_size) {
+			/* back to the default size after a large response */
+			HEV_MEMORY_ALLOCATOR_FREE (self->recv_buffer);
+			self->recv_buffer = NULL;
+			self->recv_size = 0;
+		}
+	}
+
+	return true;
+}
+
+static bool
+upstream_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevDNSUpstream *self = data;
+	HevDNSUpstreamSocket *sock = NULL;
+	unsigned int i;
+	bool res = true;
+
+	/* udp: one of the sockets, the answers read are those it sent */
+	if (HEV_DNS_TRANSPORT_UDP == self->transport) {
+		for (i=0; (i<UDP_SOCKETS) && !sock; i++) {
+			if (fd == self->socks[i].remote_fd)
+			  sock = &self->socks[i];
+		}
+	}
+	if (!sock && (fd != self->remote_fd)) {
+		fd->revents = 0;
+		return true;
+	}
+
+	if (EPOLLIN & fd->revents)
+	  self->revents |= REMOTE_IN;
+	if (EPOLLOUT & fd->revents)
+	  self->revents |= REMOTE_OUT;
+
+	self->busy = true;
+	if (REMOTE_IN & self->revents)
+	  res = sock ? remote_read_datagrams (self, sock) : remote_read (self);
+	if (res && ((EPOLLERR | EPOLLHUP) & fd->revents))
+	  res = false;
+	/* a handshake finished by reading leaves requests to write */
+	if (res && ((REMOTE_OUT & self->revents) || self->tls_conn))
+	  res = remote_write (self);
+	self->busy = false;
+
+	if (!res) {
+		/* an idle connection closed by the server is no error */
+		if (0 < self->pending)
+		  hev_dns_stats_inc (self->connected ? HEV_DNS_STATS_ERROR_RESET :
+					  HEV_DNS_STATS_ERROR_CONNECT);
+		dns_do_reset (self);
+	}
+	if (self->drain_notify)
+	  self->drain_notify (self, self->drain_notify_data);
+
+	return true;
+}
+
+static void
+upstream_timeout_handler (HevEventTimer *timer, void *data)
+{
+	HevDNSUpstream *self = data;
+
+	hev_dns_stats_inc (self->connected ? HEV_DNS_STATS_ERROR_UPSTREAM_TIMEOUT :
+				HEV_DNS_STATS_ERROR_CONNECT);
+	dns_do_reset (self);
+}
+
@@ -0,0 +1,53 @@
+/*
+ ============================================================================
+ Name        : hev-dns-upstream.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : DNS upstream connection
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_UPSTREAM_H__
+#define __HEV_DNS_UPSTREAM_H__
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "hev-event-loop.h"
+#include "hev-dns-tls.h"
+
+typedef struct _HevDNSUpstream HevDNSUpstream;
+typedef enum _HevDNSTransport HevDNSTransport;
+
+enum _HevDNSTransport
+{
+	HEV_DNS_TRANSPORT_UDP,
+	/* one query at a time per connection */
+	HEV_DNS_TRANSPORT_TCP,
+	HEV_DNS_TRANSPORT_TCP_PIPELINED,
+	HEV_DNS_TRANSPORT_TLS,
+};
+
+/* msg lives in the receive buffer, valid until the drain notify */
+typedef void (*HevDNSUpstreamNotify) (void *msg, size_t len, void *data);
+typedef void (*HevDNSUpstreamDrainNotify) (HevDNSUpstream *self, void *data);
+
+HevDNSUpstream * hev_dns_upstream_new (HevEventLoop *loop, struct sockaddr_storage *addr,
+			HevDNSTransport transport, HevDNSTLS *tls);
+
+HevDNSUpstream * hev_dns_upstream_ref (HevDNSUpstream *self);
+void hev_dns_upstream_unref (HevDNSUpstream *self);
+
+int hev_dns_upstream_query (HevDNSUpstream *self, const void *msg, size_t len,
+			HevDNSUpstreamNotify notify, void *notify_data);
+void hev_dns_upstream_cancel (HevDNSUpstream *self, int handle);
+
+void hev_dns_upstream_set_cork (HevDNSUpstream *self, bool cork);
+void hev_dns_upstream_set_drain_notify (HevDNSUpstream *self,
+			HevDNSUpstreamDrainNotify notify, void *notify_data);
+
+unsigned int hev_dns_upstream_get_pending (HevDNSUpstream *self);
+HevDNSTransport hev_dns_upstream_get_transport (HevDNSUpstream *self);
+
+#endif /* __HEV_DNS_UPSTREAM_H__ */
+
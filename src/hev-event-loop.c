@@ -7,39 +7,167 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
+#include <endian.h>
 #include <stddef.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
 #include "hev-slist.h"
 #include "hev-event-loop.h"
+#include "hev-event-uring.h"
+
+#define PRIORITY_MIN	(-4)
+#define PRIORITY_MAX	(4)
+#define PRIORITY_LEVELS	(PRIORITY_MAX - PRIORITY_MIN + 1)
+
+/* timer wheel: 4 levels of 256 slots, 1 ms per tick */
+#define WHEEL_BITS	(8)
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	(4)
+
+#define URING_ENTRIES	(256)
+/* provided buffers: recvmsg header, the address, then the datagram */
+#define RECV_BUFFERS	(256)
+#define RECV_DATA_SIZE	(4096)
+#define RECV_BUFFER_SIZE	(sizeof (struct io_uring_recvmsg_out) + \
+			sizeof (struct sockaddr_storage) + RECV_DATA_SIZE)
+/* sends in flight, each holds a copy until it completes */
+#define SEND_SLOTS	(128)
+#define SEND_DATA_SIZE	(4096)
+
+/* what a completion is for, in the low bits of its user data */
+enum
+{
+	TAG_POLL = 0,
+	TAG_RECV = 1,
+	TAG_SEND = 2,
+	TAG_NONE = 3,
+	TAG_MASK = 3,
+};
+
+typedef struct _HevEventLoopSendSlot HevEventLoopSendSlot;
+
+struct _HevEventLoopSendSlot
+{
+	struct msghdr msg;
+	struct iovec iovec;
+	struct sockaddr_storage addr;
+	uint8_t data[SEND_DATA_SIZE];
+};
 
 struct _HevEventLoop
 {
 	int epoll_fd;
 	unsigned int ref_count;
 
+	/* io_uring backend when set, epoll_fd is unused then */
+	HevEventUring *uring;
+	/* armed polls, receives and sends, waited for on unref */
+	unsigned int uring_pending;
+	int datagram_fd;
+	bool recv_armed;
+	HevEventLoopDatagramFunc datagram_func;
+	void *datagram_data;
+	struct msghdr recv_msg;
+	unsigned int datagram_count;
+	HevEventLoopDatagram datagrams[RECV_BUFFERS];
+	uint16_t datagram_bids[RECV_BUFFERS];
+	HevEventLoopSendSlot *send_slots;
+	unsigned int free_send_count;
+	uint16_t free_sends[SEND_SLOTS];
+
 	bool run;
-	HevSList *sources;
+	HevEventSource *sources;
+
+	/* ready fds, one fifo per priority level */
+	HevEventSourceFD *ready_heads[PRIORITY_LEVELS];
+	HevEventSourceFD *ready_tails[PRIORITY_LEVELS];
+
+	/* next tick to expire, relative to base_time */
+	uint64_t timer_tick;
+	uint64_t base_time;
+	unsigned int timer_count;
+	HevEventTimer wheel[WHEEL_LEVELS][WHEEL_SIZE];
 };
 
+static uint64_t
+get_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 HevEventLoop *
 hev_event_loop_new (void)
+{
+	return hev_event_loop_new_with_backend (HEV_EVENT_LOOP_BACKEND_EPOLL);
+}
+
+static HevEventUring *
+uring_new (void)
+{
+	HevEventUring *uring = hev_event_uring_new (URING_ENTRIES);
+
+	/* buffer rings need 5.19, multishot receives 6.0 */
+	if (uring && !hev_event_uring_setup_buffers (uring, RECV_BUFFERS, RECV_BUFFER_SIZE)) {
+		hev_event_uring_free (uring);
+		uring = NULL;
+	}
+
+	return uring;
+}
+
+HevEventLoop *
+hev_event_loop_new_with_backend (HevEventLoopBackend backend)
 {
 	HevEventLoop *self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevEventLoop));
 
 	if (self) {
-		self->epoll_fd = epoll_create (1024);
+		int i;
+
+		self->uring = NULL;
+		if (HEV_EVENT_LOOP_BACKEND_IO_URING == backend)
+		  self->uring = uring_new ();
+		self->epoll_fd = self->uring ? -1 : epoll_create (1024);
+		self->uring_pending = 0;
+		self->datagram_fd = -1;
+		self->recv_armed = false;
+		self->datagram_func = NULL;
+		self->datagram_data = NULL;
+		self->datagram_count = 0;
+		self->send_slots = NULL;
+		self->free_send_count = 0;
 		self->ref_count = 1;
 		self->run = true;
 		self->sources = NULL;
+		for (i=0; i<PRIORITY_LEVELS; i++) {
+			self->ready_heads[i] = NULL;
+			self->ready_tails[i] = NULL;
+		}
+		for (i=0; i<(WHEEL_LEVELS * WHEEL_SIZE); i++) {
+			HevEventTimer *head = &self->wheel[0][0] + i;
+			head->_prev = head;
+			head->_next = head;
+		}
+		self->timer_tick = 0;
+		self->timer_count = 0;
+		self->base_time = get_time ();
 	}
 
 	return self;
 }
 
+static void uring_drain (HevEventLoop *self);
+
 HevEventLoop *
 hev_event_loop_ref (HevEventLoop *self)
 {
@@ -55,97 +183,525 @@ hev_event_loop_unref (HevEventLoop *self)
 	if (self) {
 		self->ref_count --;
 		if (0 == self->ref_count) {
-			HevSList *list = NULL;
-			for (list=self->sources; list; list=hev_slist_next (list)) {
-				HevEventSource *source = hev_slist_data (list);
+			HevEventSource *source = self->sources;
+			while (source) {
+				HevEventSource *next = source->_next;
 				_hev_event_source_set_loop (source, NULL);
 				hev_event_source_unref (source);
+				source = next;
 			}
-			hev_slist_free (self->sources);
-			close (self->epoll_fd);
+			if (self->uring)
+			  uring_drain (self);
+			else
+			  close (self->epoll_fd);
 			HEV_MEMORY_ALLOCATOR_FREE (self);
 		}
 	}
 }
 
-static HevSList *
-insert_event_source_fd_sorted (HevSList *fd_list, HevEventSourceFD *fd)
+static void
+ready_queue_push (HevEventLoop *self, HevEventSourceFD *fd)
+{
+	int priority = PRIORITY_MIN;
+
+	if (fd->source)
+	  priority = hev_event_source_get_priority (fd->source);
+	if (PRIORITY_MIN > priority)
+	  priority = PRIORITY_MIN;
+	else if (PRIORITY_MAX < priority)
+	  priority = PRIORITY_MAX;
+	priority -= PRIORITY_MIN;
+
+	fd->_queued = true;
+	fd->_next = NULL;
+	if (self->ready_tails[priority])
+	  self->ready_tails[priority]->_next = fd;
+	else
+	  self->ready_heads[priority] = fd;
+	self->ready_tails[priority] = fd;
+}
+
+static void
+dispatch_event_source_fd (HevEventLoop *self, HevEventSourceFD *fd)
+{
+	HevEventSource *source = fd->source;
+	bool res;
+
+	if (!source || (hev_event_source_get_loop (source) != self) ||
+				!source->funcs.check (source, fd))
+	  return;
+
+	res = source->funcs.dispatch (source, fd,
+				source->callback.callback, source->callback.data);
+	/* recheck, in user's dispatch, source and fd may be remove. */
+	if (!fd->source)
+	  return;
+	if (res) {
+		if (hev_event_source_get_loop (source) == self)
+		  source->funcs.prepare (source);
+	} else {
+		fd->revents = 0;
+		hev_event_loop_del_source (self, source);
+	}
+}
+
+static bool
+dispatch_ready_fds (HevEventLoop *self)
+{
+	bool pending = false;
+	int i;
+
+	/* highest ... lowest, every ready fd once per round */
+	for (i=PRIORITY_LEVELS-1; i>=0; i--) {
+		HevEventSourceFD *fd = self->ready_heads[i];
+
+		self->ready_heads[i] = NULL;
+		self->ready_tails[i] = NULL;
+		while (fd) {
+			HevEventSourceFD *next = fd->_next;
+
+			fd->_next = NULL;
+			fd->_queued = false;
+			dispatch_event_source_fd (self, fd);
+			if (fd->source && (fd->_events & fd->revents)) {
+				ready_queue_push (self, fd);
+				pending = true;
+			} else {
+				_hev_event_source_fd_unref (fd);
+			}
+			fd = next;
+		}
+	}
+
+	return pending;
+}
+
+static void
+clear_ready_fds (HevEventLoop *self)
 {
-	HevSList *list = NULL;
+	int i;
+
+	for (i=0; i<PRIORITY_LEVELS; i++) {
+		HevEventSourceFD *fd = self->ready_heads[i];
 
-	for (list=fd_list; list; list=hev_slist_next (list)) {
-		HevEventSourceFD *_fd  = hev_slist_data (list);
-		if (hev_event_source_get_priority (fd->source) >
-				hev_event_source_get_priority (_fd->source))
+		while (fd) {
+			HevEventSourceFD *next = fd->_next;
+
+			fd->_next = NULL;
+			fd->_queued = false;
+			_hev_event_source_fd_unref (fd);
+			fd = next;
+		}
+		self->ready_heads[i] = NULL;
+		self->ready_tails[i] = NULL;
+	}
+}
+
+static void
+timer_list_insert (HevEventTimer *head, HevEventTimer *timer)
+{
+	timer->_prev = head->_prev;
+	timer->_next = head;
+	head->_prev->_next = timer;
+	head->_prev = timer;
+}
+
+static void
+timer_list_remove (HevEventTimer *timer)
+{
+	timer->_prev->_next = timer->_next;
+	timer->_next->_prev = timer->_prev;
+	timer->_prev = NULL;
+	timer->_next = NULL;
+}
+
+static void
+wheel_insert (HevEventLoop *self, HevEventTimer *timer)
+{
+	uint64_t expire = timer->_expire;
+	uint64_t delta;
+	int level;
+
+	if (expire < self->timer_tick)
+	  expire = self->timer_tick;
+	delta = expire - self->timer_tick;
+	/* beyond the outermost level, park at its far end */
+	if ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) <= delta) {
+		delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+		expire = self->timer_tick + delta;
+	}
+	for (level=0; level<(WHEEL_LEVELS - 1); level++) {
+		if ((1ULL << (WHEEL_BITS * (level + 1))) > delta)
 		  break;
 	}
-	return hev_slist_insert_before (fd_list, fd, list);
+	timer_list_insert (&self->wheel[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK],
+				timer);
+}
+
+void
+hev_event_loop_add_timer (HevEventLoop *self, HevEventTimer *timer,
+			unsigned int timeout)
+{
+	uint64_t now;
+
+	if (!self || !timer)
+	  return;
+
+	if (timer->_next)
+	  hev_event_loop_del_timer (self, timer);
+	now = get_time () - self->base_time;
+	/* the wheel is empty, skip idle ticks */
+	if (0 == self->timer_count)
+	  self->timer_tick = now;
+	timer->_expire = now + timeout;
+	wheel_insert (self, timer);
+	self->timer_count ++;
+}
+
+void
+hev_event_loop_del_timer (HevEventLoop *self, HevEventTimer *timer)
+{
+	if (self && timer && timer->_next) {
+		timer_list_remove (timer);
+		self->timer_count --;
+	}
+}
+
+uint64_t
+hev_event_loop_get_time (HevEventLoop *self)
+{
+	/* milliseconds on the loop's clock, same base as the timers */
+	return self ? get_time () - self->base_time : 0;
+}
+
+static void
+wheel_cascade (HevEventLoop *self, int level)
+{
+	HevEventTimer *head = &self->wheel[level][(self->timer_tick >>
+				(WHEEL_BITS * level)) & WHEEL_MASK];
+
+	while (head->_next != head) {
+		HevEventTimer *timer = head->_next;
+		timer_list_remove (timer);
+		wheel_insert (self, timer);
+	}
+}
+
+static void
+expire_timers (HevEventLoop *self)
+{
+	uint64_t now = get_time () - self->base_time;
+	HevEventTimer expired;
+
+	expired._prev = &expired;
+	expired._next = &expired;
+	while ((0 < self->timer_count) && (self->timer_tick <= now)) {
+		unsigned int index = self->timer_tick & WHEEL_MASK;
+		HevEventTimer *head = &self->wheel[0][index];
+		int level;
+
+		/* refill level 0 from the upper levels at each wrap */
+		for (level=1; (0 == index) && (level<WHEEL_LEVELS); level++) {
+			wheel_cascade (self, level);
+			index = (self->timer_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		}
+		/* move due timers aside, callbacks may add or delete timers */
+		if (head->_next != head) {
+			expired._next = head->_next;
+			expired._prev = head->_prev;
+			expired._next->_prev = &expired;
+			expired._prev->_next = &expired;
+			head->_prev = head;
+			head->_next = head;
+		}
+		self->timer_tick ++;
+		while (expired._next != &expired) {
+			HevEventTimer *timer = expired._next;
+			timer_list_remove (timer);
+			self->timer_count --;
+			timer->callback (timer, timer->data);
+		}
+	}
+}
+
+static int
+get_timers_timeout (HevEventLoop *self)
+{
+	uint64_t now, tick;
+
+	if (0 == self->timer_count)
+	  return -1;
+
+	/* first busy slot of level 0 in this turn, or the next cascade */
+	for (tick=self->timer_tick; ; tick++) {
+		HevEventTimer *head = &self->wheel[0][tick & WHEEL_MASK];
+
+		if (head->_next != head)
+		  break;
+		if ((tick == self->timer_tick) && (0 == (tick & WHEEL_MASK)))
+		  break;
+		if (WHEEL_MASK == (tick & WHEEL_MASK)) {
+			tick ++;
+			break;
+		}
+	}
+
+	now = get_time () - self->base_time;
+	if (tick <= now)
+	  return 0;
+
+	return tick - now;
+}
+
+static inline uint32_t
+poll32 (uint32_t events)
+{
+	/* the kernel reads the two halves swapped on big endian */
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	return events;
+}
+
+static bool
+uring_arm_poll (HevEventLoop *self, HevEventSourceFD *fd)
+{
+	struct io_uring_sqe *sqe = hev_event_uring_get_sqe (self->uring);
+
+	if (!sqe)
+	  return false;
+
+	/* edge triggered as with epoll, fires until it is removed */
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd->fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = poll32 (fd->_events & ~EPOLLET);
+	sqe->user_data = (uintptr_t) fd | TAG_POLL;
+	/* held until its last completion, which may come after the removal */
+	_hev_event_source_fd_ref (fd);
+	self->uring_pending ++;
+
+	return true;
+}
+
+static bool
+uring_cancel (HevEventLoop *self, uint64_t user_data, uint8_t opcode)
+{
+	struct io_uring_sqe *sqe = hev_event_uring_get_sqe (self->uring);
+
+	if (!sqe)
+	  return false;
+
+	sqe->opcode = opcode;
+	sqe->addr = user_data;
+	sqe->user_data = TAG_NONE;
+
+	return true;
+}
+
+static bool
+uring_arm_recv (HevEventLoop *self)
+{
+	struct io_uring_sqe *sqe = hev_event_uring_get_sqe (self->uring);
+
+	if (!sqe)
+	  return false;
+
+	/* one request, a completion and a provided buffer per datagram */
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = self->datagram_fd;
+	sqe->addr = (uintptr_t) &self->recv_msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = TAG_RECV;
+	self->recv_armed = true;
+	self->uring_pending ++;
+
+	return true;
+}
+
+static void
+uring_handle_poll (HevEventLoop *self, struct io_uring_cqe *cqe, bool running)
+{
+	HevEventSourceFD *fd = (void *) (uintptr_t) (cqe->user_data & ~TAG_MASK);
+	bool attached = fd->source && (hev_event_source_get_loop (fd->source) == self);
+
+	if (running && attached && (0 < cqe->res)) {
+		fd->revents |= cqe->res;
+		if (!fd->_queued)
+		  ready_queue_push (self, _hev_event_source_fd_ref (fd));
+	}
+	if (IORING_CQE_F_MORE & cqe->flags)
+	  return;
+
+	/* the kernel ended a multishot poll on its own, arm it again */
+	self->uring_pending --;
+	if (running && attached && (0 <= cqe->res))
+	  uring_arm_poll (self, fd);
+	_hev_event_source_fd_unref (fd);
+}
+
+static void
+uring_handle_recv (HevEventLoop *self, struct io_uring_cqe *cqe, bool running)
+{
+	if (IORING_CQE_F_BUFFER & cqe->flags) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uint8_t *buffer = hev_event_uring_get_buffer (self->uring, bid);
+		struct io_uring_recvmsg_out *out = (void *) buffer;
+		size_t offset = sizeof (struct io_uring_recvmsg_out) +
+			self->recv_msg.msg_namelen + self->recv_msg.msg_controllen;
+
+		if (running && self->datagram_func && (0 <= cqe->res) && (offset <= cqe->res)) {
+			HevEventLoopDatagram *datagram = &self->datagrams[self->datagram_count];
+
+			datagram->addr = (void *) (buffer + sizeof (struct io_uring_recvmsg_out));
+			datagram->data = buffer + offset;
+			datagram->len = cqe->res - offset;
+			datagram->truncated = !!(MSG_TRUNC & out->flags);
+			self->datagram_bids[self->datagram_count ++] = bid;
+		} else {
+			hev_event_uring_put_buffer (self->uring, bid);
+		}
+	}
+	if (IORING_CQE_F_MORE & cqe->flags)
+	  return;
+
+	/* out of buffers, or cancelled, armed again after the batch */
+	self->uring_pending --;
+	self->recv_armed = false;
+	if ((0 > cqe->res) && (-ENOBUFS != cqe->res) && (-ECANCELED != cqe->res))
+	  fprintf (stderr, "io_uring receive failed: %s\n", strerror (-cqe->res));
+}
+
+static void
+uring_handle_send (HevEventLoop *self, struct io_uring_cqe *cqe)
+{
+	/* a failed send is a lost datagram, as on a full socket */
+	self->free_sends[self->free_send_count ++] = cqe->user_data >> 2;
+	self->uring_pending --;
+}
+
+static void
+uring_reap (HevEventLoop *self, bool running)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int i;
+
+	while ((cqe = hev_event_uring_peek_cqe (self->uring))) {
+		switch (cqe->user_data & TAG_MASK) {
+		case TAG_POLL:
+			uring_handle_poll (self, cqe, running);
+			break;
+		case TAG_RECV:
+			uring_handle_recv (self, cqe, running);
+			break;
+		case TAG_SEND:
+			uring_handle_send (self, cqe);
+			break;
+		}
+		hev_event_uring_cqe_seen (self->uring);
+	}
+
+	/* the whole batch at once, the buffers go back after it */
+	if (0 < self->datagram_count) {
+		if (self->datagram_func)
+		  self->datagram_func (self->datagrams, self->datagram_count,
+					  self->datagram_data);
+		for (i=0; i<self->datagram_count; i++)
+		  hev_event_uring_put_buffer (self->uring, self->datagram_bids[i]);
+		self->datagram_count = 0;
+	}
+	hev_event_uring_commit_buffers (self->uring);
+	if (running && !self->recv_armed && (0 <= self->datagram_fd))
+	  uring_arm_recv (self);
+}
+
+static void
+uring_drain (HevEventLoop *self)
+{
+	struct io_uring_sqe *sqe = hev_event_uring_get_sqe (self->uring);
+	unsigned int i;
+
+	/* every poll, receive and send left ends with a last completion */
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		sqe->user_data = TAG_NONE;
+	}
+	for (i=0; (0 < self->uring_pending) && (100 > i); i++) {
+		hev_event_uring_enter (self->uring, 10);
+		uring_reap (self, false);
+	}
+	clear_ready_fds (self);
+	hev_event_uring_free (self->uring);
+	HEV_MEMORY_ALLOCATOR_FREE (self->send_slots);
+}
+
+static void
+hev_event_loop_run_uring (HevEventLoop *self)
+{
+	int timeout = -1;
+
+	while (self->run) {
+		/* submits what was queued, then waits */
+		if (0 != timeout) {
+			int timer_timeout = get_timers_timeout (self);
+			if (0 <= timer_timeout)
+			  timeout = timer_timeout;
+		}
+		if ((0 > hev_event_uring_enter (self->uring, timeout)) &&
+					(EINTR != errno) && (EAGAIN != errno) && (EBUSY != errno)) {
+			fprintf (stderr, "io_uring enter failed!\n");
+			break;
+		}
+		expire_timers (self);
+		uring_reap (self, true);
+		timeout = dispatch_ready_fds (self) ? 0 : -1;
+	}
+	clear_ready_fds (self);
 }
 
 void
 hev_event_loop_run (HevEventLoop *self)
 {
 	int timeout = -1;
-	HevSList *fd_list = NULL;
 
 	if (!self)
 	  return;
+	if (self->uring) {
+		hev_event_loop_run_uring (self);
+		return;
+	}
 
 	while (self->run) {
 		int i = 0, nfds = 0;
 		struct epoll_event events[256];
 
 		/* waiting events */
+		if (0 != timeout) {
+			int timer_timeout = get_timers_timeout (self);
+			if (0 <= timer_timeout)
+			  timeout = timer_timeout;
+		}
 		nfds = epoll_wait (self->epoll_fd, events, 256, timeout);
 		if (-1 == nfds && EINTR != errno) {
 			fprintf (stderr, "EPoll wait failed!\n");
 			break;
 		}
-		/* insert to fd_list, sorted by source priority (highest ... lowest) */
+		expire_timers (self);
+		/* queue ready fds by source priority */
 		for (i=0; i<nfds; i++) {
 			HevEventSourceFD *fd = events[i].data.ptr;
 			fd->revents |= events[i].events;
-			fd = _hev_event_source_fd_ref (fd);
-			fd_list = insert_event_source_fd_sorted (fd_list, fd);
-		}
-		/* get highest priority source fd, check & dispatch */
-		if (fd_list) {
-			HevSList *invalid_sources = NULL;
-			HevEventSourceFD *fd = hev_slist_data (fd_list);
-			HevEventSource *source = fd->source;
-			if (source && (hev_event_source_get_loop (source) == self) &&
-						source->funcs.check (source, fd)) {
-				bool res = source->funcs.dispatch (source, fd,
-							source->callback.callback, source->callback.data);
-				/* recheck, in user's dispatch, source and fd may be remove. */
-				if (fd->source) {
-					if (res) {
-						if (hev_event_source_get_loop (source) == self)
-						  source->funcs.prepare (source);
-					} else {
-						fd->revents = 0;
-						invalid_sources = hev_slist_append (invalid_sources, source);
-					}
-				}
-			}
-			if (!(fd->_events & fd->revents) || !fd->source) {
-				fd_list = hev_slist_remove (fd_list, fd);
-				_hev_event_source_fd_unref (fd);
-			}
-			/* delete invalid sources */
-			if (invalid_sources) {
-				HevSList *list = NULL;
-				for (list=invalid_sources; list; list=hev_slist_next (list))
-				  hev_event_loop_del_source (self, hev_slist_data (list));
-				hev_slist_free (invalid_sources);
-			}
-			timeout = 0;
-		} else {
-			timeout = -1;
+			if (!fd->_queued)
+			  ready_queue_push (self, _hev_event_source_fd_ref (fd));
 		}
+		/* dispatch the whole ready set, poll again without blocking if
+		 * some fds are still ready */
+		timeout = dispatch_ready_fds (self) ? 0 : -1;
 	}
-	/* free fd_list */
-	hev_slist_free (fd_list);
+	clear_ready_fds (self);
 }
 
 void
@@ -160,12 +716,15 @@ hev_event_loop_add_source (HevEventLoop *self, HevEventSource *source)
 {
 	if (self && source) {
 		HevSList *list = NULL;
-		for (list=self->sources; list; list=hev_slist_next (list)) {
-			if (source == hev_slist_data (list))
-			  return false;
-		}
+		/* a source belongs to one loop at most */
+		if (source->loop)
+		  return false;
 		_hev_event_source_set_loop (source, self);
-		self->sources = hev_slist_append (self->sources, hev_event_source_ref (source));
+		source->_prev = NULL;
+		source->_next = self->sources;
+		if (self->sources)
+		  self->sources->_prev = source;
+		self->sources = hev_event_source_ref (source);
 		for (list=source->fds; list; list=hev_slist_next (list)) {
 			HevEventSourceFD *fd = hev_slist_data (list);
 			_hev_event_loop_add_fd (self, fd);
@@ -180,30 +739,134 @@ hev_event_loop_add_source (HevEventLoop *self, HevEventSource *source)
 bool
 hev_event_loop_del_source (HevEventLoop *self, HevEventSource *source)
 {
-	if (self && source) {
+	if (self && source && (self == source->loop)) {
 		HevSList *list = NULL;
-		for (list=self->sources; list; list=hev_slist_next (list)) {
-			if (source == hev_slist_data (list))
-			  break;
-		}
-		if (list) {
-			_hev_event_source_set_loop (source, NULL);
-			self->sources = hev_slist_remove (self->sources, source);
-			for (list=source->fds; list; list=hev_slist_next (list)) {
-				HevEventSourceFD *fd = hev_slist_data (list);
-				_hev_event_loop_del_fd (self, fd);
-			}
-			hev_event_source_unref (source);
-			return true;
+		_hev_event_source_set_loop (source, NULL);
+		if (source->_prev)
+		  source->_prev->_next = source->_next;
+		else
+		  self->sources = source->_next;
+		if (source->_next)
+		  source->_next->_prev = source->_prev;
+		source->_prev = NULL;
+		source->_next = NULL;
+		for (list=source->fds; list; list=hev_slist_next (list)) {
+			HevEventSourceFD *fd = hev_slist_data (list);
+			_hev_event_loop_del_fd (self, fd);
 		}
+		hev_event_source_unref (source);
+		return true;
 	}
 
 	return false;
 }
 
+HevEventLoopBackend
+hev_event_loop_get_backend (HevEventLoop *self)
+{
+	return (self && self->uring) ? HEV_EVENT_LOOP_BACKEND_IO_URING :
+		HEV_EVENT_LOOP_BACKEND_EPOLL;
+}
+
+bool
+hev_event_loop_add_datagram_fd (HevEventLoop *self, int fd,
+			HevEventLoopDatagramFunc func, void *data)
+{
+	if (!self || !self->uring || (0 <= self->datagram_fd) || !func)
+	  return false;
+
+	memset (&self->recv_msg, 0, sizeof (self->recv_msg));
+	self->recv_msg.msg_namelen = sizeof (struct sockaddr_storage);
+	self->datagram_fd = fd;
+	self->datagram_func = func;
+	self->datagram_data = data;
+	if (!self->recv_armed && !uring_arm_recv (self)) {
+		self->datagram_fd = -1;
+		self->datagram_func = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void
+hev_event_loop_del_datagram_fd (HevEventLoop *self, int fd)
+{
+	if (!self || !self->uring || (fd != self->datagram_fd))
+	  return;
+
+	self->datagram_fd = -1;
+	self->datagram_func = NULL;
+	self->datagram_data = NULL;
+	if (self->recv_armed)
+	  uring_cancel (self, TAG_RECV, IORING_OP_ASYNC_CANCEL);
+}
+
+unsigned int
+hev_event_loop_send_datagrams (HevEventLoop *self, int fd,
+			struct mmsghdr *msgs, unsigned int count)
+{
+	unsigned int i;
+
+	if (!self || !self->uring)
+	  return 0;
+
+	if (!self->send_slots) {
+		self->send_slots = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevEventLoopSendSlot) * SEND_SLOTS);
+		if (!self->send_slots)
+		  return 0;
+		for (i=0; i<SEND_SLOTS; i++)
+		  self->free_sends[i] = SEND_SLOTS - 1 - i;
+		self->free_send_count = SEND_SLOTS;
+	}
+
+	/* copied, the caller reuses its buffers once this returns */
+	for (i=0; i<count; i++) {
+		struct msghdr *msg = &msgs[i].msg_hdr;
+		HevEventLoopSendSlot *slot;
+		struct io_uring_sqe *sqe;
+		size_t j, len = 0;
+		uint16_t index;
+
+		for (j=0; j<msg->msg_iovlen; j++)
+		  len += msg->msg_iov[j].iov_len;
+		if ((0 == self->free_send_count) || (SEND_DATA_SIZE < len) ||
+					(sizeof (struct sockaddr_storage) < msg->msg_namelen))
+		  break;
+		sqe = hev_event_uring_get_sqe (self->uring);
+		if (!sqe)
+		  break;
+
+		index = self->free_sends[-- self->free_send_count];
+		slot = &self->send_slots[index];
+		for (j=0, len=0; j<msg->msg_iovlen; j++) {
+			memcpy (slot->data + len, msg->msg_iov[j].iov_base, msg->msg_iov[j].iov_len);
+			len += msg->msg_iov[j].iov_len;
+		}
+		memcpy (&slot->addr, msg->msg_name, msg->msg_namelen);
+		memset (&slot->msg, 0, sizeof (slot->msg));
+		slot->iovec.iov_base = slot->data;
+		slot->iovec.iov_len = len;
+		slot->msg.msg_name = &slot->addr;
+		slot->msg.msg_namelen = msg->msg_namelen;
+		slot->msg.msg_iov = &slot->iovec;
+		slot->msg.msg_iovlen = 1;
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t) &slot->msg;
+		sqe->user_data = ((uint64_t) index << 2) | TAG_SEND;
+		self->uring_pending ++;
+	}
+
+	return i;
+}
+
 bool
 _hev_event_loop_add_fd (HevEventLoop *self, HevEventSourceFD *fd)
 {
+	if (self && self->uring && fd)
+	  return uring_arm_poll (self, fd);
 	if (self && fd) {
 		struct epoll_event event;
 		event.events = fd->_events | EPOLLET;
@@ -218,6 +881,8 @@ _hev_event_loop_add_fd (HevEventLoop *self, HevEventSourceFD *fd)
 bool
 _hev_event_loop_del_fd (HevEventLoop *self, HevEventSourceFD *fd)
 {
+	if (self && self->uring && fd)
+	  return uring_cancel (self, (uintptr_t) fd | TAG_POLL, IORING_OP_POLL_REMOVE);
 	if (self && fd) {
 		return (0 == epoll_ctl (self->epoll_fd,
 					EPOLL_CTL_DEL, fd->fd, NULL));
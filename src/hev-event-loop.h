@@ -11,10 +11,37 @@
 #define __HEV_EVENT_LOOP_H__
 
 typedef struct _HevEventLoop HevEventLoop;
+typedef enum _HevEventLoopBackend HevEventLoopBackend;
+typedef struct _HevEventLoopDatagram HevEventLoopDatagram;
+
+#include <sys/socket.h>
 
 #include "hev-event-source.h"
+#include "hev-event-timer.h"
+
+enum _HevEventLoopBackend
+{
+	HEV_EVENT_LOOP_BACKEND_EPOLL,
+	HEV_EVENT_LOOP_BACKEND_IO_URING,
+};
+
+/* valid until the function returns */
+struct _HevEventLoopDatagram
+{
+	void *data;
+	size_t len;
+	bool truncated;
+	struct sockaddr_storage *addr;
+};
+
+struct mmsghdr;
+
+typedef void (*HevEventLoopDatagramFunc) (HevEventLoopDatagram *datagrams,
+			unsigned int count, void *data);
 
 HevEventLoop * hev_event_loop_new (void);
+/* falls back to epoll where io_uring is not usable */
+HevEventLoop * hev_event_loop_new_with_backend (HevEventLoopBackend backend);
 
 HevEventLoop * hev_event_loop_ref (HevEventLoop *self);
 void hev_event_loop_unref (HevEventLoop *self);
@@ -25,6 +52,22 @@ void hev_event_loop_quit (HevEventLoop *self);
 bool hev_event_loop_add_source (HevEventLoop *self, HevEventSource *source);
 bool hev_event_loop_del_source (HevEventLoop *self, HevEventSource *source);
 
+void hev_event_loop_add_timer (HevEventLoop *self, HevEventTimer *timer,
+			unsigned int timeout);
+void hev_event_loop_del_timer (HevEventLoop *self, HevEventTimer *timer);
+
+uint64_t hev_event_loop_get_time (HevEventLoop *self);
+
+HevEventLoopBackend hev_event_loop_get_backend (HevEventLoop *self);
+
+/* io_uring only: datagrams of one socket received without a system call,
+ * batched per wakeup, and sends queued with the next wait */
+bool hev_event_loop_add_datagram_fd (HevEventLoop *self, int fd,
+			HevEventLoopDatagramFunc func, void *data);
+void hev_event_loop_del_datagram_fd (HevEventLoop *self, int fd);
+unsigned int hev_event_loop_send_datagrams (HevEventLoop *self, int fd,
+			struct mmsghdr *msgs, unsigned int count);
+
 bool _hev_event_loop_add_fd (HevEventLoop *self, HevEventSourceFD *fd);
 bool _hev_event_loop_del_fd (HevEventLoop *self, HevEventSourceFD *fd);
 
@@ -24,8 +24,10 @@ struct _HevEventSourceFD
 	uint32_t _events;
 	uint32_t revents;
 	unsigned int _ref_count;
+	bool _queued;
 
 	HevEventSource *source;
+	HevEventSourceFD *_next;
 	void *data;
 };
 
@@ -38,7 +40,9 @@ _hev_event_source_fd_new (HevEventSource *source, int fd, uint32_t events)
 		self->_events = events;
 		self->revents = 0;
 		self->_ref_count = 1;
+		self->_queued = false;
 		self->source = source;
+		self->_next = NULL;
 		self->data = NULL;
 	}
 
@@ -42,6 +42,8 @@ hev_event_source_new (HevEventSourceFuncs *funcs, size_t struct_size)
 			self->callback.notify = NULL;
 			self->fds = NULL;
 			self->loop = NULL;
+			self->_prev = NULL;
+			self->_next = NULL;
 			return self;
 		}
 	}
@@ -88,7 +90,7 @@ hev_event_source_set_name (HevEventSource *self, const char *name)
 	if (self && name) {
 		if (self->name)
 		  HEV_MEMORY_ALLOCATOR_FREE (self->name);
-		self->name = HEV_MEMORY_ALLOCATOR_ALLOC (strlen (name));
+		self->name = HEV_MEMORY_ALLOCATOR_ALLOC (strlen (name) + 1);
 		strcpy (self->name, name);
 	}
 }
@@ -183,7 +185,7 @@ hev_event_source_get_loop (HevEventSource *self)
 void
 _hev_event_source_set_loop (HevEventSource *self, HevEventLoop *loop)
 {
-	if (self && (!self->loop) && loop)
+	if (self && (!self->loop || !loop))
 	  self->loop = loop;
 }
 
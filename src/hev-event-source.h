@@ -49,6 +49,10 @@ struct _HevEventSource
 
 	HevSList *fds;
 	HevEventLoop *loop;
+
+	/* sources of a loop, linked in place */
+	HevEventSource *_prev;
+	HevEventSource *_next;
 };
 
 HevEventSource * hev_event_source_new (HevEventSourceFuncs *funcs, size_t struct_size);
@@ -0,0 +1,50 @@
+/*
+ ============================================================================
+ Name        : hev-event-timer.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : An event timer
+ ============================================================================
+ */
+
+#ifndef __HEV_EVENT_TIMER_H__
+#define __HEV_EVENT_TIMER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct _HevEventTimer HevEventTimer;
+typedef void (*HevEventTimerFunc) (HevEventTimer *timer, void *data);
+
+/* embedded in its owner, no allocation on add or delete */
+struct _HevEventTimer
+{
+	HevEventTimer *_prev;
+	HevEventTimer *_next;
+	uint64_t _expire;
+
+	HevEventTimerFunc callback;
+	void *data;
+};
+
+static inline void
+hev_event_timer_init (HevEventTimer *self, HevEventTimerFunc callback, void *data)
+{
+	if (self) {
+		self->_prev = NULL;
+		self->_next = NULL;
+		self->_expire = 0;
+		self->callback = callback;
+		self->data = data;
+	}
+}
+
+static inline bool
+hev_event_timer_is_pending (HevEventTimer *self)
+{
+	return self ? (NULL != self->_next) : false;
+}
+
+#endif /* __HEV_EVENT_TIMER_H__ */
+
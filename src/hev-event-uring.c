@@ -0,0 +1,316 @@
+/*
+ ============================================================================
+ Name        : hev-event-uring.c
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : A minimal io_uring
+ ============================================================================
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "hev-event-uring.h"
+#include "hev-memory-allocator.h"
+
+#define load_acquire(p)		__atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n (p, v, __ATOMIC_RELEASE)
+
+struct _HevEventUring
+{
+	int fd;
+	unsigned int features;
+
+	/* submission ring, entries are filled in order */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_flags;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sqe_tail;
+	struct io_uring_sqe *sqes;
+
+	/* completion ring */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/* provided buffer ring, group 0 */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	unsigned int buf_count;
+	unsigned int buf_size;
+	uint16_t buf_tail;
+	uint8_t *bufs;
+};
+
+static int
+uring_setup (unsigned int entries, struct io_uring_params *params)
+{
+	return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter (int fd, unsigned int to_submit, unsigned int min_complete,
+			unsigned int flags, void *arg, size_t arg_size)
+{
+	return syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+				flags, arg, arg_size);
+}
+
+static int
+uring_register (int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+HevEventUring *
+hev_event_uring_new (unsigned int entries)
+{
+	HevEventUring *self;
+	struct io_uring_params params;
+	unsigned int *array, i;
+
+	self = HEV_MEMORY_ALLOCATOR_ALLOC (sizeof (HevEventUring));
+	if (!self)
+	  return NULL;
+	memset (self, 0, sizeof (HevEventUring));
+
+	/* room for the bursts of multishot completions */
+	memset (&params, 0, sizeof (params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN |
+		IORING_SETUP_TASKRUN_FLAG;
+	params.cq_entries = entries * 4;
+	self->fd = uring_setup (entries, &params);
+	if (0 > self->fd) {
+		HEV_MEMORY_ALLOCATOR_FREE (self);
+		return NULL;
+	}
+	/* one mmap for both rings, and waiting with a timeout */
+	self->features = params.features;
+	if (!(IORING_FEAT_SINGLE_MMAP & params.features) ||
+				!(IORING_FEAT_EXT_ARG & params.features) ||
+				!(IORING_FEAT_NODROP & params.features))
+	  goto fail;
+
+	self->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+	self->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	if (self->cq_ring_size > self->sq_ring_size)
+	  self->sq_ring_size = self->cq_ring_size;
+	self->sq_ring = mmap (NULL, self->sq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == self->sq_ring) {
+		self->sq_ring = NULL;
+		goto fail;
+	}
+	self->cq_ring = self->sq_ring;
+	self->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	self->sqes = mmap (NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == self->sqes) {
+		self->sqes = NULL;
+		goto fail;
+	}
+
+	self->sq_head = self->sq_ring + params.sq_off.head;
+	self->sq_tail = self->sq_ring + params.sq_off.tail;
+	self->sq_flags = self->sq_ring + params.sq_off.flags;
+	self->sq_mask = *(unsigned int *) (self->sq_ring + params.sq_off.ring_mask);
+	self->sq_entries = params.sq_entries;
+	self->sqe_tail = *self->sq_tail;
+	/* entry i always sits at index i */
+	array = self->sq_ring + params.sq_off.array;
+	for (i=0; i<params.sq_entries; i++)
+	  array[i] = i;
+
+	self->cq_head = self->cq_ring + params.cq_off.head;
+	self->cq_tail = self->cq_ring + params.cq_off.tail;
+	self->cq_mask = *(unsigned int *) (self->cq_ring + params.cq_off.ring_mask);
+	self->cqes = self->cq_ring + params.cq_off.cqes;
+
+	return self;
+
+fail:
+	hev_event_uring_free (self);
+	return NULL;
+}
+
+void
+hev_event_uring_free (HevEventUring *self)
+{
+	if (!self)
+	  return;
+
+	/* closing the ring cancels whatever is left in it */
+	if (self->sqes)
+	  munmap (self->sqes, self->sqes_size);
+	if (self->sq_ring)
+	  munmap (self->sq_ring, self->sq_ring_size);
+	close (self->fd);
+	if (self->buf_ring)
+	  munmap (self->buf_ring, self->buf_ring_size);
+	free (self->bufs);
+	HEV_MEMORY_ALLOCATOR_FREE (self);
+}
+
+struct io_uring_sqe *
+hev_event_uring_get_sqe (HevEventUring *self)
+{
+	struct io_uring_sqe *sqe;
+
+	/* full, hand what is queued to the kernel first */
+	while ((self->sqe_tail - load_acquire (self->sq_head)) >= self->sq_entries) {
+		if ((0 > hev_event_uring_enter (self, 0)) && (EINTR != errno) &&
+					(EAGAIN != errno) && (EBUSY != errno))
+		  return NULL;
+	}
+
+	sqe = &self->sqes[self->sqe_tail & self->sq_mask];
+	memset (sqe, 0, sizeof (struct io_uring_sqe));
+	self->sqe_tail ++;
+
+	return sqe;
+}
+
+int
+hev_event_uring_enter (HevEventUring *self, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, flags = 0, min_complete = 0;
+	int res;
+
+	/* the kernel takes entries from the head, all it has not taken yet */
+	store_release (self->sq_tail, self->sqe_tail);
+	to_submit = self->sqe_tail - load_acquire (self->sq_head);
+
+	if (0 != timeout) {
+		flags |= IORING_ENTER_GETEVENTS;
+		min_complete = 1;
+	} else if (IORING_SQ_TASKRUN & load_acquire (self->sq_flags)) {
+		/* completions are waiting for us to run them */
+		flags |= IORING_ENTER_GETEVENTS;
+	} else if (0 == to_submit) {
+		return 0;
+	}
+
+	memset (&arg, 0, sizeof (arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (0 < timeout) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts = (uintptr_t) &ts;
+	}
+	res = uring_enter (self->fd, to_submit, min_complete,
+				flags | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+	if ((0 > res) && (ETIME == errno))
+	  res = 0;
+
+	return res;
+}
+
+struct io_uring_cqe *
+hev_event_uring_peek_cqe (HevEventUring *self)
+{
+	unsigned int head = *self->cq_head;
+
+	if (head == load_acquire (self->cq_tail))
+	  return NULL;
+
+	return &self->cqes[head & self->cq_mask];
+}
+
+void
+hev_event_uring_cqe_seen (HevEventUring *self)
+{
+	store_release (self->cq_head, *self->cq_head + 1);
+}
+
+bool
+hev_event_uring_setup_buffers (HevEventUring *self, unsigned int count,
+			unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	/* a power of two, as the kernel wants it */
+	if (!self || self->buf_ring || (0 == count) || (count & (count - 1)) ||
+				(UINT16_MAX < count))
+	  return false;
+
+	self->buf_ring_size = count * sizeof (struct io_uring_buf);
+	self->buf_ring = mmap (NULL, self->buf_ring_size, PROT_READ | PROT_WRITE,
+				MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (MAP_FAILED == self->buf_ring) {
+		self->buf_ring = NULL;
+		return false;
+	}
+	self->bufs = malloc ((size_t) count * size);
+	if (!self->bufs)
+	  goto fail;
+
+	memset (&reg, 0, sizeof (reg));
+	reg.ring_addr = (uintptr_t) self->buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = 0;
+	if (0 != uring_register (self->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+	  goto fail;
+
+	self->buf_count = count;
+	self->buf_size = size;
+	self->buf_tail = 0;
+	for (i=0; i<count; i++)
+	  hev_event_uring_put_buffer (self, i);
+	hev_event_uring_commit_buffers (self);
+
+	return true;
+
+fail:
+	free (self->bufs);
+	self->bufs = NULL;
+	munmap (self->buf_ring, self->buf_ring_size);
+	self->buf_ring = NULL;
+	return false;
+}
+
+void *
+hev_event_uring_get_buffer (HevEventUring *self, uint16_t bid)
+{
+	if (!self->bufs || (bid >= self->buf_count))
+	  return NULL;
+
+	return self->bufs + (size_t) bid * self->buf_size;
+}
+
+void
+hev_event_uring_put_buffer (HevEventUring *self, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &self->buf_ring->bufs[self->buf_tail & (self->buf_count - 1)];
+	buf->addr = (uintptr_t) hev_event_uring_get_buffer (self, bid);
+	buf->len = self->buf_size;
+	buf->bid = bid;
+	self->buf_tail ++;
+}
+
+void
+hev_event_uring_commit_buffers (HevEventUring *self)
+{
+	if (self && self->buf_ring)
+	  store_release (&self->buf_ring->tail, self->buf_tail);
+}
+
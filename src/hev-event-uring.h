@@ -0,0 +1,39 @@
+/*
+ ============================================================================
+ Name        : hev-event-uring.h
+ Author      : Heiher <r@hev.cc>
+ Copyright   : Copyright (c) 2014 everyone.
+ Description : A minimal io_uring
+ ============================================================================
+ */
+
+#ifndef __HEV_EVENT_URING_H__
+#define __HEV_EVENT_URING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+typedef struct _HevEventUring HevEventUring;
+
+HevEventUring * hev_event_uring_new (unsigned int entries);
+void hev_event_uring_free (HevEventUring *self);
+
+/* a zeroed entry, queued until the next enter */
+struct io_uring_sqe * hev_event_uring_get_sqe (HevEventUring *self);
+/* submit, and wait up to timeout ms for a completion, -1 for ever */
+int hev_event_uring_enter (HevEventUring *self, int timeout);
+
+struct io_uring_cqe * hev_event_uring_peek_cqe (HevEventUring *self);
+void hev_event_uring_cqe_seen (HevEventUring *self);
+
+/* provided buffers, group 0, for multishot receives */
+bool hev_event_uring_setup_buffers (HevEventUring *self, unsigned int count,
+			unsigned int size);
+void * hev_event_uring_get_buffer (HevEventUring *self, uint16_t bid);
+void hev_event_uring_put_buffer (HevEventUring *self, uint16_t bid);
+/* buffers put back are seen by the kernel from here */
+void hev_event_uring_commit_buffers (HevEventUring *self);
+
+#endif /* __HEV_EVENT_URING_H__ */
+
@@ -7,33 +7,122 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "hev-main.h"
 #include "hev-dns-forwarder.h"
+#include "hev-dns-cache.h"
+#include "hev-dns-stats.h"
+#include "hev-dns-stats-server.h"
+#include "hev-event-source-fds.h"
 #include "hev-event-source-signal.h"
 
+/* one cache for all workers, in bytes, and the least it takes */
+#define CACHE_SIZE	(64 * 1024 * 1024)
+#define MIN_CACHE_SIZE	(256 * 1024)
+/* cache snapshot, besides the one on exit */
+#define SNAPSHOT_INTERVAL	(5 * 60 * 1000)
+
+typedef struct _HevWorker HevWorker;
+
+struct _HevWorker
+{
+	int quit_fd;
+	pthread_t thread;
+	HevEventLoop *loop;
+	HevDNSForwarder *forwarder;
+};
+
 static const char *default_dns_servers = "8.8.8.8:53";
-static const char *default_dns_port = "53";
-static const char *default_listen_addr = "0.0.0.0";
+static const char *default_listen_addr = "::";
 static const char *default_listen_port = "5300";
+static HevEventLoopBackend backend = HEV_EVENT_LOOP_BACKEND_EPOLL;
+static HevDNSCache *cache = NULL;
+static const char *cache_file = NULL;
+static pthread_t snapshot_thread;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond;
+static bool snapshot_quit = false;
 
 static void
 usage (const char *app)
 {
 	printf ("\
-usage: %s [-h] [-b BIND_ADDR] [-p BIND_PORT] [-s DNS]\n\
-Forwarding DNS queries on TCP transport.\n\
+usage: %s [-h] [-b BIND_ADDR] [-p BIND_PORT] [-s DNS] [-d DELAY] [-r DELAY]\n\
+          [-n BATCH] [-t THREADS] [-S STATS] [-m SIZE] [-c FILE] [-u]\n\
+Forwarding DNS queries to upstreams over UDP, TCP or TLS.\n\
 \n\
-  -b BIND_ADDR          address that listens, default: 0.0.0.0\n\
+  -b BIND_ADDR          address that listens, default: :: (ipv4 and ipv6,\n\
+                        0.0.0.0 when the host has no ipv6)\n\
   -p BIND_PORT          port that listens, default: 5300\n\
-  -s DNS:[PORT]         DNS servers to use, default: 8.8.8.8:53\n\
+  -s DNS[:PORT][,...]   DNS servers to use, repeatable, [DNS6]:PORT for ipv6,\n\
+                        udp://, tcp:// (a query at a time), tcp-pipelined://\n\
+                        (the default) or tls://DNS[:PORT][/NAME] (DNS over TLS),\n\
+                        default: 8.8.8.8:53\n\
+  -d DELAY              ms before a query is hedged to another server, default: off\n\
+  -r DELAY              ms before a late query is answered from an expired cache\n\
+                        entry, 0 never, default: 1800\n\
+  -n BATCH              datagrams per receive/send batch, default: 32\n\
+  -t THREADS            worker threads sharing the port, default: 1\n\
+  -S STATS              prometheus metrics on ADDR[:PORT] (http), udp://ADDR[:PORT]\n\
+                        or a unix socket PATH, default port 9153, default: off;\n\
+                        SIGUSR1 dumps them to stderr\n\
+  -m SIZE               cache memory in bytes, k, m or g suffix, at least 256k,\n\
+                        default: 64m\n\
+  -c FILE               cache snapshot, loaded at start, saved on exit and every\n\
+                        5 minutes, default: off\n\
+  -u                    io_uring event loop, linux 6.0 or later, default: epoll\n\
   -h                    show this help message and exit\n", app);
 }
 
+/* bytes, with an optional k, m or g suffix, false on anything else */
+static bool
+parse_size (const char *str, size_t *size)
+{
+	unsigned long long value;
+	unsigned int shift = 0;
+	char *end;
+
+	if (!isdigit ((unsigned char) str[0]))
+	  return false;
+	errno = 0;
+	value = strtoull (str, &end, 10);
+	if ((end == str) || (ERANGE == errno))
+	  return false;
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		shift += 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		shift += 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		shift += 10;
+		end ++;
+		break;
+	}
+	if (('\0' != *end) || (value > (SIZE_MAX >> shift)))
+	  return false;
+
+	*size = (size_t) value << shift;
+	return true;
+}
+
 static bool
 signal_handler (void *data)
 {
@@ -42,20 +131,169 @@ signal_handler (void *data)
 	return false;
 }
 
+static bool
+stats_signal_handler (void *data)
+{
+	char buffer[16 * 1024];
+	size_t len;
+
+	len = hev_dns_stats_format (buffer, sizeof (buffer));
+	fwrite (buffer, 1, len, stderr);
+	fflush (stderr);
+
+	return true;
+}
+
+static void *
+snapshot_thread_handler (void *data)
+{
+	struct timespec ts;
+
+	/* off the workers' loops, a large cache takes a while to write */
+	pthread_mutex_lock (&snapshot_lock);
+	while (!snapshot_quit) {
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += SNAPSHOT_INTERVAL / 1000;
+		while (!snapshot_quit && (ETIMEDOUT !=
+						pthread_cond_timedwait (&snapshot_cond, &snapshot_lock, &ts)))
+		  ;
+		if (snapshot_quit)
+		  break;
+		pthread_mutex_unlock (&snapshot_lock);
+		hev_dns_cache_save (cache, cache_file);
+		pthread_mutex_lock (&snapshot_lock);
+	}
+	pthread_mutex_unlock (&snapshot_lock);
+
+	return NULL;
+}
+
+static bool
+snapshot_start (void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&snapshot_cond, &attr);
+	pthread_condattr_destroy (&attr);
+
+	if (0 == pthread_create (&snapshot_thread, NULL, snapshot_thread_handler, NULL))
+	  return true;
+	pthread_cond_destroy (&snapshot_cond);
+	return false;
+}
+
+static void
+snapshot_stop (void)
+{
+	pthread_mutex_lock (&snapshot_lock);
+	snapshot_quit = true;
+	pthread_cond_signal (&snapshot_cond);
+	pthread_mutex_unlock (&snapshot_lock);
+	pthread_join (snapshot_thread, NULL);
+	pthread_cond_destroy (&snapshot_cond);
+}
+
+static bool
+quit_source_handler (HevEventSourceFD *fd, void *data)
+{
+	HevEventLoop *loop = data;
+	hev_event_loop_quit (loop);
+	return true;
+}
+
+static void *
+worker_thread_handler (void *data)
+{
+	HevWorker *worker = data;
+	hev_event_loop_run (worker->loop);
+	return NULL;
+}
+
+static bool
+worker_init (HevWorker *worker, const char *listen_addr, const char *listen_port,
+			const char *dns_servers, int hedge_delay, int stale_delay, int batch_size)
+{
+	worker->quit_fd = -1;
+	worker->loop = hev_event_loop_new_with_backend (backend);
+	if (hev_event_loop_get_backend (worker->loop) != backend)
+	  fprintf (stderr, "io_uring unavailable, using epoll\n");
+	worker->forwarder = hev_dns_forwarder_new (worker->loop, listen_addr,
+				listen_port, dns_servers, cache);
+	if (!worker->forwarder)
+	  return false;
+	if (0 < batch_size)
+	  hev_dns_forwarder_set_batch_size (worker->forwarder, batch_size);
+	if (0 < hedge_delay)
+	  hev_dns_forwarder_set_hedge_delay (worker->forwarder, hedge_delay);
+	if (0 <= stale_delay)
+	  hev_dns_forwarder_set_stale_delay (worker->forwarder, stale_delay);
+
+	return true;
+}
+
+static bool
+worker_start (HevWorker *worker)
+{
+	HevEventSource *source = NULL;
+
+	/* wakeup fd to quit a loop from another thread */
+	worker->quit_fd = eventfd (0, EFD_NONBLOCK);
+	if (-1 == worker->quit_fd)
+	  return false;
+	source = hev_event_source_fds_new ();
+	hev_event_source_set_priority (source, 3);
+	hev_event_source_add_fd (source, worker->quit_fd, EPOLLIN | EPOLLET);
+	hev_event_source_set_callback (source,
+				(HevEventSourceFunc) quit_source_handler, worker->loop, NULL);
+	hev_event_loop_add_source (worker->loop, source);
+	hev_event_source_unref (source);
+
+	return 0 == pthread_create (&worker->thread, NULL,
+				worker_thread_handler, worker);
+}
+
+static void
+worker_stop (HevWorker *worker)
+{
+	uint64_t value = 1;
+
+	if (sizeof (value) == write (worker->quit_fd, &value, sizeof (value)))
+	  pthread_join (worker->thread, NULL);
+}
+
+static void
+worker_fini (HevWorker *worker)
+{
+	if (worker->forwarder)
+	  hev_dns_forwarder_unref (worker->forwarder);
+	hev_event_loop_unref (worker->loop);
+	if (-1 < worker->quit_fd)
+	  close (worker->quit_fd);
+}
+
 int
 main (int argc, char **argv)
 {
-	HevEventLoop *loop = NULL;
 	HevEventSource *source = NULL;
-	HevDNSForwarder *forwarder = NULL;
+	HevEventSource *stats_source = NULL;
+	HevDNSStatsServer *stats_server = NULL;
+	HevWorker *workers = NULL;
 
-	int ch;
+	int i, ch;
 	char *listen_addr = NULL;
 	char *listen_port = NULL;
 	char *dns_servers = NULL;
-	char *dns_port = NULL;
+	char *stats_addr = NULL;
+	size_t cache_size = CACHE_SIZE;
+	int hedge_delay = 0;
+	int stale_delay = -1;
+	int batch_size = 0;
+	int threads = 1, inited = 0, started = 1;
+	bool ready = true, snapshotting = false;
 
-	while ((ch = getopt(argc, argv, "hb:p:s:")) != -1) {
+	while ((ch = getopt(argc, argv, "hb:p:s:d:r:n:t:S:m:c:u")) != -1) {
 		switch (ch) {
 			case 'h':
 				usage(argv[0]);
@@ -67,7 +305,44 @@ main (int argc, char **argv)
 				listen_port = strdup(optarg);
 				break;
 			case 's':
-				dns_servers = strdup(optarg);
+				if (dns_servers == NULL) {
+					dns_servers = strdup(optarg);
+				} else {
+					char *list = NULL;
+					if (asprintf(&list, "%s,%s", dns_servers, optarg) < 0) {
+						exit(1);
+					}
+					free(dns_servers);
+					dns_servers = list;
+				}
+				break;
+			case 'd':
+				hedge_delay = atoi(optarg);
+				break;
+			case 'r':
+				stale_delay = atoi(optarg);
+				break;
+			case 'n':
+				batch_size = atoi(optarg);
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'S':
+				stats_addr = strdup(optarg);
+				break;
+			case 'm':
+				if (!parse_size(optarg, &cache_size)) {
+					fprintf(stderr, "Invalid cache size: %s\n", optarg);
+					usage(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'c':
+				cache_file = strdup(optarg);
+				break;
+			case 'u':
+				backend = HEV_EVENT_LOOP_BACKEND_IO_URING;
 				break;
 		}
 	}
@@ -75,36 +350,70 @@ main (int argc, char **argv)
 	if (dns_servers == NULL) {
 		dns_servers = strdup(default_dns_servers);
 	}
-	dns_port = strpbrk(dns_servers, ":#");
-	if (dns_port == NULL) {
-		dns_port = strdup(default_dns_port);
-	} else {
-		*dns_port++ = '\0';
-	}
 	if (listen_addr == NULL) {
 		listen_addr = strdup(default_listen_addr);
 	}
 	if (listen_port == NULL) {
 		listen_port = strdup(default_listen_port);
 	}
-
-	loop = hev_event_loop_new ();
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (cache_size < MIN_CACHE_SIZE) {
+		cache_size = MIN_CACHE_SIZE;
+	}
 
 	signal (SIGPIPE, SIG_IGN);
 
+	/* the signal is blocked in all threads, only worker 0 handles it */
 	source = hev_event_source_signal_new (SIGINT);
 	hev_event_source_set_priority (source, 3);
-	hev_event_source_set_callback (source, signal_handler, loop, NULL);
-	hev_event_loop_add_source (loop, source);
-	hev_event_source_unref (source);
+	stats_source = hev_event_source_signal_new (SIGUSR1);
+	hev_event_source_set_callback (stats_source, stats_signal_handler, NULL, NULL);
+
+	cache = hev_dns_cache_new (cache_size);
+	if (cache && cache_file)
+	  hev_dns_cache_load (cache, cache_file);
+
+	workers = hev_malloc0 (sizeof (HevWorker) * threads);
+	ready = NULL != cache;
+	while (ready && (inited < threads)) {
+		ready = worker_init (&workers[inited ++], listen_addr, listen_port,
+					dns_servers, hedge_delay, stale_delay, batch_size);
+	}
 
-	forwarder = hev_dns_forwarder_new (loop, listen_addr, listen_port, dns_servers, dns_port);
-	if (forwarder) {
-		hev_event_loop_run (loop);
-		hev_dns_forwarder_unref (forwarder);
+	/* served by worker 0, the counters of every thread are summed */
+	if (ready && stats_addr) {
+		stats_server = hev_dns_stats_server_new (workers[0].loop, stats_addr);
+		ready = NULL != stats_server;
 	}
 
-	hev_event_loop_unref (loop);
+	if (ready) {
+		hev_event_source_set_callback (source, signal_handler, workers[0].loop, NULL);
+		hev_event_loop_add_source (workers[0].loop, source);
+		hev_event_loop_add_source (workers[0].loop, stats_source);
+		for (started=1; started<threads; started++) {
+			if (!worker_start (&workers[started]))
+			  break;
+		}
+		snapshotting = cache_file && (started == threads) && snapshot_start ();
+		if (started == threads)
+		  hev_event_loop_run (workers[0].loop);
+		for (i=1; i<started; i++)
+		  worker_stop (&workers[i]);
+		if (snapshotting)
+		  snapshot_stop ();
+		if (cache_file && (started == threads) && !hev_dns_cache_save (cache, cache_file))
+		  fprintf (stderr, "Can't save cache to %s\n", cache_file);
+	}
+	hev_event_source_unref (source);
+	hev_event_source_unref (stats_source);
+	hev_dns_stats_server_unref (stats_server);
+
+	for (i=0; i<inited; i++)
+	  worker_fini (&workers[i]);
+	hev_free (workers);
+	hev_dns_cache_unref (cache);
 
 	return 0;
 }
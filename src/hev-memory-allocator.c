@@ -7,13 +7,53 @@
  ============================================================================
  */
 
+#include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
 #include "hev-memory-allocator.h"
 
+/* every block is preceded by a header, keeps malloc's alignment */
+#define HEADER_SIZE	(16)
+#define SLAB_SIZE	(64 * 1024)
+#define CLASS_COUNT	(20)
+#define CLASS_GRAIN	(16)
+#define CLASS_MAX	(16384)
+#define CLASS_LARGE	(UINT32_MAX)
+
+typedef struct _HevMemoryBlock HevMemoryBlock;
+typedef struct _HevMemorySlab HevMemorySlab;
+
+struct _HevMemoryBlock
+{
+	HevMemoryBlock *next;
+};
+
+struct _HevMemorySlab
+{
+	HevMemorySlab *next;
+};
+
+struct _HevMemoryAllocator
+{
+	unsigned int ref_count;
+
+	HevMemorySlab *slabs;
+	HevMemoryBlock *free_lists[CLASS_COUNT];
+	HevMemoryAllocatorStats stats;
+	uint8_t class_index[CLASS_MAX / CLASS_GRAIN + 1];
+};
+
+static const unsigned int class_sizes[CLASS_COUNT] =
+{
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512,
+	768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384,
+};
+
 HevMemoryAllocator *
 hev_memory_allocator_default (void)
 {
-	static HevMemoryAllocator *allocator = NULL;
+	/* one per thread, so the free lists are never shared */
+	static __thread HevMemoryAllocator *allocator = NULL;
 
 	if (!allocator)
 	  allocator = hev_memory_allocator_new ();
@@ -27,8 +67,19 @@ hev_memory_allocator_new (void)
 	HevMemoryAllocator *self = NULL;
 
 	self = malloc (sizeof (HevMemoryAllocator));
-	if (self)
-	  self->ref_count = 1;
+	if (self) {
+		unsigned int i, c = 0;
+
+		self->ref_count = 1;
+		self->slabs = NULL;
+		memset (self->free_lists, 0, sizeof (self->free_lists));
+		memset (&self->stats, 0, sizeof (self->stats));
+		for (i=0; i<=(CLASS_MAX / CLASS_GRAIN); i++) {
+			while ((i * CLASS_GRAIN) > class_sizes[c])
+			  c ++;
+			self->class_index[i] = c;
+		}
+	}
 
 	return self;
 }
@@ -49,21 +100,113 @@ hev_memory_allocator_unref (HevMemoryAllocator *self)
 {
 	if (self) {
 		self->ref_count --;
-		if (0 == self->ref_count)
-		  free (self);
+		if (0 == self->ref_count) {
+			HevMemorySlab *slab = self->slabs;
+			while (slab) {
+				HevMemorySlab *next = slab->next;
+				free (slab);
+				slab = next;
+			}
+			free (self);
+		}
 	}
 }
 
+static bool
+hev_memory_allocator_refill (HevMemoryAllocator *self, unsigned int index)
+{
+	size_t block_size = HEADER_SIZE + class_sizes[index];
+	size_t i, count = (SLAB_SIZE - HEADER_SIZE) / block_size;
+	HevMemorySlab *slab;
+	uint8_t *data;
+
+	if (0 == count)
+	  count = 1;
+	slab = malloc (HEADER_SIZE + block_size * count);
+	if (!slab)
+	  return false;
+	slab->next = self->slabs;
+	self->slabs = slab;
+
+	/* carve the slab into blocks, headers record the class */
+	data = ((uint8_t *) slab) + HEADER_SIZE;
+	for (i=0; i<count; i++) {
+		HevMemoryBlock *block = (HevMemoryBlock *) (data + HEADER_SIZE);
+		*((uint32_t *) data) = index;
+		block->next = self->free_lists[index];
+		self->free_lists[index] = block;
+		data += block_size;
+	}
+
+	return true;
+}
+
+static inline void
+stats_inc (unsigned long *counter)
+{
+	/* owner thread only, the stats reader loads it from any thread */
+	__atomic_store_n (counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
 void *
 hev_memory_allocator_alloc (HevMemoryAllocator *self, size_t size)
 {
-	return malloc (size);
+	HevMemoryBlock *block;
+	unsigned int index;
+
+	if (CLASS_MAX < size) {
+		uint8_t *data = malloc (HEADER_SIZE + size);
+		if (!data)
+		  return NULL;
+		*((uint32_t *) data) = CLASS_LARGE;
+		stats_inc (&self->stats.large);
+		return data + HEADER_SIZE;
+	}
+
+	index = self->class_index[(size + CLASS_GRAIN - 1) / CLASS_GRAIN];
+	if (self->free_lists[index]) {
+		stats_inc (&self->stats.hits);
+	} else {
+		stats_inc (&self->stats.misses);
+		if (!hev_memory_allocator_refill (self, index))
+		  return NULL;
+	}
+
+	block = self->free_lists[index];
+	self->free_lists[index] = block->next;
+
+	return block;
 }
 
 void
 hev_memory_allocator_free (HevMemoryAllocator *self, void *ptr)
 {
-	free (ptr);
+	HevMemoryBlock *block = ptr;
+	uint32_t index;
+
+	if (!ptr)
+	  return;
+
+	index = *((uint32_t *) (((uint8_t *) ptr) - HEADER_SIZE));
+	if (CLASS_LARGE == index) {
+		free (((uint8_t *) ptr) - HEADER_SIZE);
+		return;
+	}
+
+	block->next = self->free_lists[index];
+	self->free_lists[index] = block;
+}
+
+void
+hev_memory_allocator_get_stats (HevMemoryAllocator *self,
+			HevMemoryAllocatorStats *stats)
+{
+	if (!self || !stats)
+	  return;
+
+	stats->hits = __atomic_load_n (&self->stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n (&self->stats.misses, __ATOMIC_RELAXED);
+	stats->large = __atomic_load_n (&self->stats.large, __ATOMIC_RELAXED);
 }
 
 void *
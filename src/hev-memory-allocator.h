@@ -21,10 +21,16 @@
 typedef void (*HevDestroyNotify) (void *data);
 
 typedef struct _HevMemoryAllocator HevMemoryAllocator;
+typedef struct _HevMemoryAllocatorStats HevMemoryAllocatorStats;
 
-struct _HevMemoryAllocator
+struct _HevMemoryAllocatorStats
 {
-	unsigned int ref_count;
+	/* served from a free list */
+	unsigned long hits;
+	/* free list empty, a new slab was carved */
+	unsigned long misses;
+	/* above the largest size class, passed to malloc */
+	unsigned long large;
 };
 
 HevMemoryAllocator * hev_memory_allocator_default (void);
@@ -37,6 +43,9 @@ void hev_memory_allocator_unref (HevMemoryAllocator *self);
 void * hev_memory_allocator_alloc (HevMemoryAllocator *self, size_t size);
 void hev_memory_allocator_free (HevMemoryAllocator *self, void *ptr);
 
+void hev_memory_allocator_get_stats (HevMemoryAllocator *self,
+			HevMemoryAllocatorStats *stats);
+
 void * hev_malloc (size_t size);
 void * hev_malloc0 (size_t size);
 void hev_free (void *ptr);